@@ -5,11 +5,14 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "int.h"
 #include "log.h"
 #include "common/bug.h"
+#include "common/err.h"
 #include "bfd.h"
 #include "common/list.h"
 #include "util.h"
@@ -25,31 +28,43 @@
  */
 #define BUFSIZE	(PAGE_SIZE)
 
+/*
+ * Images are written with many small entries, so writes go
+ * through bigger buffers to make fewer write() calls.
+ */
+#define WBUFSIZE	(16 * PAGE_SIZE)
+
 struct bfd_buf {
 	char *mem;
 	struct list_head l;
+	bool writable;
 };
 
 static LIST_HEAD(bufs);
+static LIST_HEAD(wbufs);
 
 #define BUFBATCH	(16)
+#define WBUFBATCH	(4)
 
-static int buf_get(struct xbuf *xb)
+static int buf_get(struct xbuf *xb, bool writable)
 {
+	struct list_head *pool = writable ? &wbufs : &bufs;
+	unsigned int size = writable ? WBUFSIZE : BUFSIZE;
+	int batch = writable ? WBUFBATCH : BUFBATCH;
 	struct bfd_buf *b;
 
-	if (list_empty(&bufs)) {
+	if (list_empty(pool)) {
 		void *mem;
 		int i;
 
-		mem = mmap(NULL, BUFBATCH * BUFSIZE, PROT_READ | PROT_WRITE,
+		mem = mmap(NULL, batch * size, PROT_READ | PROT_WRITE,
 				MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
 		if (mem == MAP_FAILED) {
 			pr_perror("No buf");
 			return -1;
 		}
 
-		for (i = 0; i < BUFBATCH; i++) {
+		for (i = 0; i < batch; i++) {
 			b = xmalloc(sizeof(*b));
 			if (!b) {
 				if (i == 0) {
@@ -61,12 +76,13 @@ static int buf_get(struct xbuf *xb)
 				break;
 			}
 
-			b->mem = mem + i * BUFSIZE;
-			list_add_tail(&b->l, &bufs);
+			b->mem = mem + i * size;
+			b->writable = writable;
+			list_add_tail(&b->l, pool);
 		}
 	}
 
-	b = list_first_entry(&bufs, struct bfd_buf, l);
+	b = list_first_entry(pool, struct bfd_buf, l);
 	list_del_init(&b->l);
 
 	xb->mem = b->mem;
@@ -82,7 +98,7 @@ static void buf_put(struct xbuf *xb)
 	 * Don't unmap buffer back, it will get reused
 	 * by next bfdopen call
 	 */
-	list_add(&xb->buf->l, &bufs);
+	list_add(&xb->buf->l, xb->buf->writable ? &wbufs : &bufs);
 	xb->buf = NULL;
 	xb->mem = NULL;
 	xb->data = NULL;
@@ -90,12 +106,13 @@ static void buf_put(struct xbuf *xb)
 
 static int bfdopen(struct bfd *f, bool writable)
 {
-	if (buf_get(&f->b)) {
+	if (buf_get(&f->b, writable)) {
 		close_safe(&f->fd);
 		return -1;
 	}
 
 	f->writable = writable;
+	f->mapped = false;
 	return 0;
 }
 
@@ -104,12 +121,65 @@ int bfdopenr(struct bfd *f)
 	return bfdopen(f, false);
 }
 
+/*
+ * Map the whole file instead of reading it into a buffer, so that
+ * bread_ptr() can give out its contents in place. Files which can't
+ * be mapped are read as usual.
+ */
+int bfdopenr_mmap(struct bfd *f)
+{
+	struct stat st;
+	void *mem;
+
+	if (fstat(f->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size == 0 || st.st_size > UINT_MAX)
+		return bfdopenr(f);
+
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+	if (mem == MAP_FAILED) {
+		pr_debug("Can't map file, reading it: %m\n");
+		return bfdopenr(f);
+	}
+
+	madvise(mem, st.st_size, MADV_SEQUENTIAL);
+
+	f->b.mem = mem;
+	f->b.data = mem;
+	f->b.sz = st.st_size;
+	f->b.buf = NULL;
+	f->writable = false;
+	f->mapped = true;
+	return 0;
+}
+
+static void bunmap(struct bfd *f)
+{
+	struct xbuf *b = &f->b;
+
+	munmap(b->mem, b->data - b->mem + b->sz);
+	b->mem = NULL;
+	b->data = NULL;
+	f->mapped = false;
+}
+
+/* Ask the kernel to read in the rest of a mapped file */
+void bprefetch(struct bfd *f)
+{
+	struct xbuf *b = &f->b;
+	char *start;
+
+	if (!bfd_mapped(f) || !b->sz)
+		return;
+
+	start = (char *)((unsigned long)b->data & PAGE_MASK);
+	madvise(start, b->data + b->sz - start, MADV_WILLNEED);
+}
+
 int bfdopenw(struct bfd *f)
 {
 	return bfdopen(f, true);
 }
 
-static int bflush(struct bfd *bfd);
 static bool flush_failed = false;
 
 int bfd_flush_images(void)
@@ -119,7 +189,9 @@ int bfd_flush_images(void)
 
 void bclose(struct bfd *f)
 {
-	if (bfd_buffered(f)) {
+	if (bfd_mapped(f))
+		bunmap(f);
+	else if (bfd_buffered(f)) {
 		if (f->writable && bflush(f) < 0) {
 			/*
 			 * This is to propagate error up. It's
@@ -142,6 +214,10 @@ static int brefill(struct bfd *f)
 	int ret;
 	struct xbuf *b = &f->b;
 
+	/* The whole file is already there */
+	if (bfd_mapped(f))
+		return 0;
+
 	memmove(b->mem, b->data, b->sz);
 	b->data = b->mem;
 
@@ -158,16 +234,6 @@ static int brefill(struct bfd *f)
 	return 1;
 }
 
-static char *strnchr(char *str, unsigned int len, char c)
-{
-	while (len > 0 && *str != c) {
-		str++;
-		len--;
-	}
-
-	return len == 0 ? NULL : str;
-}
-
 char *breadline(struct bfd *f)
 {
 	return breadchr(f, '\n');
@@ -180,8 +246,14 @@ char *breadchr(struct bfd *f, char c)
 	char *n;
 	unsigned int ss = 0;
 
+	if (bfd_mapped(f)) {
+		pr_err("Can't read lines from a mapped file\n");
+		return ERR_PTR(-EINVAL);
+	}
+
 again:
-	n = strnchr(b->data + ss, b->sz - ss, c);
+	/* memchr() is vectorized in libc, unlike a byte by byte loop */
+	n = memchr(b->data + ss, c, b->sz - ss);
 	if (n) {
 		char *ret;
 
@@ -234,7 +306,7 @@ again:
 	goto again;
 }
 
-static int bflush(struct bfd *bfd)
+int bflush(struct bfd *bfd)
 {
 	struct xbuf *b = &bfd->b;
 	int ret;
@@ -254,14 +326,14 @@ static int __bwrite(struct bfd *bfd, const void *buf, int size)
 {
 	struct xbuf *b = &bfd->b;
 
-	if (b->sz + size > BUFSIZE) {
+	if (b->sz + size > WBUFSIZE) {
 		int ret;
 		ret = bflush(bfd);
 		if (ret < 0)
 			return ret;
 	}
 
-	if (size > BUFSIZE)
+	if (size > WBUFSIZE)
 		return write(bfd->fd, buf, size);
 
 	memcpy(b->data + b->sz, buf, size);
@@ -277,6 +349,31 @@ int bwrite(struct bfd *bfd, const void *buf, int size)
 	return __bwrite(bfd, buf, size);
 }
 
+/*
+ * Returns room for @size bytes right in the buffer, so that the caller
+ * can put them there itself and then call bwrite_commit(). NULL means
+ * the bfd is not buffered or the bytes don't fit into a buffer, an
+ * error pointer that the buffered bytes could not be flushed.
+ */
+void *bwrite_reserve(struct bfd *bfd, int size)
+{
+	struct xbuf *b = &bfd->b;
+
+	if (!bfd_buffered(bfd) || size > WBUFSIZE)
+		return NULL;
+
+	if (b->sz + size > WBUFSIZE && bflush(bfd) < 0)
+		return ERR_PTR(-EIO);
+
+	return b->data + b->sz;
+}
+
+void bwrite_commit(struct bfd *bfd, int size)
+{
+	BUG_ON(bfd->b.sz + size > WBUFSIZE);
+	bfd->b.sz += size;
+}
+
 int bwritev(struct bfd *bfd, const struct iovec *iov, int cnt)
 {
 	int i, written = 0;
@@ -299,6 +396,26 @@ int bwritev(struct bfd *bfd, const struct iovec *iov, int cnt)
 	return written;
 }
 
+/*
+ * Returns the next @size bytes of a mapped file in place,
+ * or NULL if there are less of them left.
+ */
+void *bread_ptr(struct bfd *bfd, int size)
+{
+	struct xbuf *b = &bfd->b;
+	void *ret;
+
+	BUG_ON(!bfd_mapped(bfd));
+
+	if (size > b->sz)
+		return NULL;
+
+	ret = b->data;
+	b->data += size;
+	b->sz -= size;
+	return ret;
+}
+
 int bread(struct bfd *bfd, void *buf, int size)
 {
 	struct xbuf *b = &bfd->b;
@@ -274,6 +274,7 @@ void init_opts(void)
 	opts.cpu_cap = CPU_CAP_DEFAULT;
 	opts.manage_cgroups = CG_MODE_DEFAULT;
 	opts.ps_socket = -1;
+	opts.ps_connections = 1;
 	opts.ghost_limit = DEFAULT_GHOST_LIMIT;
 	opts.timeout = DEFAULT_TIMEOUT;
 	opts.empty_ns = 0;
@@ -530,6 +531,8 @@ int parse_options(int argc, char **argv, bool *usage_error,
 		{ "verbosity",			optional_argument,	0, 'v'	},
 		{ "ps-socket",			required_argument,	0, 1091},
 		BOOL_OPT("stream", &opts.stream),
+		BOOL_OPT("compress", &opts.compress),
+		BOOL_OPT("hash-pages", &opts.hash_pages),
 		{ "config",			required_argument,	0, 1089},
 		{ "no-default-config",		no_argument,		0, 1090},
 		{ "tls-cacert",			required_argument,	0, 1092},
@@ -541,6 +544,16 @@ int parse_options(int argc, char **argv, bool *usage_error,
 		{ "cgroup-yard",		required_argument,	0, 1096 },
 		{ "pre-dump-mode",		required_argument,	0, 1097},
 		{ "file-validation",		required_argument,	0, 1098	},
+		{ "mem-dump-workers",		required_argument,	0, 1099	},
+		{ "ps-connections",		required_argument,	0, 1100	},
+		{ "pre-dump-iters",		required_argument,	0, 1101	},
+		{ "pre-dump-downtime",		required_argument,	0, 1102	},
+		{ "lazy-pages-workers",		required_argument,	0, 1103	},
+		{ "mem-restore-workers",	required_argument,	0, 1104	},
+		{ "trace-file",			required_argument,	0, 1105	},
+		BOOL_OPT("mem-dump-pipeline", &opts.mem_dump_pipeline),
+		BOOL_OPT("io-uring", &opts.io_uring),
+		BOOL_OPT("mmap-images", &opts.mmap_images),
 		{ },
 	};
 
@@ -870,6 +883,39 @@ int parse_options(int argc, char **argv, bool *usage_error,
 			if (parse_file_validation_method(&opts, optarg))
 				return 2;
 			break;
+		case 1099:
+			opts.mem_dump_workers = atoi(optarg);
+			if (opts.mem_dump_workers < 0)
+				goto bad_arg;
+			break;
+		case 1100:
+			opts.ps_connections = atoi(optarg);
+			if (opts.ps_connections < 1)
+				goto bad_arg;
+			break;
+		case 1101:
+			opts.pre_dump_iters = atoi(optarg);
+			if (opts.pre_dump_iters < 0)
+				goto bad_arg;
+			break;
+		case 1102:
+			opts.pre_dump_downtime = atoi(optarg);
+			if (opts.pre_dump_downtime < 0)
+				goto bad_arg;
+			break;
+		case 1103:
+			opts.lazy_pages_workers = atoi(optarg);
+			if (opts.lazy_pages_workers < 0)
+				goto bad_arg;
+			break;
+		case 1104:
+			opts.mem_restore_workers = atoi(optarg);
+			if (opts.mem_restore_workers < 0)
+				goto bad_arg;
+			break;
+		case 1105:
+			SET_CHAR_OPTS(trace_file, optarg);
+			break;
 		case 'V':
 			pr_msg("Version: %s\n", CRIU_VERSION);
 			if (strcmp(CRIU_GITID, "0"))
@@ -931,6 +977,102 @@ int check_options(void)
 		}
 	}
 
+	if (opts.ps_connections > 1 &&
+	    (opts.tls || opts.ps_socket != -1 || opts.lazy_pages)) {
+		pr_warn("--ps-connections is ignored together with "
+			"--tls, --ps-socket or --lazy-pages\n");
+		opts.ps_connections = 1;
+	}
+
+	if (opts.mem_dump_workers && opts.stream) {
+		pr_warn("Memory dump workers can't stream images, "
+			"--mem-dump-workers is ignored\n");
+		opts.mem_dump_workers = 0;
+	}
+
+	if (opts.mem_dump_workers && opts.use_page_server &&
+	    opts.ps_connections < 2) {
+		pr_warn("Memory dump workers need --ps-connections to "
+			"use the page server, --mem-dump-workers is ignored\n");
+		opts.mem_dump_workers = 0;
+	}
+
+	if (opts.compress && (opts.use_page_server || opts.stream)) {
+		pr_warn("Only local pages images can be compressed, "
+			"--compress is ignored\n");
+		opts.compress = 0;
+	}
+
+	if (opts.hash_pages && (opts.use_page_server || opts.stream ||
+				opts.lazy_pages)) {
+		pr_warn("Only local pages images can be hashed, "
+			"--hash-pages is ignored\n");
+		opts.hash_pages = 0;
+	}
+
+	if (opts.hash_pages && opts.compress) {
+		pr_err("--hash-pages can't be used with --compress\n");
+		return 1;
+	}
+
+	/*
+	 * Chunk writers are forked, so the state kept in memory by
+	 * these xfers would be lost between chunks.
+	 */
+	if (opts.mem_dump_pipeline &&
+	    (opts.use_page_server ? opts.tls :
+	     (opts.compress || opts.hash_pages || opts.auto_dedup))) {
+		pr_warn("--mem-dump-pipeline is ignored together with "
+			"--tls, --compress, --hash-pages or --auto-dedup\n");
+		opts.mem_dump_pipeline = 0;
+	}
+
+	/*
+	 * Pre-dump iterations go into subdirectories of the images
+	 * dir, neither page server nor image streamer can do that.
+	 */
+	if (opts.pre_dump_iters && (opts.use_page_server || opts.stream)) {
+		pr_warn("--pre-dump-iters is ignored together with "
+			"--page-server or --stream\n");
+		opts.pre_dump_iters = 0;
+	}
+
+	/* A page server connection can't be shared between workers */
+	if (opts.lazy_pages_workers > 1 && opts.use_page_server) {
+		pr_warn("--lazy-pages-workers is ignored together with "
+			"--page-server\n");
+		opts.lazy_pages_workers = 0;
+	}
+
+	/* There are no files to read ahead from the streamer */
+	if (opts.mem_restore_workers && opts.stream) {
+		pr_warn("--mem-restore-workers is ignored together with --stream\n");
+		opts.mem_restore_workers = 0;
+	}
+
+	/* Images come from a pipe, there is nothing to map */
+	if (opts.mmap_images && opts.stream) {
+		pr_warn("--mmap-images is ignored together with --stream\n");
+		opts.mmap_images = 0;
+	}
+
+	if (opts.pre_dump_downtime && !opts.pre_dump_iters)
+		pr_warn("--pre-dump-downtime is ignored without --pre-dump-iters\n");
+
+#ifndef CONFIG_HAS_LZ4
+	if (opts.compress) {
+		pr_err("CRIU was built without LZ4 support\n");
+		return 1;
+	}
+#endif
+
+#ifndef CONFIG_HAS_LIBURING
+	if (opts.io_uring) {
+		pr_err("CRIU was built without io_uring support\n");
+		return 1;
+	}
+#endif
+
 #ifndef CONFIG_GNUTLS
 	if (opts.tls) {
 		pr_err("CRIU was built without TLS support\n");
@@ -50,6 +50,7 @@
 #include "net.h"
 #include "restorer.h"
 #include "uffd.h"
+#include "page-uring.h"
 
 static char *feature_name(int (*func)(void));
 
@@ -1234,6 +1235,28 @@ static int check_clone3_set_tid(void)
 	return 0;
 }
 
+static int check_compress(void)
+{
+#ifdef CONFIG_HAS_LZ4
+	return 0;
+#else
+	pr_warn("CRIU built without LZ4 - can't compress pages images\n");
+	return -1;
+#endif
+}
+
+static int check_io_uring(void)
+{
+	struct page_uring *pu;
+
+	pu = page_uring_open();
+	if (!pu)
+		return -1;
+
+	page_uring_close(pu);
+	return 0;
+}
+
 static int check_can_map_vdso(void)
 {
 	if (kdat_can_map_vdso() == 1)
@@ -1499,6 +1522,8 @@ static struct feature_list feature_list[] = {
 	{ "timens", check_time_namespace},
 	{ "external_net_ns", check_external_net_ns},
 	{ "clone3_set_tid", check_clone3_set_tid},
+	{ "compress", check_compress},
+	{ "io_uring", check_io_uring},
 	{ NULL, NULL },
 };
 
@@ -17,6 +17,11 @@ int cr_dedup(void)
 	DIR * dirp;
 	struct dirent *ent;
 
+	if (parent_has_dup_pages()) {
+		pr_err("Previous images share pages, they can't be deduplicated\n");
+		return -1;
+	}
+
 	dirp = opendir(CR_PARENT_LINK);
 	if (dirp == NULL) {
 		pr_perror("Can't enter previous snapshot folder, error=%d", errno);
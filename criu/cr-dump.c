@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include <fcntl.h>
 
@@ -29,6 +30,7 @@
 #include "images/file-lock.pb-c.h"
 #include "images/rlimit.pb-c.h"
 #include "images/siginfo.pb-c.h"
+#include "images/stats.pb-c.h"
 
 #include "common/list.h"
 #include "imgset.h"
@@ -61,6 +63,7 @@
 #include "cgroup-props.h"
 #include "file-lock.h"
 #include "page-xfer.h"
+#include "page-compress.h"
 #include "kerndat.h"
 #include "stats.h"
 #include "mem.h"
@@ -83,6 +86,7 @@
 #include "memfd.h"
 #include "timens.h"
 #include "img-streamer.h"
+#include "trace-event.h"
 
 /*
  * Architectures can overwrite this function to restore register sets that
@@ -1144,6 +1148,7 @@ static int pre_dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie
 	int ret = -1;
 	struct parasite_dump_misc misc;
 	struct mem_dump_ctl mdc;
+	struct trace_span span;
 
 	vm_area_list_init(&vmas);
 
@@ -1159,14 +1164,18 @@ static int pre_dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie
 	if (item->pid->state == TASK_DEAD)
 		return 0;
 
+	trace_span_start(&span, "collect mappings", "task", pid);
 	ret = collect_mappings(pid, &vmas, NULL);
+	trace_span_end(&span);
 	if (ret) {
 		pr_err("Collect mappings (pid: %d) failed with %d\n", pid, ret);
 		goto err;
 	}
 
 	ret = -1;
+	trace_span_start(&span, "infect", "task", pid);
 	parasite_ctl = parasite_infect_seized(pid, item, &vmas);
+	trace_span_end(&span);
 	if (!parasite_ctl) {
 		pr_err("Can't infect (pid: %d) with parasite\n", pid);
 		goto err_free;
@@ -1197,7 +1206,9 @@ static int pre_dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie
 	mdc.stat = NULL;
 	mdc.parent_ie = parent_ie;
 
+	trace_span_start(&span, "pages", "task", pid);
 	ret = parasite_dump_pages_seized(item, &vmas, &mdc, parasite_ctl);
+	trace_span_end(&span);
 	if (ret)
 		goto err_cure;
 
@@ -1225,6 +1236,7 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 	struct parasite_drain_fd *dfds = NULL;
 	struct proc_posix_timers_stat proc_args;
 	struct mem_dump_ctl mdc;
+	struct trace_span span;
 
 	vm_area_list_init(&vmas);
 
@@ -1243,7 +1255,9 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 	if (ret < 0)
 		goto err;
 
+	trace_span_start(&span, "collect mappings", "task", pid);
 	ret = collect_mappings(pid, &vmas, dump_filemap);
+	trace_span_end(&span);
 	if (ret) {
 		pr_err("Collect mappings (pid: %d) failed with %d\n", pid, ret);
 		goto err;
@@ -1254,7 +1268,9 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 		if (!dfds)
 			goto err;
 
+		trace_span_start(&span, "collect fds", "task", pid);
 		ret = collect_fds(pid, &dfds);
+		trace_span_end(&span);
 		if (ret) {
 			pr_err("Collect fds (pid: %d) failed with %d\n", pid, ret);
 			goto err;
@@ -1277,7 +1293,9 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 		goto err;
 	}
 
+	trace_span_start(&span, "infect", "task", pid);
 	parasite_ctl = parasite_infect_seized(pid, item, &vmas);
+	trace_span_end(&span);
 	if (!parasite_ctl) {
 		pr_err("Can't infect (pid: %d) with parasite\n", pid);
 		goto err;
@@ -1344,7 +1362,9 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 	}
 
 	if (dfds) {
+		trace_span_start(&span, "files", "task", pid);
 		ret = dump_task_files_seized(parasite_ctl, item, dfds);
+		trace_span_end(&span);
 		if (ret) {
 			pr_err("Dump files (pid: %d) failed with %d\n", pid, ret);
 			goto err_cure;
@@ -1361,7 +1381,9 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 	mdc.stat = &pps_buf;
 	mdc.parent_ie = parent_ie;
 
+	trace_span_start(&span, "pages", "task", pid);
 	ret = parasite_dump_pages_seized(item, &vmas, &mdc, parasite_ctl);
+	trace_span_end(&span);
 	if (ret)
 		goto err_cure;
 
@@ -1383,7 +1405,9 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 		goto err_cure;
 	}
 
+	trace_span_start(&span, "core", "task", pid);
 	ret = dump_task_core_all(parasite_ctl, item, &pps_buf, cr_imgset, &misc);
+	trace_span_end(&span);
 	if (ret) {
 		pr_err("Dump core (pid: %d) failed with %d\n", pid, ret);
 		goto err_cure;
@@ -1395,7 +1419,9 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 		goto err_cure;
 	}
 
+	trace_span_start(&span, "threads", "task", pid);
 	ret = dump_task_threads(parasite_ctl, item);
+	trace_span_end(&span);
 	if (ret) {
 		pr_err("Can't dump threads\n");
 		goto err_cure;
@@ -1405,16 +1431,20 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 	 * On failure local map will be cured in cr_dump_finish()
 	 * for lazy pages.
 	 */
+	trace_span_start(&span, "cure", "task", pid);
 	if (opts.lazy_pages)
 		ret = compel_cure_remote(parasite_ctl);
 	else
 		ret = compel_cure(parasite_ctl);
+	trace_span_end(&span);
 	if (ret) {
 		pr_err("Can't cure (pid: %d) from parasite\n", pid);
 		goto err;
 	}
 
+	trace_span_start(&span, "mm", "task", pid);
 	ret = dump_task_mm(pid, &pps_buf, &misc, &vmas, cr_imgset);
+	trace_span_end(&span);
 	if (ret) {
 		pr_err("Dump mappings (pid: %d) failed with %d\n", pid, ret);
 		goto err;
@@ -1479,10 +1509,17 @@ static int setup_alarm_handler(void)
 	return 0;
 }
 
+/*
+ * Spans from the end of collect_pstree() till the tasks are let go,
+ * it's started in one function and ended in another.
+ */
+static struct trace_span frozen_span;
+
 static int cr_pre_dump_finish(int status)
 {
 	InventoryEntry he = INVENTORY_ENTRY__INIT;
 	struct pstree_item *item;
+	struct trace_span span;
 	int ret;
 
 	/*
@@ -1500,9 +1537,12 @@ static int cr_pre_dump_finish(int status)
 	he.has_pre_dump_mode = true;
 	he.pre_dump_mode = opts.pre_dump_mode;
 
+	inventory_mark_dup_pages(&he);
+
 	pstree_switch_state(root_item, TASK_ALIVE);
 
 	timing_stop(TIME_FROZEN);
+	trace_span_end(&frozen_span);
 
 	if (status < 0) {
 		ret = status;
@@ -1519,6 +1559,7 @@ static int cr_pre_dump_finish(int status)
 			continue;
 
 		pr_info("\tPre-dumping %d\n", vpid(item));
+		trace_span_start(&span, "memwrite", "task", item->pid->real);
 		timing_start(TIME_MEMWRITE);
 		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, vpid(item));
 		if (ret < 0)
@@ -1540,6 +1581,7 @@ static int cr_pre_dump_finish(int status)
 			goto err;
 
 		timing_stop(TIME_MEMWRITE);
+		trace_span_end(&span);
 
 		destroy_page_pipe(mem_pp);
 		if (compel_cure_local(ctl))
@@ -1558,7 +1600,7 @@ err:
 	if (disconnect_from_page_server())
 		ret = -1;
 
-	if (bfd_flush_images())
+	if (bfd_flush_images() || page_compress_failed())
 		ret = -1;
 
 	if (write_img_inventory(&he))
@@ -1570,6 +1612,7 @@ err:
 		write_stats(DUMP_STATS);
 		pr_info("Pre-dumping finished successfully\n");
 	}
+	trace_close();
 	return ret;
 }
 
@@ -1577,6 +1620,7 @@ int cr_pre_dump_tasks(pid_t pid)
 {
 	InventoryEntry *parent_ie = NULL;
 	struct pstree_item *item;
+	struct trace_span span;
 	int ret = -1;
 
 	/*
@@ -1602,6 +1646,9 @@ int cr_pre_dump_tasks(pid_t pid)
 	if (init_stats(DUMP_STATS))
 		goto err;
 
+	if (opts.trace_file && trace_open(opts.trace_file))
+		goto err;
+
 	if (cr_plugin_init(CR_PLUGIN_STAGE__PRE_DUMP))
 		goto err;
 
@@ -1623,21 +1670,29 @@ int cr_pre_dump_tasks(pid_t pid)
 	if (setup_alarm_handler())
 		goto err;
 
+	trace_span_start(&span, "collect pstree", "dump", 0);
 	if (collect_pstree())
 		goto err;
+	trace_span_end(&span);
+	trace_span_start(&frozen_span, "frozen", "dump", 0);
 
 	if (collect_pstree_ids_predump())
 		goto err;
 
+	trace_span_start(&span, "collect namespaces", "dump", 0);
 	if (collect_namespaces(false) < 0)
 		goto err;
+	trace_span_end(&span);
 
 	/* Errors handled later in detect_pid_reuse */
 	parent_ie = get_parent_inventory();
 
-	for_each_pstree_item(item)
+	for_each_pstree_item(item) {
+		trace_span_start(&span, "pre-dump task", "task", item->pid->real);
 		if (pre_dump_one_task(item, parent_ie))
 			goto err;
+		trace_span_end(&span);
+	}
 
 	if (parent_ie) {
 		inventory_entry__free_unpacked(parent_ie, NULL);
@@ -1687,12 +1742,15 @@ static int cr_dump_finish(int ret)
 {
 	int post_dump_ret = 0;
 
+	if (wait_mem_dump_workers())
+		ret = -1;
+
 	if (disconnect_from_page_server())
 		ret = -1;
 
 	close_cr_imgset(&glob_imgset);
 
-	if (bfd_flush_images())
+	if (bfd_flush_images() || page_compress_failed())
 		ret = -1;
 
 	cr_plugin_fini(CR_PLUGIN_STAGE__DUMP, ret);
@@ -1752,6 +1810,7 @@ static int cr_dump_finish(int ret)
 			    (ret || post_dump_ret) ?
 			    TASK_ALIVE : opts.final_state);
 	timing_stop(TIME_FROZEN);
+	trace_span_end(&frozen_span);
 	free_pstree(root_item);
 	seccomp_free_entries();
 	free_file_locks();
@@ -1768,6 +1827,7 @@ static int cr_dump_finish(int ret)
 		write_stats(DUMP_STATS);
 		pr_info("Dumping finished successfully\n");
 	}
+	trace_close();
 	return post_dump_ret ? : (ret != 0);
 }
 
@@ -1776,6 +1836,7 @@ int cr_dump_tasks(pid_t pid)
 	InventoryEntry he = INVENTORY_ENTRY__INIT;
 	InventoryEntry *parent_ie = NULL;
 	struct pstree_item *item;
+	struct trace_span span;
 	int pre_dump_ret = 0;
 	int ret = -1;
 
@@ -1803,6 +1864,9 @@ int cr_dump_tasks(pid_t pid)
 	if (init_stats(DUMP_STATS))
 		goto err;
 
+	if (opts.trace_file && trace_open(opts.trace_file))
+		goto err;
+
 	if (cr_plugin_init(CR_PLUGIN_STAGE__DUMP))
 		goto err;
 
@@ -1847,8 +1911,11 @@ int cr_dump_tasks(pid_t pid)
 	 * afterwards.
 	 */
 
+	trace_span_start(&span, "collect pstree", "dump", 0);
 	if (collect_pstree())
 		goto err;
+	trace_span_end(&span);
+	trace_span_start(&frozen_span, "frozen", "dump", 0);
 
 	if (collect_pstree_ids())
 		goto err;
@@ -1859,8 +1926,10 @@ int cr_dump_tasks(pid_t pid)
 	if (collect_file_locks())
 		goto err;
 
+	trace_span_start(&span, "collect namespaces", "dump", 0);
 	if (collect_namespaces(true) < 0)
 		goto err;
+	trace_span_end(&span);
 
 	glob_imgset = cr_glob_imgset_open(O_DUMP);
 	if (!glob_imgset)
@@ -1873,8 +1942,10 @@ int cr_dump_tasks(pid_t pid)
 	parent_ie = get_parent_inventory();
 
 	for_each_pstree_item(item) {
+		trace_span_start(&span, "dump task", "task", item->pid->real);
 		if (dump_one_task(item, parent_ie))
 			goto err;
+		trace_span_end(&span);
 	}
 
 	if (parent_ie) {
@@ -1892,8 +1963,10 @@ int cr_dump_tasks(pid_t pid)
 		goto err;
 
 	/* MNT namespaces are dumped after files to save remapped links */
+	trace_span_start(&span, "dump mount namespaces", "dump", 0);
 	if (dump_mnt_namespaces() < 0)
 		goto err;
+	trace_span_end(&span);
 
 	if (dump_file_locks())
 		goto err;
@@ -1913,14 +1986,18 @@ int cr_dump_tasks(pid_t pid)
 	 * ipc shared memory, but an ipc namespace is dumped in a child
 	 * process.
 	 */
+	trace_span_start(&span, "dump shmem", "dump", 0);
 	ret = cr_dump_shmem();
 	if (ret)
 		goto err;
+	trace_span_end(&span);
 
 	if (root_ns_mask) {
+		trace_span_start(&span, "dump namespaces", "dump", 0);
 		ret = dump_namespaces(root_item, root_ns_mask);
 		if (ret)
 			goto err;
+		trace_span_end(&span);
 	}
 
 	if ((root_ns_mask & CLONE_NEWTIME) == 0) {
@@ -1929,9 +2006,11 @@ int cr_dump_tasks(pid_t pid)
 			goto err;
 	}
 
+	trace_span_start(&span, "dump cgroups", "dump", 0);
 	ret = dump_cgroups();
 	if (ret)
 		goto err;
+	trace_span_end(&span);
 
 	ret = fix_external_unix_sockets();
 	if (ret)
@@ -1956,3 +2035,165 @@ err:
 
 	return cr_dump_finish(ret);
 }
+
+/*
+ * Iterative migration: pre-dump into pre-1, pre-2, ... subdirectories
+ * of the images dir, each on top of the previous one, and then do the
+ * final dump on top of the last of them. With memory tracking each
+ * iteration writes only the pages dirtied since the previous one, so
+ * the final dump (the only one keeping the tree frozen while writing
+ * pages) is as short as the last pre-dump iteration.
+ */
+
+#define PRE_DUMP_DIR		"pre-%d"
+
+/*
+ * Iterations stop once the dirty set shrinks by less than 10%, more
+ * of them wouldn't make the final dump noticeably shorter.
+ */
+#define PRE_DUMP_CONVERGED	90
+
+static int pre_dump_iteration(pid_t pid, int iter)
+{
+	char dir[PATH_MAX], parent[PATH_MAX];
+	int status;
+	pid_t child;
+
+	snprintf(dir, sizeof(dir), PRE_DUMP_DIR, iter);
+	if (mkdirat(get_service_fd(IMG_FD_OFF), dir, 0700) && errno != EEXIST) {
+		pr_perror("Can't create %s", dir);
+		return -1;
+	}
+
+	child = fork();
+	if (child < 0) {
+		pr_perror("Can't fork pre-dump");
+		return -1;
+	}
+
+	if (child == 0) {
+		/* Parent links are resolved relative to the pre-N dir */
+		if (iter > 1) {
+			snprintf(parent, sizeof(parent), "../" PRE_DUMP_DIR, iter - 1);
+			SET_CHAR_OPTS(img_parent, parent);
+		} else if (opts.img_parent && opts.img_parent[0] != '/') {
+			snprintf(parent, sizeof(parent), "../%s", opts.img_parent);
+			SET_CHAR_OPTS(img_parent, parent);
+		}
+
+		snprintf(dir, sizeof(dir), "/proc/self/fd/%d/" PRE_DUMP_DIR,
+			 get_service_fd(IMG_FD_OFF), iter);
+		if (open_image_dir(dir, O_DUMP))
+			exit(1);
+
+		opts.lazy_pages = false;
+		exit(cr_pre_dump_tasks(pid) ? 1 : 0);
+	}
+
+	if (waitpid(child, &status, 0) != child) {
+		pr_perror("Unable to wait %d", child);
+		return -1;
+	}
+
+	if (status) {
+		pr_err("Pre-dump iteration %d failed (%d)\n", iter, status);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pre-dump leaves its stats in the work dir, they are read back
+ * to see how many pages were dirtied by the tree this time.
+ */
+static int pre_dump_read_stats(u64 *written, u64 *downtime)
+{
+	struct cr_img *img;
+	StatsEntry *se;
+	int ret;
+
+	img = open_image_at(AT_FDCWD, CR_FD_STATS, O_RSTR, "dump");
+	if (!img)
+		return -1;
+
+	if (empty_image(img)) {
+		pr_err("No stats after pre-dump\n");
+		close_image(img);
+		return -1;
+	}
+
+	ret = pb_read_one(img, &se, PB_STATS);
+	close_image(img);
+	if (ret < 0)
+		return -1;
+
+	if (!se->dump) {
+		pr_err("No dump stats after pre-dump\n");
+		stats_entry__free_unpacked(se, NULL);
+		return -1;
+	}
+
+	*written = se->dump->pages_written + se->dump->shpages_written;
+	/*
+	 * The final dump keeps the tree frozen both while draining the
+	 * dirty pages and while writing them.
+	 */
+	*downtime = (u64)se->dump->frozen_time + se->dump->memwrite_time;
+
+	stats_entry__free_unpacked(se, NULL);
+	return 0;
+}
+
+int cr_iterative_dump_tasks(pid_t pid)
+{
+	u64 written, prev_written = 0, downtime;
+	char parent[PATH_MAX];
+	int iter, dfd;
+
+	for (iter = 1; iter <= opts.pre_dump_iters; iter++) {
+		if (pre_dump_iteration(pid, iter))
+			return -1;
+
+		if (pre_dump_read_stats(&written, &downtime))
+			return -1;
+
+		pr_info("Pre-dump iteration %d: %"PRIu64" pages written, "
+			"%"PRIu64" us expected downtime\n", iter, written, downtime);
+
+		if (opts.pre_dump_downtime &&
+		    downtime <= (u64)opts.pre_dump_downtime * 1000) {
+			pr_info("Downtime budget of %d ms is met\n",
+				opts.pre_dump_downtime);
+			break;
+		}
+
+		if (iter > 1 && written * 100 >= prev_written * PRE_DUMP_CONVERGED) {
+			pr_info("Dirty pages converged at %"PRIu64"\n", written);
+			break;
+		}
+
+		prev_written = written;
+	}
+
+	if (iter > opts.pre_dump_iters)
+		iter = opts.pre_dump_iters;
+
+	snprintf(parent, sizeof(parent), PRE_DUMP_DIR, iter);
+	SET_CHAR_OPTS(img_parent, parent);
+	opts.track_mem = true;
+
+	dfd = get_service_fd(IMG_FD_OFF);
+	if (unlinkat(dfd, CR_PARENT_LINK, 0) && errno != ENOENT) {
+		pr_perror("Can't remove parent snapshot link");
+		return -1;
+	}
+
+	if (symlinkat(opts.img_parent, dfd, CR_PARENT_LINK)) {
+		pr_perror("Can't link parent snapshot");
+		return -1;
+	}
+
+	pr_info("Dumping on top of %d pre-dump iterations\n", iter);
+	return cr_dump_tasks(pid);
+}
@@ -50,6 +50,7 @@
 #include "uffd.h"
 #include "namespaces.h"
 #include "mem.h"
+#include "page-prefetch.h"
 #include "mount.h"
 #include "fsnotify.h"
 #include "pstree.h"
@@ -202,6 +203,7 @@ static int restore_wait_other_tasks(void)
 
 static inline void __restore_switch_stage_nw(int next_stage)
 {
+	timing_stage(next_stage);
 	futex_set(&task_entries->nr_in_progress,
 			stage_participants(next_stage));
 	futex_set(&task_entries->start, next_stage);
@@ -209,6 +211,7 @@ static inline void __restore_switch_stage_nw(int next_stage)
 
 static inline void __restore_switch_stage(int next_stage)
 {
+	timing_stage(next_stage);
 	if (next_stage != CR_STATE_COMPLETE)
 		futex_set(&task_entries->nr_in_progress,
 				stage_participants(next_stage));
@@ -431,6 +434,23 @@ static rt_sigaction_t parent_act[SIGMAX];
 #ifdef CONFIG_COMPAT
 static rt_sigaction_t_compat parent_act_compat[SIGMAX];
 #endif
+/*
+ * Set once the task has restored its sigactions, so that children
+ * forked before that know their parent_act* are not what they have.
+ */
+static bool sigactions_restored;
+
+static void invalidate_parent_act(void)
+{
+	int sig;
+
+	for (sig = 0; sig < SIGMAX; sig++) {
+		parent_act[sig].rt_sa_mask.sig[0] |= 1 << SIGKILL;
+#ifdef CONFIG_COMPAT
+		parent_act_compat[sig].rt_sa_mask.sig[0] |= 1 << SIGKILL;
+#endif
+	}
+}
 
 static bool sa_inherited(int sig, rt_sigaction_t *sa)
 {
@@ -684,6 +704,9 @@ static int prepare_sigactions(CoreEntry *core)
 		stack32 = NULL;
 	}
 
+	if (ret >= 0)
+		sigactions_restored = true;
+
 	return ret;
 }
 
@@ -901,8 +924,10 @@ static int restore_one_alive_task(int pid, CoreEntry *core)
 
 	memzero(ta, args_len);
 
+	task_timing_start(current, TASK_TIME_FILES);
 	if (prepare_fds(current))
 		return -1;
+	task_timing_stop(current, TASK_TIME_FILES);
 
 	if (prepare_file_locks(pid))
 		return -1;
@@ -1361,6 +1386,40 @@ static int set_next_pid(void *arg)
 	return 0;
 }
 
+/*
+ * The root task's core is read by criu, other tasks read theirs right
+ * after clone() rather than have the parent read the cores of all its
+ * children one after another. Nobody looks at the state of a task set
+ * here before the task passes the CR_STATE_FORKING stage.
+ */
+static int open_task_core(struct pstree_item *item, CoreEntry **core)
+{
+	if (open_core(vpid(item), core))
+		return -1;
+
+	if (check_core(*core, item))
+		return -1;
+
+	item->pid->state = (*core)->tc->task_state;
+	rsti(item)->cg_set = (*core)->tc->cg_set;
+
+	if (item->pid->state != TASK_DEAD && !task_alive(item)) {
+		pr_err("Unknown task state %d\n", item->pid->state);
+		return -1;
+	}
+
+	/*
+	 * By default we assume that seccomp is not
+	 * used at all (especially on dead task). Later
+	 * we will walk over all threads and check in
+	 * details if filter is present setting up
+	 * this flag as appropriate.
+	 */
+	rsti(item)->has_seccomp = false;
+
+	return 0;
+}
+
 static inline int fork_with_pid(struct pstree_item *item)
 {
 	unsigned long clone_flags;
@@ -1370,31 +1429,13 @@ static inline int fork_with_pid(struct pstree_item *item)
 	pid_t pid = vpid(item);
 
 	if (item->pid->state != TASK_HELPER) {
-		if (open_core(pid, &ca.core))
-			return -1;
-
-		if (check_core(ca.core, item))
-			return -1;
-
-		item->pid->state = ca.core->tc->task_state;
-		rsti(item)->cg_set = ca.core->tc->cg_set;
-
-		if (item->pid->state != TASK_DEAD && !task_alive(item)) {
-			pr_err("Unknown task state %d\n", item->pid->state);
-			return -1;
-		}
-
-		/*
-		 * By default we assume that seccomp is not
-		 * used at all (especially on dead task). Later
-		 * we will walk over all threads and check in
-		 * details if filter is present setting up
-		 * this flag as appropriate.
-		 */
-		rsti(item)->has_seccomp = false;
+		ca.core = NULL;
+		if (unlikely(item == root_item)) {
+			if (open_task_core(item, &ca.core))
+				return -1;
 
-		if (unlikely(item == root_item))
 			maybe_clone_parent(item, &ca);
+		}
 	} else {
 		/*
 		 * Helper entry will not get moved around and thus
@@ -1542,6 +1583,9 @@ static void sigchld_handler(int signal, siginfo_t *siginfo, void *data)
 		if (pid <= 0)
 			return;
 
+		if (pages_prefetch_reaped(pid, status))
+			continue;
+
 		if (!current && WIFSTOPPED(status) &&
 					WSTOPSIG(status) == SIGCHLD) {
 			/* The root task is ptraced. Allow it to handle SIGCHLD */
@@ -1740,16 +1784,58 @@ static int mount_proc(void)
  * their pid. Thus sid-s restore is tied with children creation.
  */
 
-static int create_children_and_session(void)
+/*
+ * Children that share no private vmas with us don't need our memory,
+ * so they are forked before it is restored. They then restore their
+ * own memory along with us, and the fork doesn't have to copy page
+ * tables of our restored memory.
+ */
+static bool may_fork_early(struct pstree_item *child)
+{
+	if (fault_injected(FI_RESTORE_ROOT_ONLY))
+		return false;
+
+	return !task_inherits_vmas(child);
+}
+
+/* Our sid can only be restored once all alien children are forked */
+static bool sid_restored_early(void)
+{
+	struct pstree_item *child;
+
+	list_for_each_entry(child, &current->children, sibling)
+		if (restore_before_setsid(child) && !may_fork_early(child))
+			return false;
+
+	return true;
+}
+
+static bool forked_early(struct pstree_item *child)
+{
+	if (!may_fork_early(child))
+		return false;
+
+	return restore_before_setsid(child) || sid_restored_early();
+}
+
+/*
+ * Called twice, before the memory of the task is restored and after
+ * it, each time forking the children forked_early() tells about.
+ */
+static int create_children_and_session(bool early)
 {
 	int ret;
 	struct pstree_item *child;
 
-	pr_info("Restoring children in alien sessions:\n");
+	pr_info("Restoring children in alien sessions%s:\n",
+		early ? " early" : "");
 	list_for_each_entry(child, &current->children, sibling) {
 		if (!restore_before_setsid(child))
 			continue;
 
+		if (forked_early(child) != early)
+			continue;
+
 		BUG_ON(child->born_sid != -1 && getsid(0) != child->born_sid);
 
 		ret = fork_with_pid(child);
@@ -1757,14 +1843,18 @@ static int create_children_and_session(void)
 			return ret;
 	}
 
-	if (current->parent)
+	if (current->parent && sid_restored_early() == early)
 		restore_sid();
 
-	pr_info("Restoring children in our session:\n");
+	pr_info("Restoring children in our session%s:\n",
+		early ? " early" : "");
 	list_for_each_entry(child, &current->children, sibling) {
 		if (restore_before_setsid(child))
 			continue;
 
+		if (forked_early(child) != early)
+			continue;
+
 		ret = fork_with_pid(child);
 		if (ret < 0)
 			return ret;
@@ -1812,6 +1902,19 @@ static int restore_task_with_children(void *_arg)
 	if (log_init_by_pid(vpid(current)))
 		return -1;
 
+	/*
+	 * Forked before the parent restored its sigactions, e.g. early
+	 * or by a helper, we have what criu or the grandparent had, not
+	 * what parent_act* says, so none of ours can be inherited.
+	 */
+	if (!sigactions_restored)
+		invalidate_parent_act();
+	sigactions_restored = false;
+
+	if (current->pid->state != TASK_HELPER && !ca->core &&
+	    open_task_core(current, &ca->core))
+		goto err;
+
 	if (current->parent == NULL) {
 		/*
 		 * The root task has to be in its namespaces before executing
@@ -1896,8 +1999,19 @@ static int restore_task_with_children(void *_arg)
 	if (restore_task_mnt_ns(current))
 		goto err;
 
+	timing_start(TIME_FORK);
+	task_timing_start(current, TASK_TIME_FORK);
+
+	if (create_children_and_session(true))
+		goto err;
+
+	task_timing_stop(current, TASK_TIME_FORK);
+	timing_stop(TIME_FORK);
+
+	task_timing_start(current, TASK_TIME_MEM);
 	if (prepare_mappings(current))
 		goto err;
+	task_timing_stop(current, TASK_TIME_MEM);
 
 	if (prepare_sigactions(ca->core) < 0)
 		goto err;
@@ -1911,10 +2025,12 @@ static int restore_task_with_children(void *_arg)
 		goto err;
 
 	timing_start(TIME_FORK);
+	task_timing_start(current, TASK_TIME_FORK);
 
-	if (create_children_and_session())
+	if (create_children_and_session(false))
 		goto err;
 
+	task_timing_stop(current, TASK_TIME_FORK);
 	timing_stop(TIME_FORK);
 
 	if (populate_pid_proc())
@@ -1936,11 +2052,13 @@ static int restore_task_with_children(void *_arg)
 		 *
 		 * It means that all tasks entered into their namespaces.
 		 */
+		task_timing_mark(current, TASK_MARK_FORKED);
 		if (restore_wait_other_tasks())
 			goto err;
 		fini_restore_mntns();
 		__restore_switch_stage(CR_STATE_RESTORE);
 	} else {
+		task_timing_mark(current, TASK_MARK_FORKED);
 		if (restore_finish_stage(task_entries, CR_STATE_FORKING) < 0)
 			goto err;
 	}
@@ -2566,6 +2684,9 @@ int cr_restore_tasks(void)
 	if (crtools_prepare_shared() < 0)
 		goto err;
 
+	if (start_pages_prefetch() < 0)
+		goto err;
+
 	if (criu_signals_setup() < 0)
 		goto err;
 
@@ -2574,6 +2695,7 @@ int cr_restore_tasks(void)
 
 	ret = restore_root_task(root_item);
 err:
+	stop_pages_prefetch();
 	cr_plugin_fini(CR_PLUGIN_STAGE__RESTORE, ret);
 	return ret;
 }
@@ -3845,6 +3967,7 @@ static int sigreturn_restore(pid_t pid, struct task_restore_args *task_args, uns
 	 * and restoring core is extremely destructive.
 	 */
 
+	task_timing_mark(current, TASK_MARK_RESTORER);
 	JUMP_TO_RESTORER_BLOB(new_sp, restore_task_exec_start, task_args);
 
 err:
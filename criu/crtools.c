@@ -232,6 +232,8 @@ int main(int argc, char *argv[], char *envp[])
 	if (!strcmp(argv[optind], "dump")) {
 		if (!opts.tree_id)
 			goto opt_pid_missing;
+		if (opts.pre_dump_iters)
+			return cr_iterative_dump_tasks(opts.tree_id);
 		return cr_dump_tasks(opts.tree_id);
 	}
 
@@ -268,8 +270,15 @@ int main(int argc, char *argv[], char *envp[])
 	if (!strcmp(argv[optind], "check"))
 		return cr_check() != 0;
 
-	if (!strcmp(argv[optind], "page-server"))
+	if (!strcmp(argv[optind], "page-server")) {
+		if (opts.hash_pages) {
+			pr_warn("Pages are hashed by dump, "
+				"--hash-pages is ignored\n");
+			opts.hash_pages = 0;
+		}
+
 		return cr_page_server(opts.daemon_mode, false, -1) != 0;
+	}
 
 	if (!strcmp(argv[optind], "service"))
 		return cr_service(opts.daemon_mode);
@@ -357,6 +366,9 @@ usage:
 "                        this requires running a second instance of criu\n"
 "                        in lazy-pages mode: 'criu lazy-pages -D DIR'\n"
 "                        --lazy-pages and lazy-pages mode require userfaultfd\n"
+"  --lazy-pages-workers NUM\n"
+"                        in lazy-pages mode, serve the restored tasks from\n"
+"                        up to NUM processes\n"
 "  --stream              dump/restore images using criu-image-streamer\n"
 "\n"
 "* External resources support:\n"
@@ -463,6 +475,8 @@ usage:
 "                          -v3 - also information messages and timestamps\n"
 "                          -v4 - lots of debug\n"
 "  --display-stats       print out dump/restore stats\n"
+"  --trace-file FILE     write dump or restore steps with their timings to FILE\n"
+"                        in the Chrome trace event format\n"
 "\n"
 "* Memory dumping options:\n"
 "  --track-mem           turn on memory changes tracker in kernel\n"
@@ -474,11 +488,35 @@ usage:
 "                        will be punched from the image\n"
 "  --pre-dump-mode       splice - parasite based pre-dumping (default)\n"
 "                        read   - process_vm_readv syscall based pre-dumping\n"
+"  --mem-dump-workers NUM\n"
+"                        write pages of up to NUM tasks into images in parallel\n"
+"                        with dumping the rest of the tree (default 0),\n"
+"                        with --page-server each needs --ps-connections\n"
+"  --mem-dump-pipeline   write each chunk of pages into images while the next\n"
+"                        one is drained from the task\n"
+"  --compress            compress pages images with LZ4, works for dump,\n"
+"                        pre-dump and page-server\n"
+"  --hash-pages          don't write zero-filled pages and pages already\n"
+"                        written for other tasks into images\n"
+"  --io-uring            write pages images on dump and read them on restore\n"
+"                        through io_uring\n"
+"  --mem-restore-workers NUM\n"
+"                        on restore, read pages images into the page cache\n"
+"                        ahead of the tasks from NUM processes\n"
+"  --mmap-images         map image files and unpack their entries in place\n"
+"                        instead of reading them through a buffer\n"
+"  --pre-dump-iters NUM  on dump, pre-dump up to NUM times into pre-N\n"
+"                        subdirectories of -D until the dirty pages converge\n"
+"  --pre-dump-downtime MSEC\n"
+"                        stop pre-dumping once the final dump is expected to\n"
+"                        keep the tasks frozen for at most MSEC\n"
 "\n"
 "Page/Service server options:\n"
 "  --address ADDR        address of server or service\n"
 "  --port PORT           port of page server\n"
 "  --ps-socket FD        use specified FD as page server socket\n"
+"  --ps-connections NUM  stripe pages across up to NUM connections to\n"
+"                        page server (default 1)\n"
 "  -d|--daemon           run in the background after creating socket\n"
 "  --status-fd FD        write \\0 to the FD and close it once process is ready\n"
 "                        to handle requests\n"
@@ -48,6 +48,8 @@
 #include "string.h"
 #include "kerndat.h"
 #include "fdstore.h"
+#include "stats.h"
+#include "trace-event.h"
 #include "bpfmap.h"
 
 #include "protobuf.h"
@@ -606,6 +608,19 @@ int dump_my_file(int lfd, u32 *id, int *type)
 	return 0;
 }
 
+/* Name the span after the type of the fd, e.g. INETSK */
+static void trace_fd_span_end(struct trace_span *span, FdinfoEntry *e)
+{
+	const ProtobufCEnumValue *v;
+
+	v = protobuf_c_enum_descriptor_get_value(&fd_types__descriptor, e->type);
+	if (v)
+		span->name = v->name;
+	span->arg = "fd";
+	span->val = e->fd;
+	trace_span_end(span);
+}
+
 int dump_task_files_seized(struct parasite_ctl *ctl, struct pstree_item *item,
 		struct parasite_drain_fd *dfds)
 {
@@ -643,9 +658,13 @@ int dump_task_files_seized(struct parasite_ctl *ctl, struct pstree_item *item,
 
 		for (i = 0; i < nr_fds; i++) {
 			FdinfoEntry e = FDINFO_ENTRY__INIT;
+			struct trace_span span;
 
+			trace_span_start(&span, "fd", "fd", item->pid->real);
 			ret = dump_one_file(item->pid, dfds->fds[i + off],
 						lfds[i], opts + i, ctl, &e, dfds);
+			if (trace_enabled)
+				trace_fd_span_end(&span, &e);
 			if (ret)
 				break;
 
@@ -1126,6 +1145,19 @@ int setup_and_serve_out(struct fdinfo_list_entry *fle, int new_fd)
 	return 0;
 }
 
+static bool is_socket_fd(struct file_desc *d)
+{
+	switch (d->ops->type) {
+	case FD_TYPES__INETSK:
+	case FD_TYPES__UNIXSK:
+	case FD_TYPES__PACKETSK:
+	case FD_TYPES__NETLINKSK:
+		return true;
+	default:
+		return false;
+	}
+}
+
 static int open_fd(struct fdinfo_list_entry *fle)
 {
 	struct file_desc *d = fle->desc;
@@ -1154,7 +1186,11 @@ static int open_fd(struct fdinfo_list_entry *fle)
 	 * For every fle, new_fd is populated only once.
 	 * See setup_and_serve_out() BUG_ON for the details.
 	 */
+	if (is_socket_fd(d))
+		task_timing_start(current, TASK_TIME_SOCKETS);
 	ret = d->ops->open(d, &new_fd);
+	if (is_socket_fd(d))
+		task_timing_stop(current, TASK_TIME_SOCKETS);
 	if (ret != -1 && new_fd >= 0) {
 		if (setup_and_serve_out(fle, new_fd) < 0)
 			return -1;
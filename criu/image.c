@@ -86,6 +86,11 @@ int check_img_inventory(void)
 		goto out_err;
 	}
 
+	if (he->dup_pages && opts.auto_dedup) {
+		pr_warn("Pages images share pages, auto-dedup is disabled\n");
+		opts.auto_dedup = false;
+	}
+
 	ret = 0;
 
 out_err:
@@ -143,7 +148,7 @@ int inventory_save_uptime(InventoryEntry *he)
  * pid-reuse => fail.
  */
 
-InventoryEntry *get_parent_inventory(void)
+static InventoryEntry *read_parent_inventory(void)
 {
 	struct cr_img *img;
 	InventoryEntry *ie;
@@ -177,17 +182,59 @@ InventoryEntry *get_parent_inventory(void)
 		return NULL;
 	}
 
-	if (!ie->has_dump_uptime) {
+	close_image(img);
+	close(dir);
+	return ie;
+}
+
+InventoryEntry *get_parent_inventory(void)
+{
+	InventoryEntry *ie;
+
+	ie = read_parent_inventory();
+	if (ie && !ie->has_dump_uptime) {
 		pr_warn("Parent pre-dump inventory has no uptime\n");
 		inventory_entry__free_unpacked(ie, NULL);
 		ie = NULL;
 	}
 
-	close_image(img);
-	close(dir);
 	return ie;
 }
 
+/*
+ * Pages images written with --hash-pages are referred to from the
+ * PE_DUP entries of other pagemaps, so punching holes in them would
+ * corrupt those. All the dumps on top of such images are marked too,
+ * so that checking the top-most inventory is enough on restore.
+ */
+bool parent_has_dup_pages(void)
+{
+	InventoryEntry *ie;
+	bool ret;
+
+	ie = read_parent_inventory();
+	if (!ie)
+		return false;
+
+	ret = ie->dup_pages;
+	inventory_entry__free_unpacked(ie, NULL);
+	return ret;
+}
+
+void inventory_mark_dup_pages(InventoryEntry *he)
+{
+	if (!opts.hash_pages && !parent_has_dup_pages())
+		return;
+
+	he->has_dup_pages = true;
+	he->dup_pages = true;
+
+	if (opts.auto_dedup) {
+		pr_warn("Pages images share pages, auto-dedup is disabled\n");
+		opts.auto_dedup = false;
+	}
+}
+
 int prepare_inventory(InventoryEntry *he)
 {
 	struct pid pid;
@@ -223,6 +270,8 @@ int prepare_inventory(InventoryEntry *he)
 		he->has_tcp_close = true;
 	}
 
+	inventory_mark_dup_pages(he);
+
 	return 0;
 }
 
@@ -463,7 +512,11 @@ static int do_open_image(struct cr_img *img, int dfd, int type, unsigned long of
 	if (oflags & O_NOBUF)
 		bfd_setraw(&img->_x);
 	else {
-		if (flags == O_RDONLY)
+		/* Only the fd of raw images is used, don't map them */
+		if (flags == O_RDONLY && opts.mmap_images &&
+		    imgset_template[type].magic != RAW_IMAGE_MAGIC)
+			ret = bfdopenr_mmap(&img->_x);
+		else if (flags == O_RDONLY)
 			ret = bfdopenr(&img->_x);
 		else
 			ret = bfdopenw(&img->_x);
@@ -602,6 +655,25 @@ void up_page_ids_base(void)
 	page_ids += 0x10000;
 }
 
+void skip_page_id(void)
+{
+	/*
+	 * Pages images were opened in a forked memory dump
+	 * worker, so the ID it took is lost for us. Skip it
+	 * to not produce two pages images with the same ID.
+	 */
+	page_ids++;
+}
+
+void stripe_page_ids(int stripe)
+{
+	/*
+	 * Page servers forked for extra connections write
+	 * into the same dir, give each its own range of IDs.
+	 */
+	page_ids += stripe * 0x100000;
+}
+
 struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi, u32 *id)
 {
 	if (flags == O_RDONLY || flags == O_RDWR) {
@@ -14,6 +14,7 @@ struct xbuf {
 struct bfd {
 	int fd;
 	bool writable;
+	bool mapped;		/* b.mem is the whole file mmap-ed */
 	struct xbuf b;
 };
 
@@ -22,17 +23,29 @@ static inline bool bfd_buffered(struct bfd *b)
 	return b->b.mem != NULL;
 }
 
+static inline bool bfd_mapped(struct bfd *b)
+{
+	return b->mapped;
+}
+
 static inline void bfd_setraw(struct bfd *b)
 {
 	b->b.mem = NULL;
+	b->mapped = false;
 }
 
 int bfdopenr(struct bfd *f);
+int bfdopenr_mmap(struct bfd *f);
+void *bread_ptr(struct bfd *f, int sz);
+void bprefetch(struct bfd *f);
 int bfdopenw(struct bfd *f);
 void bclose(struct bfd *f);
+int bflush(struct bfd *f);
 char *breadline(struct bfd *f);
 char *breadchr(struct bfd *f, char c);
 int bwrite(struct bfd *f, const void *buf, int sz);
+void *bwrite_reserve(struct bfd *f, int sz);
+void bwrite_commit(struct bfd *f, int sz);
 struct iovec;
 int bwritev(struct bfd *f, const struct iovec *iov, int cnt);
 int bread(struct bfd *f, void *buf, int sz);
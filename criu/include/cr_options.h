@@ -120,9 +120,19 @@ struct cr_options {
 	unsigned short		port;
 	char			*addr;
 	int			ps_socket;
+	int			ps_connections;
 	int			track_mem;
 	char			*img_parent;
 	int			auto_dedup;
+	int			mem_dump_workers;
+	int			mem_restore_workers;
+	int			mem_dump_pipeline;
+	int			compress;
+	int			hash_pages;
+	int			io_uring;
+	int			mmap_images;
+	int			pre_dump_iters;
+	int			pre_dump_downtime;
 	unsigned int		cpu_cap;
 	int			force_irmap;
 	char			**exec_cmd;
@@ -148,6 +158,7 @@ struct cr_options {
 	unsigned int		empty_ns;
 	int			tcp_skip_in_flight;
 	bool			lazy_pages;
+	int			lazy_pages_workers;
 	char			*work_dir;
 
 	/*
@@ -158,6 +169,7 @@ struct cr_options {
 	 */
 	int			deprecated_ok;
 	int			display_stats;
+	char			*trace_file;
 	int			weak_sysctls;
 	int			status_fd;
 	bool			orphan_pts_master;
@@ -15,6 +15,8 @@ extern int write_img_inventory(InventoryEntry *he);
 extern int inventory_save_uptime(InventoryEntry *he);
 extern InventoryEntry *get_parent_inventory(void);
 extern int prepare_inventory(InventoryEntry *he);
+extern bool parent_has_dup_pages(void);
+extern void inventory_mark_dup_pages(InventoryEntry *he);
 struct pprep_head {
 	int (*actor)(struct pprep_head *);
 	struct pprep_head *next;
@@ -23,6 +25,7 @@ extern void add_post_prepare_cb(struct pprep_head *);
 extern bool deprecated_ok(char *what);
 extern int cr_dump_tasks(pid_t pid);
 extern int cr_pre_dump_tasks(pid_t pid);
+extern int cr_iterative_dump_tasks(pid_t pid);
 extern int cr_restore_tasks(void);
 extern int convert_to_elf(char *elf_path, int fd_core);
 extern int cr_check(void);
@@ -77,6 +77,8 @@ enum {
 	CR_FD_BINFMT_MISC,
 	CR_FD_BINFMT_MISC_OLD,
 	CR_FD_PAGES,
+	CR_FD_PAGES_FRAMES,
+	CR_FD_PAGE_HASHES,
 
 	CR_FD_SIGACT,
 	CR_FD_VMAS,
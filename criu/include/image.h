@@ -84,7 +84,9 @@
 #define VMA_AREA_VVAR		(1 <<  12)
 #define VMA_AREA_AIORING	(1 <<  13)
 #define VMA_AREA_MEMFD		(1 <<  14)
+#define VMA_AREA_THP		(1 <<  15)	/* had huge pages on dump */
 
+#define VMA_LAZY_SHMEM		(1 <<  27)	/* content left to lazy-pages */
 #define VMA_CLOSE		(1 <<  28)
 #define VMA_NO_PROT_WRITE	(1 <<  29)
 #define VMA_PREMMAPED		(1 <<  30)
@@ -154,6 +156,8 @@ extern int open_image_lazy(struct cr_img *img);
 extern struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, u32 *pages_id);
 extern struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi, u32 *pages_id);
 extern void up_page_ids_base(void);
+extern void skip_page_id(void);
+extern void stripe_page_ids(int stripe);
 
 extern struct cr_img *img_from_fd(int fd); /* for cr-show mostly */
 
@@ -53,6 +53,7 @@ struct kerndat_s {
 	bool has_uffd;
 	unsigned long uffd_features;
 	bool has_thp_disable;
+	unsigned long thp_size;
 	bool can_map_vdso;
 	bool vdso_hint_reliable;
 	struct vdso_symtable	vdso_sym;
@@ -68,6 +69,8 @@ struct kerndat_s {
 	bool has_fsopen;
 	bool has_clone3_set_tid;
 	bool has_timens;
+	bool has_pagemap_scan;
+	bool has_procmap_query;
 };
 
 extern struct kerndat_s kdat;
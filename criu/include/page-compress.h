@@ -0,0 +1,41 @@
+#ifndef __CR_PAGE_COMPRESS_H__
+#define __CR_PAGE_COMPRESS_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "int.h"
+
+/*
+ * Compressed pages images.
+ *
+ * Pages are packed into frames of PAGES_FRAME_SIZE bytes, each frame
+ * is compressed on its own and written into pages image back to back.
+ * Where the frames are is recorded in page-frames image, so that any
+ * page can be found by its offset in uncompressed pages stream (the
+ * pi_off of page_read) by inflating only the frame it sits in.
+ */
+
+#define PAGES_FRAME_SIZE	(1 << 20)
+
+struct cr_img;
+struct page_compress;
+struct page_decompress;
+
+extern struct page_compress *page_compress_open(u32 pages_id);
+extern int page_compress_write(struct page_compress *pc, struct cr_img *pi,
+			       int pipe, unsigned long len);
+extern void page_compress_close(struct page_compress *pc, struct cr_img *pi);
+extern bool page_compress_failed(void);
+
+/*
+ * -1 -- error
+ *  0 -- the pages image is not compressed
+ *  1 -- opened
+ */
+extern int page_decompress_open(int dfd, u32 pages_id, struct page_decompress **pd);
+extern int page_decompress_read(struct page_decompress *pd, struct cr_img *pi,
+				void *buf, unsigned long len, off_t off);
+extern void page_decompress_close(struct page_decompress *pd);
+
+#endif /* __CR_PAGE_COMPRESS_H__ */
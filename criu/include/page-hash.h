@@ -0,0 +1,63 @@
+#ifndef __CR_PAGE_HASH_H__
+#define __CR_PAGE_HASH_H__
+
+#include <stdbool.h>
+
+#include "int.h"
+
+/*
+ * Content hashes of the pages written into pages images.
+ *
+ * While dumping with --hash-pages each page is looked up by its
+ * contents before being written. Zero-filled pages and pages that
+ * are already in some pages image are not written again, instead
+ * the pagemap gets PE_ZERO or PE_DUP entries for them. On dump a
+ * hash hit is verified by comparing the pages byte by byte.
+ *
+ * The hashes of the pages written into task's pages image go to the
+ * page-hashes image next to it, one per page in the same order. On
+ * restore they tell which pages of inherited vmas are the same as
+ * the parent's ones without reading them. There's nothing to compare
+ * the pages with there, so a page is taken as the same if all the
+ * 128 bits of the hash match. The hash is not a cryptographic one,
+ * it makes accidental collisions practically impossible, but gives
+ * no guarantee against page contents crafted to collide.
+ */
+
+struct page_hash {
+	u64	lo;	/* alone picks a bucket on dump */
+	u64	hi;
+};
+
+static inline bool page_hash_equal(struct page_hash *a, struct page_hash *b)
+{
+	return a->lo == b->lo && a->hi == b->hi;
+}
+
+struct page_hash_img {
+	u32	pages_id;	/* pages image being written */
+	u64	written;	/* bytes already in it */
+	void	*pending;	/* pages to be written after them */
+};
+
+extern bool page_zero_filled(void *page);
+extern void page_hash(void *page, struct page_hash *h);
+
+/*
+ * -1 -- error
+ *  0 -- no such page yet
+ *  1 -- found, the copy is at *off in pages-*id
+ */
+extern int page_hash_find(struct page_hash_img *hi, void *page, u64 hash,
+			  u32 *id, u64 *off);
+extern int page_hash_add(u64 hash, u32 id, u64 off);
+
+/*
+ * -1 -- error
+ *  0 -- no hashes for pages-id
+ *  1 -- *nr hashes are in *hashes
+ */
+extern int page_hashes_load(u32 pages_id, struct page_hash **hashes,
+			    unsigned long *nr);
+
+#endif /* __CR_PAGE_HASH_H__ */
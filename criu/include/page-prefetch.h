@@ -0,0 +1,27 @@
+#ifndef __CR_PAGE_PREFETCH_H__
+#define __CR_PAGE_PREFETCH_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Prefetching of pages images on restore.
+ *
+ * With --mem-restore-workers the root criu process forks helpers
+ * that read the pages images of all tasks into the page cache, in
+ * PAGES_PREFETCH_CHUNK pieces spread over the helpers, in the order
+ * the tasks are restored. The tasks then mostly copy the pages from
+ * the page cache instead of waiting for the storage one read after
+ * another. The helpers are best effort, an error in one of them is
+ * not an error of the restore.
+ */
+
+#define PAGES_PREFETCH_CHUNK	(4 << 20)
+
+extern int start_pages_prefetch(void);
+extern void stop_pages_prefetch(void);
+
+/* Called from the SIGCHLD handler, true if pid is one of the helpers */
+extern bool pages_prefetch_reaped(pid_t pid, int status);
+
+#endif /* __CR_PAGE_PREFETCH_H__ */
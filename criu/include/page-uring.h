@@ -0,0 +1,33 @@
+#ifndef __CR_PAGE_URING_H__
+#define __CR_PAGE_URING_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * io_uring engine for pages images.
+ *
+ * On restore the reads page_read queues with PR_ASYNC are submitted
+ * as up to PAGE_URING_DEPTH outstanding readv requests rather than
+ * being read one preadv after another. On dump the local page xfer
+ * queues splices from page pipes into pages image and submits them
+ * as one linked chain, page_uring_sync() has to be called before the
+ * pipes are reused. A ring is used for either reads or splices.
+ */
+
+#define PAGE_URING_DEPTH	64
+
+struct page_uring;
+
+extern struct page_uring *page_uring_open(void);
+extern void page_uring_close(struct page_uring *pu);
+
+extern int page_uring_readv(struct page_uring *pu, int fd,
+			    struct iovec *iov, int nr, off_t off, void *data);
+extern int page_uring_reap(struct page_uring *pu, void **data, int *res);
+
+extern int page_uring_splice(struct page_uring *pu, int pipe, int fd,
+			     unsigned long len);
+extern int page_uring_sync(struct page_uring *pu);
+
+#endif /* __CR_PAGE_URING_H__ */
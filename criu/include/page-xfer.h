@@ -37,6 +37,9 @@ struct page_xfer {
 		struct /* local */ {
 			struct cr_img *pmi; /* pagemaps */
 			struct cr_img *pi;  /* pages */
+			struct page_compress *pc; /* when compressing pages */
+			struct hash_xfer *hx; /* when hashing pages */
+			struct page_uring *pu; /* when splicing pages with io_uring */
 		};
 
 		struct /* page-server */ {
@@ -52,7 +55,9 @@ extern int open_page_xfer(struct page_xfer *xfer, int fd_type, unsigned long id)
 struct page_pipe;
 extern int page_xfer_dump_pages(struct page_xfer *, struct page_pipe *);
 extern int page_xfer_predump_pages(int pid, struct page_xfer *, struct page_pipe *);
+extern int page_xfer_flush(struct page_xfer *);
 extern int connect_to_page_server_to_send(void);
+extern void page_server_use_stripe(int n);
 extern int connect_to_page_server_to_recv(int epfd);
 extern int disconnect_from_page_server(void);
 
@@ -2,14 +2,51 @@
 #define __CR_PAGEMAP_H__
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include "int.h"
 
 #include "common/list.h"
 
 struct vma_area;
+struct pmc_vma;
 
 #define PAGEMAP_PFN_OFF(addr)	(PAGE_PFN(addr) * sizeof(u64))
 
+/* Since linux-6.7, see include/uapi/linux/fs.h */
+#ifndef PAGEMAP_SCAN
+#define PAGEMAP_SCAN		_IOWR('f', 16, struct pm_scan_arg)
+
+#define PAGE_IS_WPALLOWED	(1 << 0)
+#define PAGE_IS_WRITTEN		(1 << 1)
+#define PAGE_IS_FILE		(1 << 2)
+#define PAGE_IS_PRESENT		(1 << 3)
+#define PAGE_IS_SWAPPED		(1 << 4)
+#define PAGE_IS_PFNZERO		(1 << 5)
+#define PAGE_IS_HUGE		(1 << 6)
+#define PAGE_IS_SOFT_DIRTY	(1 << 7)
+
+struct page_region {
+	u64	start;
+	u64	end;
+	u64	categories;
+};
+
+struct pm_scan_arg {
+	u64	size;
+	u64	flags;
+	u64	start;
+	u64	end;
+	u64	walk_end;
+	u64	vec;
+	u64	vec_len;
+	u64	max_pages;
+	u64	category_inverted;
+	u64	category_mask;
+	u64	category_anyof_mask;
+	u64	return_mask;
+};
+#endif
+
 typedef struct {
 	pid_t			pid;		/* which process it belongs */
 	unsigned long		start;		/* start of area */
@@ -17,6 +54,11 @@ typedef struct {
 	const struct list_head	*vma_head;	/* list head of VMAs we're serving */
 	u64			*map;		/* local buffer */
 	size_t			map_len;	/* length of a buffer */
+	void			*gap;		/* pagemap of holes goes here */
+	struct pmc_vma		*vmas;		/* VMAs in the buffer */
+	unsigned int		nr_vmas;
+	unsigned int		cur;		/* the last VMA asked for */
+	struct page_region	*regs;		/* PAGEMAP_SCAN results */
 	int			fd;		/* file to read PMs from */
 } pmc_t;
 
@@ -26,4 +68,12 @@ extern int pmc_init(pmc_t *pmc, pid_t pid, const struct list_head *vma_head, siz
 extern u64 *pmc_get_map(pmc_t *pmc, const struct vma_area *vma);
 extern void pmc_fini(pmc_t *pmc);
 
+/*
+ * Asks the kernel for present and swapped pages in [start, end) and
+ * puts them into pmc->regs as ranges of pages with the same flags.
+ * Returns the number of ranges, *walk_end is where the scan stopped.
+ */
+extern long pmc_scan(pmc_t *pmc, unsigned long start, unsigned long end,
+		     unsigned long *walk_end);
+
 #endif /* __CR_PAGEMAP_H__ */
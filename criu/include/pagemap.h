@@ -4,6 +4,10 @@
 #include "common/list.h"
 #include "images/pagemap.pb-c.h"
 #include "page.h"
+#include "protobuf.h"
+
+struct page_decompress;
+struct page_uring;
 
 /*
  * page_read -- engine, that reads pages from image file(s)
@@ -64,6 +68,12 @@ struct page_read {
 	struct cr_img *pmi;
 	struct cr_img *pi;
 	u32 pages_img_id;
+	struct page_decompress *pd;	/* set if pages image is compressed */
+	struct page_uring *pu;		/* set on the first --io-uring read */
+	bool elided;			/* there are PE_ZERO or PE_DUP entries */
+	int dfd;			/* images dir to find PE_DUP pages in */
+	struct cr_img *dpi;		/* pages image of the last PE_DUP read */
+	u32 dpi_id;
 
 	PagemapEntry *pe;		/* current pagemap we are on */
 	struct page_read *parent;	/* parent pagemap (if ->in_parent
@@ -81,6 +91,7 @@ struct page_read {
 	PagemapEntry **pmes;
 	int nr_pmes;
 	int curr_pme;
+	struct pb_arena pmes_arena;	/* pmes are unpacked here */
 
 	struct list_head	async;
 };
@@ -136,6 +147,9 @@ static inline bool page_read_has_parent(struct page_read *pr)
 #define PE_PARENT	(1 << 0)	/* pages are in parent snapshot */
 #define PE_LAZY		(1 << 1)	/* pages can be lazily restored */
 #define PE_PRESENT	(1 << 2)	/* pages are present in pages*img */
+#define PE_ZERO		(1 << 3)	/* pages are filled with zeroes */
+#define PE_DUP		(1 << 4)	/* pages are at dup_off in pages-dup_pages_id */
+#define PE_HOT		(1 << 5)	/* lazy pages are likely to be accessed soon */
 
 static inline bool pagemap_in_parent(PagemapEntry *pe)
 {
@@ -152,4 +166,19 @@ static inline bool pagemap_present(PagemapEntry *pe)
 	return !!(pe->flags & PE_PRESENT);
 }
 
+static inline bool pagemap_zero(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_ZERO);
+}
+
+static inline bool pagemap_dup(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_DUP);
+}
+
+static inline bool pagemap_hot(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_HOT);
+}
+
 #endif /* __CR_PAGE_READ_H__ */
@@ -2,6 +2,7 @@
 #define __CR_PROC_PARSE_H__
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
 
 #include "compel/infect.h"
 
@@ -85,6 +86,36 @@ struct proc_status_creds {
 
 #define INVALID_UID ((uid_t)-1)
 
+/* Since linux-6.11, see include/uapi/linux/fs.h */
+#ifndef PROCMAP_QUERY
+#define PROCMAP_QUERY		_IOWR('f', 17, struct procmap_query)
+
+#define PROCMAP_QUERY_VMA_READABLE		0x01
+#define PROCMAP_QUERY_VMA_WRITABLE		0x02
+#define PROCMAP_QUERY_VMA_EXECUTABLE		0x04
+#define PROCMAP_QUERY_VMA_SHARED		0x08
+#define PROCMAP_QUERY_COVERING_OR_NEXT_VMA	0x10
+#define PROCMAP_QUERY_FILE_BACKED_VMA		0x20
+
+struct procmap_query {
+	u64	size;
+	u64	query_flags;
+	u64	query_addr;
+	u64	vma_start;
+	u64	vma_end;
+	u64	vma_flags;
+	u64	vma_page_size;
+	u64	vma_offset;
+	u64	inode;
+	u32	dev_major;
+	u32	dev_minor;
+	u32	vma_name_size;
+	u32	build_id_size;
+	u64	vma_name_addr;
+	u64	build_id_addr;
+};
+#endif
+
 extern int parse_pid_stat(pid_t pid, struct proc_pid_stat *s);
 extern unsigned int parse_pid_loginuid(pid_t pid, int *err, bool ignore_noent);
 extern int parse_pid_oom_score_adj(pid_t pid, int *err);
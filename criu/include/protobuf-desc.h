@@ -80,6 +80,8 @@ enum {
 	PB_SK_QUEUES,
 	PB_IPCNS_MSG,
 	PB_IPCNS_MSG_ENT,
+	PB_PAGES_FRAMES_HEAD,
+	PB_PAGES_FRAME,
 
 	PB_MAX,
 };
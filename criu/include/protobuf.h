@@ -8,11 +8,15 @@
 #include "util.h"
 
 struct cr_img;
+struct pb_arena;
 
-extern int do_pb_read_one(struct cr_img *, void **objp, int type, bool eof);
+extern int do_pb_read_one(struct cr_img *, void **objp, int type, bool eof,
+			  struct pb_arena *arena);
 
-#define pb_read_one(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, false)
-#define pb_read_one_eof(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, true)
+#define pb_read_one(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, false, NULL)
+#define pb_read_one_eof(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, true, NULL)
+#define pb_read_one_arena(fd, objp, type, arena) \
+	do_pb_read_one(fd, (void **)objp, type, true, arena)
 
 extern int pb_write_one(struct cr_img *, void *obj, int type);
 
@@ -27,6 +31,23 @@ extern int pb_write_one(struct cr_img *, void *obj, int type);
 
 #include <google/protobuf-c/protobuf-c.h>
 
+/*
+ * Objects that live and die together, e.g. all entries of an image,
+ * can be unpacked into an arena. Its memory is bump-allocated from
+ * big chunks and is only released all at once by pb_arena_free, so
+ * such objects must never be freed with __free_unpacked.
+ */
+struct pb_arena_chunk;
+
+struct pb_arena {
+	ProtobufCAllocator	allocator;
+	struct pb_arena_chunk	*chunk;		/* the current one */
+	size_t			used;
+};
+
+extern void pb_arena_init(struct pb_arena *arena);
+extern void pb_arena_free(struct pb_arena *arena);
+
 struct collect_image_info {
 	int fd_type;
 	int pb_type;
@@ -38,6 +59,7 @@ struct collect_image_info {
 #define COLLECT_SHARED		0x1	/* use shared memory for obj-s */
 #define COLLECT_NOFREE		0x2	/* don't free entry after callback */
 #define COLLECT_HAPPENED	0x4	/* image was opened and collected */
+#define COLLECT_ARENA		0x8	/* kept entries are never freed, unpack them into an arena */
 
 extern int collect_image(struct collect_image_info *);
 extern int collect_entry(ProtobufCMessage *base, struct collect_image_info *cinfo);
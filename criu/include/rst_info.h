@@ -5,6 +5,7 @@
 #include "common/list.h"
 #include "vma.h"
 #include "kerndat.h"
+#include "stats.h"
 
 struct task_entries {
 	int nr_threads, nr_tasks, nr_helpers;
@@ -71,6 +72,8 @@ struct rst_info {
 	bool			has_thp_enabled;
 
 	void			*breakpoint;
+
+	struct task_timings	timings;
 };
 
 extern struct task_entries *task_entries;
@@ -1,6 +1,8 @@
 #ifndef __CR_STATS_H__
 #define __CR_STATS_H__
 
+#include <sys/time.h>
+
 enum {
 	TIME_FREEZING,
 	TIME_FROZEN,
@@ -21,6 +23,47 @@ enum {
 extern void timing_start(int t);
 extern void timing_stop(int t);
 
+/* Wall time of the restore stages, see CR_STATE_ */
+extern void timing_stage(int stage);
+
+enum {
+	TASK_TIME_FORK,
+	TASK_TIME_MEM,
+	TASK_TIME_FILES,
+	TASK_TIME_SOCKETS,
+
+	TASK_TIME_NR_STATS,
+};
+
+enum {
+	TASK_MARK_FORKED,	/* finished CR_STATE_FORKING */
+	TASK_MARK_RESTORER,	/* jumped into the restorer */
+
+	TASK_MARK_NR_STATS,
+};
+
+struct timing {
+	struct timeval start;
+	struct timeval total;
+};
+
+/*
+ * Restore timings of one task, kept in its rst_info, which is shared
+ * with criu. The first start and the last stop of each timing go to
+ * the trace.
+ */
+struct task_timings {
+	struct timing	timings[TASK_TIME_NR_STATS];
+	struct timeval	first[TASK_TIME_NR_STATS];
+	struct timeval	last[TASK_TIME_NR_STATS];
+	struct timeval	marks[TASK_MARK_NR_STATS];
+};
+
+struct pstree_item;
+extern void task_timing_start(struct pstree_item *t, int tm);
+extern void task_timing_stop(struct pstree_item *t, int tm);
+extern void task_timing_mark(struct pstree_item *t, int mark);
+
 enum {
 	CNT_PAGES_SCANNED,
 	CNT_PAGES_SKIPPED_PARENT,
@@ -33,6 +76,12 @@ enum {
 	CNT_SHPAGES_SKIPPED_PARENT,
 	CNT_SHPAGES_WRITTEN,
 
+	CNT_PAGES_ZERO,
+	CNT_PAGES_DUP,
+
+	CNT_PAGEMAP_HITS,
+	CNT_PAGEMAP_MISSES,
+
 	DUMP_CNT_NR_STATS,
 };
 
@@ -47,6 +96,9 @@ enum {
 extern void cnt_add(int c, unsigned long val);
 extern void cnt_sub(int c, unsigned long val);
 
+/* Objects and their packed bytes unpacked from images on restore */
+extern void cnt_pb_decoded(int pb_type, unsigned long size);
+
 #define DUMP_STATS	1
 #define RESTORE_STATS	2
 
@@ -0,0 +1,68 @@
+#ifndef __CR_TRACE_EVENT_H__
+#define __CR_TRACE_EVENT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/*
+ * Writer of the JSON trace event format, which both chrome://tracing
+ * and the Perfetto UI open. Events are grouped into tracks by pid and
+ * tid, names are written as is and thus should not need escaping.
+ *
+ * Each event is appended with a single write(), so processes forked
+ * after trace_open() can add their events too.
+ */
+
+extern bool trace_enabled;
+
+extern int trace_open(const char *path);
+extern void trace_close(void);
+
+extern void trace_name_process(int pid, const char *name);
+extern void trace_name_thread(int pid, int tid, const char *name);
+
+/* An event from start till end, arg is an optional numeric argument */
+extern void trace_complete(const char *name, const char *cat, int pid, int tid,
+			   const struct timeval *start, const struct timeval *end,
+			   const char *arg, unsigned long val);
+extern void trace_instant(const char *name, const char *cat, int pid, int tid,
+			  const struct timeval *at);
+
+/*
+ * A span is a complete event measured in place. Its name and
+ * argument can be changed till it ends, e.g. when the type of
+ * the thing being dumped becomes known. Spans cost only a check
+ * of trace_enabled when tracing is off.
+ */
+struct trace_span {
+	const char	*name;
+	const char	*cat;
+	int		pid;
+	const char	*arg;
+	unsigned long	val;
+	struct timeval	start;
+};
+
+extern void __trace_span_end(struct trace_span *s);
+
+static inline void trace_span_start(struct trace_span *s, const char *name,
+				    const char *cat, int pid)
+{
+	if (!trace_enabled)
+		return;
+
+	s->name = name;
+	s->cat = cat;
+	s->pid = pid;
+	s->arg = NULL;
+	gettimeofday(&s->start, NULL);
+}
+
+static inline void trace_span_end(struct trace_span *s)
+{
+	if (trace_enabled)
+		__trace_span_end(s);
+}
+
+#endif /* __CR_TRACE_EVENT_H__ */
@@ -5,6 +5,7 @@ struct task_restore_args;
 
 extern int uffd_open(int flags, unsigned long *features);
 extern bool uffd_noncooperative(void);
+extern bool uffd_lazy_shmem(void);
 extern int setup_uffd(int pid, struct task_restore_args *task_args);
 extern int lazy_pages_setup_zombie(int pid);
 extern int prepare_lazy_pages_socket(void);
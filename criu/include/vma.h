@@ -133,4 +133,17 @@ static inline bool vma_entry_can_be_lazy(VmaEntry *e)
 		!(vma_entry_is(e, VMA_AREA_VSYSCALL)));
 }
 
+/*
+ * Anonymous shared memory is only reachable via mappings, so its
+ * missing pages can be injected by lazy-pages daemon too. Unlike
+ * this, memfd and SysV shmem contents can be read with syscalls
+ * that userfaultfd doesn't catch.
+ */
+static inline bool vma_entry_can_be_lazy_shmem(VmaEntry *e)
+{
+	return (vma_entry_is(e, VMA_ANON_SHARED) &&
+		!vma_entry_is(e, VMA_AREA_SYSVIPC) &&
+		!(e->flags & MAP_LOCKED));
+}
+
 #endif /* __CR_VMA_H__ */
@@ -28,6 +28,7 @@
 #include "util.h"
 #include "lsm.h"
 #include "proc_parse.h"
+#include "pagemap-cache.h"
 #include "sk-inet.h"
 #include "sockets.h"
 #include "net.h"
@@ -158,6 +159,27 @@ static void kerndat_mmap_min_addr(void)
 		 (unsigned long)kdat.mmap_min_addr);
 }
 
+static void kerndat_thp_size(void)
+{
+	FILE *f;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (!f) {
+		pr_info("Transparent huge pages are not available\n");
+		return;
+	}
+
+	if (fscanf(f, "%lu", &kdat.thp_size) != 1 ||
+	    kdat.thp_size < PAGE_SIZE ||
+	    (kdat.thp_size & (kdat.thp_size - 1))) {
+		pr_warn("Can't parse the huge page size\n");
+		kdat.thp_size = 0;
+	}
+	fclose(f);
+
+	pr_debug("Found huge page size %#lx\n", kdat.thp_size);
+}
+
 static int kerndat_files_stat(void)
 {
 	static const uint32_t NR_OPEN_DEFAULT = 1024 * 1024;
@@ -707,6 +729,86 @@ err:
 	return ret;
 }
 
+/*
+ * PAGEMAP_SCAN reports soft-dirty bits since it appeared in 6.7,
+ * but check this too, the kernel rejects unknown categories.
+ */
+static int kerndat_has_pagemap_scan(void)
+{
+	struct page_region reg = { };
+	struct pm_scan_arg arg = {
+		.size			= sizeof(arg),
+		.vec			= (unsigned long)&reg,
+		.vec_len		= 1,
+		.category_anyof_mask	= PAGE_IS_PRESENT | PAGE_IS_SWAPPED,
+		.return_mask		= PAGE_IS_PRESENT | PAGE_IS_SWAPPED |
+					  PAGE_IS_FILE | PAGE_IS_PFNZERO |
+					  PAGE_IS_SOFT_DIRTY,
+	};
+	char *map;
+	int fd, ret = 0;
+
+	if (kdat.pmap == PM_DISABLED)
+		return 0;
+
+	map = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		pr_perror("Can't mmap memory for pagemap scan test");
+		return -1;
+	}
+	map[0] = '\0';
+
+	fd = open_proc(PROC_SELF, "pagemap");
+	if (fd < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	arg.start = (unsigned long)map;
+	arg.end = (unsigned long)map + PAGE_SIZE;
+	if (ioctl(fd, PAGEMAP_SCAN, &arg) < 0) {
+		if (errno != ENOTTY && errno != EINVAL)
+			pr_perror("Can't scan pagemap");
+	} else if (reg.categories & PAGE_IS_PRESENT)
+		kdat.has_pagemap_scan = true;
+
+	pr_info("PAGEMAP_SCAN is %ssupported\n",
+		kdat.has_pagemap_scan ? "" : "not ");
+	close(fd);
+out:
+	munmap(map, PAGE_SIZE);
+	return ret;
+}
+
+static int kerndat_has_procmap_query(void)
+{
+	struct procmap_query q = {
+		.size		= sizeof(q),
+		.query_flags	= PROCMAP_QUERY_COVERING_OR_NEXT_VMA,
+		.query_addr	= 0,
+	};
+	int fd;
+
+	fd = open_proc(PROC_SELF, "maps");
+	if (fd < 0)
+		return -1;
+
+	if (ioctl(fd, PROCMAP_QUERY, &q) < 0) {
+		if (errno != ENOTTY && errno != EINVAL) {
+			pr_perror("Can't query maps");
+			close(fd);
+			return -1;
+		}
+	} else
+		kdat.has_procmap_query = true;
+
+	pr_info("PROCMAP_QUERY is %ssupported\n",
+		kdat.has_procmap_query ? "" : "not ");
+	close(fd);
+	return 0;
+}
+
 static int kerndat_has_inotify_setnextwd(void)
 {
 	int ret = 0;
@@ -1083,6 +1185,14 @@ int kerndat_init(void)
 		pr_err("init_zero_page_pfn failed when initializing kerndat.\n");
 		ret = -1;
 	}
+	if (!ret && kerndat_has_pagemap_scan()) {
+		pr_err("kerndat_has_pagemap_scan failed when initializing kerndat.\n");
+		ret = -1;
+	}
+	if (!ret && kerndat_has_procmap_query()) {
+		pr_err("kerndat_has_procmap_query failed when initializing kerndat.\n");
+		ret = -1;
+	}
 	if (!ret && get_last_cap()) {
 		pr_err("get_last_cap failed when initializing kerndat.\n");
 		ret = -1;
@@ -1188,6 +1298,7 @@ int kerndat_init(void)
 
 	kerndat_lsm();
 	kerndat_mmap_min_addr();
+	kerndat_thp_size();
 	kerndat_files_stat();
 
 	if (!ret)
@@ -5,8 +5,10 @@
 #include <fcntl.h>
 #include <sys/syscall.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
 
 #include "types.h"
+#include "image.h"
 #include "cr_options.h"
 #include "servicefd.h"
 #include "mem.h"
@@ -14,6 +16,8 @@
 #include "parasite.h"
 #include "page-pipe.h"
 #include "page-xfer.h"
+#include "page-compress.h"
+#include "page-hash.h"
 #include "log.h"
 #include "kerndat.h"
 #include "stats.h"
@@ -164,6 +168,52 @@ static bool is_stack(struct pstree_item *item, unsigned long vaddr)
  * the memory contents is present in the pagent image set.
  */
 
+static int add_page(struct pstree_item *item, struct vma_area *vma,
+		    struct page_pipe *pp, unsigned long vaddr, u64 pme,
+		    bool has_parent, unsigned long *pages)
+{
+	unsigned int ppb_flags = 0;
+	int ret, st;
+
+	if (vma_entry_can_be_lazy(vma->e) && !is_stack(item, vaddr))
+		ppb_flags |= PPB_LAZY;
+
+	/*
+	 * If we're doing incremental dump (parent images
+	 * specified) and page is not soft-dirty -- we dump
+	 * hole and expect the parent images to contain this
+	 * page. The latter would be checked in page-xfer.
+	 */
+
+	if (has_parent && page_in_parent(pme & PME_SOFT_DIRTY)) {
+		ret = page_pipe_add_hole(pp, vaddr, PP_HOLE_PARENT);
+		st = 0;
+	} else {
+		ret = page_pipe_add_page(pp, vaddr, ppb_flags);
+		if (ppb_flags & PPB_LAZY && opts.lazy_pages)
+			st = 1;
+		else
+			st = 2;
+	}
+
+	if (ret)
+		return ret;
+
+	pages[st]++;
+	return 0;
+}
+
+static void account_iovs(unsigned long nr_scanned, unsigned long *pages)
+{
+	cnt_add(CNT_PAGES_SCANNED, nr_scanned);
+	cnt_add(CNT_PAGES_SKIPPED_PARENT, pages[0]);
+	cnt_add(CNT_PAGES_LAZY, pages[1]);
+	cnt_add(CNT_PAGES_WRITTEN, pages[2]);
+
+	pr_info("Pagemap generated: %lu pages (%lu lazy) %lu holes\n",
+		pages[2] + pages[1], pages[1], pages[0]);
+}
+
 static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct page_pipe *pp, u64 *map, u64 *off, bool has_parent)
 {
 	u64 *at = &map[PAGE_PFN(*off)];
@@ -175,53 +225,105 @@ static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct
 
 	for (pfn = 0; pfn < nr_to_scan; pfn++) {
 		unsigned long vaddr;
-		unsigned int ppb_flags = 0;
-		int st;
 
 		if (!should_dump_page(vma->e, at[pfn]))
 			continue;
 
 		vaddr = vma->e->start + *off + pfn * PAGE_SIZE;
 
-		if (vma_entry_can_be_lazy(vma->e) && !is_stack(item, vaddr))
-			ppb_flags |= PPB_LAZY;
-
-		/*
-		 * If we're doing incremental dump (parent images
-		 * specified) and page is not soft-dirty -- we dump
-		 * hole and expect the parent images to contain this
-		 * page. The latter would be checked in page-xfer.
-		 */
-
-		if (has_parent && page_in_parent(at[pfn] & PME_SOFT_DIRTY)) {
-			ret = page_pipe_add_hole(pp, vaddr, PP_HOLE_PARENT);
-			st = 0;
-		} else {
-			ret = page_pipe_add_page(pp, vaddr, ppb_flags);
-			if (ppb_flags & PPB_LAZY && opts.lazy_pages)
-				st = 1;
-			else
-				st = 2;
-		}
-
+		ret = add_page(item, vma, pp, vaddr, at[pfn], has_parent, pages);
 		if (ret) {
 			/* Do not do pfn++, just bail out */
 			pr_debug("Pagemap full\n");
 			break;
 		}
-
-		pages[st]++;
 	}
 
 	*off += pfn * PAGE_SIZE;
 
-	cnt_add(CNT_PAGES_SCANNED, nr_to_scan);
-	cnt_add(CNT_PAGES_SKIPPED_PARENT, pages[0]);
-	cnt_add(CNT_PAGES_LAZY, pages[1]);
-	cnt_add(CNT_PAGES_WRITTEN, pages[2]);
+	account_iovs(nr_to_scan, pages);
+	return ret;
+}
 
-	pr_info("Pagemap generated: %lu pages (%lu lazy) %lu holes\n",
-		pages[2] + pages[1], pages[1], pages[0]);
+/*
+ * The kernel reports the present and swapped pages of the VMA as
+ * ranges with the same flags, so the pages it doesn't have are not
+ * even looked at. The flags are turned back into a pagemap entry
+ * that should_dump_page() and page_in_parent() understand.
+ */
+static u64 region_pme(u64 categories)
+{
+	u64 pme = 0;
+
+	if (categories & PAGE_IS_PRESENT)
+		pme |= PME_PRESENT;
+	if (categories & PAGE_IS_SWAPPED)
+		pme |= PME_SWAP;
+	if (categories & PAGE_IS_FILE)
+		pme |= PME_FILE;
+	if (categories & PAGE_IS_SOFT_DIRTY)
+		pme |= PME_SOFT_DIRTY;
+
+	return pme;
+}
+
+static bool vma_can_scan(struct vma_area *vma)
+{
+	/* These have to be dumped whether the pages are there or not */
+	return kdat.has_pagemap_scan &&
+		!vma_area_is(vma, VMA_ANON_SHARED) &&
+		!vma_entry_is(vma->e, VMA_AREA_VDSO) &&
+		!vma_entry_is(vma->e, VMA_AREA_AIORING);
+}
+
+static int scan_iovs(struct pstree_item *item, struct vma_area *vma, struct page_pipe *pp, pmc_t *pmc, u64 *off, bool has_parent)
+{
+	unsigned long vaddr = vma->e->start + *off;
+	unsigned long nr_to_scan;
+	unsigned long pages[3] = {};
+	int ret = 0;
+
+	nr_to_scan = (vma_area_len(vma) - *off) / PAGE_SIZE;
+
+	while (!ret && vaddr < vma->e->end) {
+		unsigned long walk_end;
+		long nr, i;
+
+		nr = pmc_scan(pmc, vaddr, vma->e->end, &walk_end);
+		if (nr < 0)
+			return -1;
+
+		if (walk_end <= vaddr) {
+			pr_err("Pagemap scan stuck at %lx\n", vaddr);
+			return -1;
+		}
+
+		for (i = 0; i < nr && !ret; i++) {
+			struct page_region *reg = &pmc->regs[i];
+			u64 pme = region_pme(reg->categories);
+
+			if (reg->categories & PAGE_IS_PFNZERO)
+				continue;
+			if (!should_dump_page(vma->e, pme))
+				continue;
+
+			for (vaddr = reg->start; vaddr < reg->end; vaddr += PAGE_SIZE) {
+				ret = add_page(item, vma, pp, vaddr, pme,
+					       has_parent, pages);
+				if (ret) {
+					pr_debug("Pagemap full\n");
+					break;
+				}
+			}
+		}
+
+		if (!ret)
+			vaddr = walk_end;
+	}
+
+	*off = vaddr - vma->e->start;
+
+	account_iovs(nr_to_scan, pages);
 	return ret;
 }
 
@@ -307,6 +409,187 @@ static int xfer_pages(struct page_pipe *pp, struct page_xfer *xfer)
 	return ret;
 }
 
+/*
+ * Pipelined chunk mode. A drained chunk is written by a forked
+ * writer, while the parasite drains the next chunk into new pipes.
+ * Only one writer runs at a time, so that pagemap entries and pages
+ * get into images in the same order as without the pipeline. The
+ * iovs of the chunk stay intact in parasite args, as the following
+ * chunks take the next ones.
+ */
+static pid_t chunk_writer = -1;
+
+static inline bool mem_pipeline_on(struct page_pipe *pp)
+{
+	return opts.mem_dump_pipeline && (pp->flags & PP_CHUNK_MODE);
+}
+
+static int wait_chunk_writer(void)
+{
+	pid_t pid = chunk_writer;
+	int status;
+
+	if (pid < 0)
+		return 0;
+
+	chunk_writer = -1;
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait chunk writer %d", pid);
+		return -1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		pr_err("Chunk writer %d finished with error %d\n", pid, status);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int start_chunk_writer(struct page_pipe *pp, struct page_xfer *xfer)
+{
+	pid_t pid;
+
+	if (wait_chunk_writer())
+		return -1;
+
+	if (page_xfer_flush(xfer))
+		return -1;
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork chunk writer");
+		return -1;
+	}
+
+	if (pid == 0) {
+		int ret;
+
+		ret = xfer_pages(pp, xfer);
+		if (!ret)
+			ret = page_xfer_flush(xfer);
+		exit(ret ? 1 : 0);
+	}
+
+	chunk_writer = pid;
+	pr_debug("Chunk of %u pipes is written by %d\n", pp->nr_pipes, pid);
+
+	return page_pipe_reinit_new(pp);
+}
+
+/*
+ * Memory dump workers. When enabled, pages drained from a task into
+ * the page pipe are written into images (or sent to the page server
+ * through a connection of their own) by a forked helper, while
+ * we go on dumping the rest of the tree. At most opts.mem_dump_workers
+ * of them run at a time, the oldest one is waited for when the pool
+ * is full.
+ */
+static pid_t *mem_workers;
+static int mem_workers_head, mem_workers_nr;
+
+static inline bool mem_dump_workers_on(struct mem_dump_ctl *mdc)
+{
+	return opts.mem_dump_workers && !mdc->pre_dump && !mdc->lazy;
+}
+
+static int retire_mem_dump_worker(void)
+{
+	pid_t pid = mem_workers[mem_workers_head];
+	int status;
+
+	mem_workers_head = (mem_workers_head + 1) % opts.mem_dump_workers;
+	mem_workers_nr--;
+
+	/*
+	 * Wait for the exact pid, the dumpee tasks are
+	 * our children too.
+	 */
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait memory dump worker %d", pid);
+		return -1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		pr_err("Memory dump worker %d finished with error %d\n", pid, status);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int start_mem_dump_worker(struct pstree_item *item, struct page_pipe *pp)
+{
+	int slot;
+	pid_t pid;
+
+	if (!mem_workers) {
+		mem_workers = xmalloc(opts.mem_dump_workers * sizeof(pid_t));
+		if (!mem_workers)
+			return -1;
+	}
+
+	if (mem_workers_nr == opts.mem_dump_workers &&
+			retire_mem_dump_worker())
+		return -1;
+
+	slot = (mem_workers_head + mem_workers_nr) % opts.mem_dump_workers;
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork memory dump worker");
+		return -1;
+	}
+
+	if (pid == 0) {
+		struct page_xfer xfer = { .parent = NULL };
+		int ret;
+
+		/* No other worker uses the slot's connection */
+		if (opts.use_page_server)
+			page_server_use_stripe(slot);
+
+		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, vpid(item));
+		if (!ret) {
+			xfer.transfer_lazy = true;
+			ret = page_xfer_dump_pages(&xfer, pp);
+			xfer.close(&xfer);
+		}
+		if (!ret)
+			ret = bfd_flush_images();
+		if (!ret && page_compress_failed())
+			ret = -1;
+		exit(ret ? 1 : 0);
+	}
+
+	skip_page_id();
+
+	mem_workers[slot] = pid;
+	mem_workers_nr++;
+
+	pr_info("Pages of %d are written by worker %d\n",
+		item->pid->real, pid);
+	return 0;
+}
+
+int wait_mem_dump_workers(void)
+{
+	int ret = 0;
+
+	if (!mem_workers)
+		return 0;
+
+	timing_start(TIME_MEMWRITE);
+	while (mem_workers_nr)
+		if (retire_mem_dump_worker())
+			ret = -1;
+	timing_stop(TIME_MEMWRITE);
+
+	xfree(mem_workers);
+	mem_workers = NULL;
+	return ret;
+}
+
 static int detect_pid_reuse(struct pstree_item *item,
 			    struct proc_pid_stat* pps,
 			    InventoryEntry *parent_ie)
@@ -355,7 +638,7 @@ static int generate_vma_iovs(struct pstree_item *item, struct vma_area *vma,
 			     int parent_predump_mode)
 {
 	u64 off = 0;
-	u64 *map;
+	u64 *map = NULL;
 	int ret;
 
 	if (!vma_area_is_private(vma, kdat.task_size) &&
@@ -414,25 +697,33 @@ static int generate_vma_iovs(struct pstree_item *item, struct vma_area *vma,
 		has_parent = false;
 	}
 
-	map = pmc_get_map(pmc, vma);
-	if (!map)
-		return -1;
+	if (!vma_can_scan(vma)) {
+		map = pmc_get_map(pmc, vma);
+		if (!map)
+			return -1;
 
-	if (vma_area_is(vma, VMA_ANON_SHARED))
-		return add_shmem_area(item->pid->real, vma->e, map);
+		if (vma_area_is(vma, VMA_ANON_SHARED))
+			return add_shmem_area(item->pid->real, vma->e, map);
+	}
 
 again:
-	ret = generate_iovs(item,vma, pp, map, &off, has_parent);
+	if (map)
+		ret = generate_iovs(item,vma, pp, map, &off, has_parent);
+	else
+		ret = scan_iovs(item, vma, pp, pmc, &off, has_parent);
 	if (ret == -EAGAIN) {
 		BUG_ON(!(pp->flags & PP_CHUNK_MODE));
 
 		ret = drain_pages(pp, ctl, args);
-		if (!ret)
+		if (!ret && mem_pipeline_on(pp))
+			ret = start_chunk_writer(pp, xfer);
+		else if (!ret) {
 			ret = xfer_pages(pp, xfer);
-		if (!ret) {
-			page_pipe_reinit(pp);
-			goto again;
+			if (!ret)
+				page_pipe_reinit(pp);
 		}
+		if (!ret)
+			goto again;
 	}
 
 	return ret;
@@ -454,6 +745,7 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 	int possible_pid_reuse = 0;
 	bool has_parent;
 	int parent_predump_mode = -1;
+	bool workers = mem_dump_workers_on(mdc);
 
 	pr_info("\n");
 	pr_info("Dumping pages (type: %d pid: %d)\n", CR_FD_PAGES, item->pid->real);
@@ -474,20 +766,25 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 			 pmc_size * PAGE_SIZE))
 		return -1;
 
-	if (!(mdc->pre_dump || mdc->lazy))
+	if (!(mdc->pre_dump || mdc->lazy || workers))
 		/*
 		 * Chunk mode pushes pages portion by portion. This mode
 		 * only works when we don't need to keep pp for later
-		 * use, i.e. on non-lazy non-predump.
+		 * use, i.e. on non-lazy non-predump and when pages are
+		 * not handed over to a memory dump worker.
 		 */
 		cpp_flags |= PP_CHUNK_MODE;
+	/*
+	 * The worker's copy of iovs must not live in parasite args,
+	 * these are shared with the dumpee and get overwritten.
+	 */
 	pp = create_page_pipe(vma_area_list->nr_priv_pages,
-					    mdc->lazy ? NULL : pargs_iovs(args),
+					    (mdc->lazy || workers) ? NULL : pargs_iovs(args),
 					    cpp_flags);
 	if (!pp)
 		goto out;
 
-	if (!mdc->pre_dump) {
+	if (!mdc->pre_dump && !workers) {
 		/*
 		 * Regular dump -- create xfer object and send pages to it
 		 * right here. For pre-dumps the pp will be taken by the
@@ -531,7 +828,7 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 			goto out_xfer;
 	}
 
-	if (mdc->lazy)
+	if (mdc->lazy || workers)
 		memcpy(pargs_iovs(args), pp->iovs,
 		       sizeof(struct iovec) * pp->nr_iovs);
 
@@ -546,8 +843,13 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 	else
 		ret = drain_pages(pp, ctl, args);
 
-	if (!ret && !mdc->pre_dump)
-		ret = xfer_pages(pp, &xfer);
+	if (!ret && workers)
+		ret = start_mem_dump_worker(item, pp);
+	else if (!ret && !mdc->pre_dump) {
+		ret = wait_chunk_writer();
+		if (!ret)
+			ret = xfer_pages(pp, &xfer);
+	}
 	if (ret)
 		goto out_xfer;
 
@@ -562,7 +864,10 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 		goto out_xfer;
 	exit_code = 0;
 out_xfer:
-	if (!mdc->pre_dump)
+	/* On errors a chunk writer may still be using the images */
+	if (wait_chunk_writer())
+		exit_code = -1;
+	if (!mdc->pre_dump && !workers)
 		xfer.close(&xfer);
 out_pp:
 	if (ret || !(mdc->pre_dump || mdc->lazy))
@@ -657,6 +962,20 @@ int parasite_dump_pages_seized(struct pstree_item *item,
 	return ret;
 }
 
+/* A vma that had huge pages on dump and can have them back */
+static inline bool vma_premap_thp(struct vma_area *vma)
+{
+	return kdat.thp_size && vma_area_is(vma, VMA_AREA_THP) &&
+		vma_area_len(vma) >= kdat.thp_size;
+}
+
+/*
+ * The mm entries with all their vmas are kept till the end of
+ * restore, so unpack them into an arena rather than malloc-ing
+ * every vma entry separately.
+ */
+static struct pb_arena mm_arena;
+
 int prepare_mm_pid(struct pstree_item *i)
 {
 	pid_t pid = vpid(i);
@@ -668,7 +987,10 @@ int prepare_mm_pid(struct pstree_item *i)
 	if (!img)
 		return -1;
 
-	ret = pb_read_one_eof(img, &ri->mm, PB_MM);
+	if (!mm_arena.allocator.alloc)
+		pb_arena_init(&mm_arena);
+
+	ret = pb_read_one_arena(img, &ri->mm, PB_MM, &mm_arena);
 	close_image(img);
 	if (ret <= 0)
 		return ret;
@@ -700,7 +1022,7 @@ int prepare_mm_pid(struct pstree_item *i)
 		if (!img)
 			vma->e = ri->mm->vmas[vn++];
 		else {
-			ret = pb_read_one_eof(img, &vma->e, PB_VMA);
+			ret = pb_read_one_arena(img, &vma->e, PB_VMA, &mm_arena);
 			if (ret <= 0) {
 				xfree(vma);
 				close_image(img);
@@ -714,6 +1036,8 @@ int prepare_mm_pid(struct pstree_item *i)
 			ri->vmas.rst_priv_size += vma_area_len(vma);
 			if (vma_has_guard_gap_hidden(vma))
 				ri->vmas.rst_priv_size += PAGE_SIZE;
+			if (vma_premap_thp(vma))
+				ri->vmas.rst_priv_size += kdat.thp_size - PAGE_SIZE;
 		}
 
 		pr_info("vma 0x%"PRIx64" 0x%"PRIx64"\n", vma->e->start, vma->e->end);
@@ -800,6 +1124,18 @@ static void prepare_cow_vmas_for(struct vm_area_list *vmas, struct vm_area_list
 	}
 }
 
+/* Whether the task shares any private vma with its parent */
+bool task_inherits_vmas(struct pstree_item *t)
+{
+	struct vma_area *vma;
+
+	list_for_each_entry(vma, &rsti(t)->vmas.h, list)
+		if (vma_inherited(vma))
+			return true;
+
+	return false;
+}
+
 void prepare_cow_vmas(void)
 {
 	struct pstree_item *pi;
@@ -833,6 +1169,28 @@ void prepare_cow_vmas(void)
 	}
 }
 
+/*
+ * The huge pages of a premapped vma survive the mremap() into place
+ * only if the premapped copy has the same offset within a huge page
+ * as the vma itself, the gap in front of such a vma is unmapped.
+ */
+static int premap_align_thp(struct vma_area *vma, void **tgt_addr)
+{
+	unsigned long gap;
+
+	gap = (vma->e->start - (unsigned long)*tgt_addr) & (kdat.thp_size - 1);
+	if (!gap)
+		return 0;
+
+	if (munmap(*tgt_addr, gap)) {
+		pr_perror("Unable to unmap %p(%lx)", *tgt_addr, gap);
+		return -1;
+	}
+
+	*tgt_addr += gap;
+	return 0;
+}
+
 /* Map a private vma, if it is not mapped by a parent yet */
 static int premap_private_vma(struct pstree_item *t, struct vma_area *vma, void **tgt_addr)
 {
@@ -853,6 +1211,9 @@ static int premap_private_vma(struct pstree_item *t, struct vma_area *vma, void
 		vma->e->start -= PAGE_SIZE;
 
 	size = vma_entry_len(vma->e);
+	if (vma_premap_thp(vma) && premap_align_thp(vma, tgt_addr))
+		return -1;
+
 	if (!vma_inherited(vma)) {
 		int flag = 0;
 		/*
@@ -890,6 +1251,12 @@ static int premap_private_vma(struct pstree_item *t, struct vma_area *vma, void
 			pr_perror("Unable to map ANON_VMA");
 			return -1;
 		}
+
+		/* Let the content be read right into huge pages */
+		if (vma_premap_thp(vma) &&
+		    (vma->e->madv & (1ul << MADV_HUGEPAGE)) &&
+		    madvise(addr, size, MADV_HUGEPAGE))
+			pr_warn("Can't advise huge pages at %p: %m\n", addr);
 	} else {
 		void *paddr;
 
@@ -1025,6 +1392,52 @@ static int premap_priv_vmas(struct pstree_item *t, struct vm_area_list *vmas,
 	return ret;
 }
 
+/* How many pages of an inherited vma are read at once to be compared */
+#define COW_BATCH_PAGES		64
+
+static inline bool cow_page_same(void *p, struct page_hash *h)
+{
+	struct page_hash ph;
+
+	page_hash(p, &ph);
+	return page_hash_equal(&ph, h);
+}
+
+/*
+ * The pages of an inherited vma whose hashes are the same as the ones
+ * written on dump stay shared with the parent and are not read, the
+ * differing runs are read right into place. Returns the number of
+ * pages left shared.
+ */
+static int restore_cow_hashed(struct page_read *pr, unsigned long va,
+			      void *p, int nr, struct page_hash *h)
+{
+	bool same, next;
+	int i, j, shared = 0;
+
+	same = cow_page_same(p, &h[0]);
+	for (i = 0; i < nr; i = j, same = next) {
+		next = same;
+		for (j = i + 1; j < nr; j++) {
+			next = cow_page_same(p + j * PAGE_SIZE, &h[j]);
+			if (next != same)
+				break;
+		}
+
+		if (same) {
+			pr->skip_pages(pr, (j - i) * PAGE_SIZE);
+			shared += j - i;
+			continue;
+		}
+
+		if (pr->read_pages(pr, va + i * PAGE_SIZE, j - i,
+				   p + i * PAGE_SIZE, 0) < 0)
+			return -1;
+	}
+
+	return shared;
+}
+
 static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 {
 	struct vma_area *vma;
@@ -1038,6 +1451,10 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 	unsigned int nr_compared = 0;
 	unsigned int nr_lazy = 0;
 	unsigned long va;
+	void *cow_buf = NULL;
+	struct page_hash *cow_hashes = NULL;
+	unsigned long nr_cow_hashes = 0;
+	bool cow_hashes_tried = false;
 
 	vma = list_first_entry(vmas, struct vma_area, list);
 	rsti(t)->pages_img_id = pr->pages_img_id;
@@ -1067,8 +1484,8 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 		}
 
 		for (i = 0; i < nr_pages; i++) {
-			unsigned char buf[PAGE_SIZE];
 			void *p;
+			int nr;
 
 			/*
 			 * The lookup is over *all* possible VMAs
@@ -1125,37 +1542,79 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 			p = decode_pointer((off) * PAGE_SIZE +
 					vma->premmaped_addr);
 
-			set_bit(off, vma->page_bitmap);
-			if (vma_inherited(vma)) {
-				clear_bit(off, vma->pvma->page_bitmap);
+			/*
+			 * Try to read as many pages as possible at once.
+			 *
+			 * Within the t pagemap we still have
+			 * nr_pages - i pages (not all, as we might have
+			 * switched VMA above), within the t VMA
+			 * we have at most (vma->end - t_addr) bytes.
+			 */
+
+			nr = min_t(int, nr_pages - i, (vma->e->end - va) / PAGE_SIZE);
+
+			if (vma_inherited(vma) && !cow_hashes_tried) {
+				cow_hashes_tried = true;
+				if (page_hashes_load(pr->pages_img_id, &cow_hashes,
+						     &nr_cow_hashes) < 0) {
+					ret = -1;
+					goto err_read;
+				}
+			}
 
-				ret = pr->read_pages(pr, va, 1, buf, 0);
+			if (vma_inherited(vma) && cow_hashes &&
+			    pagemap_present(pr->pe) &&
+			    pr->pi_off / PAGE_SIZE + nr <= nr_cow_hashes) {
+				ret = restore_cow_hashed(pr, va, p, nr,
+						cow_hashes + pr->pi_off / PAGE_SIZE);
 				if (ret < 0)
 					goto err_read;
 
-				va += PAGE_SIZE;
-				nr_compared++;
+				bitmap_set(vma->page_bitmap, off, nr);
+				bitmap_clear(vma->pvma->page_bitmap, off, nr);
 
-				if (memcmp(p, buf, PAGE_SIZE) == 0) {
-					nr_shared++; /* the page is cowed */
-					continue;
+				va += nr * PAGE_SIZE;
+				nr_compared += nr;
+				nr_shared += ret;
+				nr_restored += nr - ret;
+				i += nr - 1;
+			} else if (vma_inherited(vma)) {
+				int j;
+
+				/* Pages to be compared are read in batches too */
+				if (!cow_buf) {
+					cow_buf = xmalloc(COW_BATCH_PAGES * PAGE_SIZE);
+					if (!cow_buf) {
+						ret = -1;
+						goto err_read;
+					}
 				}
 
-				nr_restored++;
-				memcpy(p, buf, PAGE_SIZE);
-			} else {
-				int nr;
+				nr = min_t(int, nr, COW_BATCH_PAGES);
+				ret = pr->read_pages(pr, va, nr, cow_buf, 0);
+				if (ret < 0)
+					goto err_read;
 
-				/*
-				 * Try to read as many pages as possible at once.
-				 *
-				 * Within the t pagemap we still have
-				 * nr_pages - i pages (not all, as we might have
-				 * switched VMA above), within the t VMA
-				 * we have at most (vma->end - t_addr) bytes.
-				 */
+				va += nr * PAGE_SIZE;
+				nr_compared += nr;
+				i += nr - 1;
+
+				for (j = 0; j < nr; j++, p += PAGE_SIZE) {
+					void *buf = cow_buf + j * PAGE_SIZE;
+
+					set_bit(off + j, vma->page_bitmap);
+					clear_bit(off + j, vma->pvma->page_bitmap);
 
-				nr = min_t(int, nr_pages - i, (vma->e->end - va) / PAGE_SIZE);
+					if (memcmp(p, buf, PAGE_SIZE) == 0) {
+						nr_shared++; /* the page is cowed */
+						continue;
+					}
+
+					nr_restored++;
+					memcpy(p, buf, PAGE_SIZE);
+				}
+			} else {
+				set_bit(off, vma->page_bitmap);
 
 				ret = pr->read_pages(pr, va, nr, p, PR_ASYNC);
 				if (ret < 0)
@@ -1172,6 +1631,8 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 	}
 
 err_read:
+	xfree(cow_buf);
+	xfree(cow_hashes);
 	if (pr->sync(pr))
 		return -1;
 
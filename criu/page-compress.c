@@ -0,0 +1,361 @@
+#include <unistd.h>
+#include <string.h>
+
+#ifdef CONFIG_HAS_LZ4
+#include <lz4.h>
+#endif
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "page-compress: "
+
+#include "types.h"
+#include "page.h"
+#include "image.h"
+#include "page-compress.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "log.h"
+#include "protobuf.h"
+#include "images/pagemap.pb-c.h"
+
+struct page_compress {
+	struct cr_img	*fi;		/* page-frames image */
+	char		*buf;		/* pages of the current frame */
+	unsigned long	fill;		/* how many bytes are in buf */
+	char		*cbuf;		/* compressed frame */
+	int		cbuf_size;
+	u64		off;		/* where next frame goes in pages image */
+};
+
+struct pages_frame {
+	u64		off;
+	u32		len;
+};
+
+struct page_decompress {
+	struct pages_frame	*frames;
+	unsigned long		nr_frames;
+	u32			frame_size;
+
+	char			*buf;		/* inflated frame */
+	long			cur;		/* which frame is in buf */
+	unsigned long		cur_len;
+	char			*cbuf;
+	u32			cbuf_size;
+};
+
+#ifdef CONFIG_HAS_LZ4
+static int compress_bound(int len)
+{
+	return LZ4_compressBound(len);
+}
+
+static int compress_frame(const char *src, int len, char *dst, int dst_len)
+{
+	return LZ4_compress_default(src, dst, len, dst_len);
+}
+
+static int decompress_frame(const char *src, int len, char *dst, int dst_len)
+{
+	return LZ4_decompress_safe(src, dst, len, dst_len);
+}
+#else
+static int compress_bound(int len)
+{
+	pr_err("CRIU was built without LZ4 support\n");
+	return 0;
+}
+
+#define compress_frame(src, len, dst, dst_len)		(0)
+#define decompress_frame(src, len, dst, dst_len)	(-1)
+#endif
+
+struct page_compress *page_compress_open(u32 pages_id)
+{
+	PagesFramesHead h = PAGES_FRAMES_HEAD__INIT;
+	struct page_compress *pc;
+
+	pc = xzalloc(sizeof(*pc));
+	if (!pc)
+		return NULL;
+
+	pc->cbuf_size = compress_bound(PAGES_FRAME_SIZE);
+	if (pc->cbuf_size <= 0)
+		goto err;
+
+	pc->buf = xmalloc(PAGES_FRAME_SIZE);
+	pc->cbuf = xmalloc(pc->cbuf_size);
+	if (!pc->buf || !pc->cbuf)
+		goto err;
+
+	pc->fi = open_image(CR_FD_PAGES_FRAMES, O_DUMP, pages_id);
+	if (!pc->fi)
+		goto err;
+
+	h.codec = PAGES_CODEC__PAGES_LZ4;
+	h.frame_size = PAGES_FRAME_SIZE;
+	if (pb_write_one(pc->fi, &h, PB_PAGES_FRAMES_HEAD) < 0) {
+		close_image(pc->fi);
+		goto err;
+	}
+
+	return pc;
+
+err:
+	xfree(pc->buf);
+	xfree(pc->cbuf);
+	xfree(pc);
+	return NULL;
+}
+
+static int flush_frame(struct page_compress *pc, struct cr_img *pi)
+{
+	PagesFrameEntry fe = PAGES_FRAME_ENTRY__INIT;
+	int len;
+
+	if (!pc->fill)
+		return 0;
+
+	len = compress_frame(pc->buf, pc->fill, pc->cbuf, pc->cbuf_size);
+	if (len <= 0) {
+		pr_err("Can't compress %lu bytes of pages\n", pc->fill);
+		return -1;
+	}
+
+	if (write_img_buf(pi, pc->cbuf, len))
+		return -1;
+
+	fe.off = pc->off;
+	fe.len = len;
+	if (pb_write_one(pc->fi, &fe, PB_PAGES_FRAME) < 0)
+		return -1;
+
+	pr_debug("Frame %lu -> %d bytes at %"PRIu64"\n", pc->fill, len, pc->off);
+
+	pc->off += len;
+	pc->fill = 0;
+	return 0;
+}
+
+int page_compress_write(struct page_compress *pc, struct cr_img *pi,
+			int pipe, unsigned long len)
+{
+	while (len) {
+		unsigned long chunk;
+		ssize_t ret;
+
+		chunk = min(len, PAGES_FRAME_SIZE - pc->fill);
+		ret = read(pipe, pc->buf + pc->fill, chunk);
+		if (ret < 0) {
+			pr_perror("Can't read pages from pipe");
+			return -1;
+		}
+		if (ret == 0) {
+			pr_err("A pipe was closed unexpectedly\n");
+			return -1;
+		}
+
+		pc->fill += ret;
+		len -= ret;
+
+		if (pc->fill == PAGES_FRAME_SIZE && flush_frame(pc, pi))
+			return -1;
+	}
+
+	return 0;
+}
+
+static bool compress_failed = false;
+
+bool page_compress_failed(void)
+{
+	return compress_failed;
+}
+
+void page_compress_close(struct page_compress *pc, struct cr_img *pi)
+{
+	/*
+	 * The tail frame is written on close, which has no way
+	 * to report an error, so do it the bclose() way and let
+	 * the caller check page_compress_failed() at the end.
+	 */
+	if (flush_frame(pc, pi))
+		compress_failed = true;
+
+	close_image(pc->fi);
+	xfree(pc->buf);
+	xfree(pc->cbuf);
+	xfree(pc);
+}
+
+static int read_frames(struct page_decompress *pd, struct cr_img *fi)
+{
+	unsigned long nr = 0;
+
+	while (1) {
+		PagesFrameEntry *fe;
+		int ret;
+
+		ret = pb_read_one_eof(fi, &fe, PB_PAGES_FRAME);
+		if (ret <= 0)
+			return ret;
+
+		if (pd->nr_frames == nr) {
+			struct pages_frame *f;
+
+			nr = nr ? nr * 2 : 64;
+			f = xrealloc(pd->frames, nr * sizeof(*f));
+			if (!f) {
+				pages_frame_entry__free_unpacked(fe, NULL);
+				return -1;
+			}
+			pd->frames = f;
+		}
+
+		pd->frames[pd->nr_frames].off = fe->off;
+		pd->frames[pd->nr_frames].len = fe->len;
+		pd->nr_frames++;
+
+		if (fe->len > pd->cbuf_size)
+			pd->cbuf_size = fe->len;
+
+		pages_frame_entry__free_unpacked(fe, NULL);
+	}
+}
+
+int page_decompress_open(int dfd, u32 pages_id, struct page_decompress **ppd)
+{
+	struct page_decompress *pd = NULL;
+	PagesFramesHead *h = NULL;
+	struct cr_img *fi;
+	int ret = -1;
+
+	*ppd = NULL;
+
+	fi = open_image_at(dfd, CR_FD_PAGES_FRAMES, O_RSTR, pages_id);
+	if (!fi)
+		return -1;
+
+	if (empty_image(fi)) {
+		close_image(fi);
+		return 0;
+	}
+
+	if (pb_read_one(fi, &h, PB_PAGES_FRAMES_HEAD) < 0)
+		goto out;
+
+	if (h->codec != PAGES_CODEC__PAGES_LZ4) {
+		pr_err("Unknown codec %d of pages-%u\n", h->codec, pages_id);
+		goto out;
+	}
+
+	if (!h->frame_size || h->frame_size % PAGE_SIZE) {
+		pr_err("Bad frame size %u of pages-%u\n", h->frame_size, pages_id);
+		goto out;
+	}
+
+	pd = xzalloc(sizeof(*pd));
+	if (!pd)
+		goto out;
+
+	pd->frame_size = h->frame_size;
+	pd->cur = -1;
+
+	if (read_frames(pd, fi))
+		goto err;
+
+	pd->buf = xmalloc(pd->frame_size);
+	pd->cbuf = xmalloc(pd->cbuf_size ? : 1);
+	if (!pd->buf || !pd->cbuf)
+		goto err;
+
+	pr_info("pages-%u is compressed in %lu frames\n", pages_id, pd->nr_frames);
+	*ppd = pd;
+	ret = 1;
+out:
+	if (h)
+		pages_frames_head__free_unpacked(h, NULL);
+	close_image(fi);
+	return ret;
+
+err:
+	page_decompress_close(pd);
+	goto out;
+}
+
+static int load_frame(struct page_decompress *pd, struct cr_img *pi, long n)
+{
+	struct pages_frame *f;
+	size_t curr = 0;
+	int len;
+
+	if (pd->cur == n)
+		return 0;
+
+	if (n >= pd->nr_frames) {
+		pr_err("Frame %ld is out of pages image (%lu frames)\n",
+		       n, pd->nr_frames);
+		return -1;
+	}
+
+	f = &pd->frames[n];
+	while (curr < f->len) {
+		ssize_t ret;
+
+		ret = pread(img_raw_fd(pi), pd->cbuf + curr,
+			    f->len - curr, f->off + curr);
+		if (ret < 1) {
+			pr_perror("Can't read frame %ld (%zd)", n, ret);
+			return -1;
+		}
+		curr += ret;
+	}
+
+	len = decompress_frame(pd->cbuf, f->len, pd->buf, pd->frame_size);
+	if (len <= 0 || (n != pd->nr_frames - 1 && len != pd->frame_size)) {
+		pr_err("Can't decompress frame %ld (%d)\n", n, len);
+		pd->cur = -1;
+		return -1;
+	}
+
+	pd->cur = n;
+	pd->cur_len = len;
+	return 0;
+}
+
+int page_decompress_read(struct page_decompress *pd, struct cr_img *pi,
+			 void *buf, unsigned long len, off_t off)
+{
+	while (len) {
+		unsigned long foff, chunk;
+
+		if (load_frame(pd, pi, off / pd->frame_size))
+			return -1;
+
+		foff = off % pd->frame_size;
+		if (foff >= pd->cur_len) {
+			pr_err("Offset %jd is out of pages image\n", (intmax_t)off);
+			return -1;
+		}
+
+		chunk = min(len, pd->cur_len - foff);
+		memcpy(buf, pd->buf + foff, chunk);
+
+		buf += chunk;
+		off += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+void page_decompress_close(struct page_decompress *pd)
+{
+	if (!pd)
+		return;
+
+	xfree(pd->frames);
+	xfree(pd->buf);
+	xfree(pd->cbuf);
+	xfree(pd);
+}
@@ -0,0 +1,293 @@
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "page-hash: "
+
+#include "types.h"
+#include "page.h"
+#include "image.h"
+#include "page-hash.h"
+#include "xmalloc.h"
+#include "log.h"
+
+/*
+ * The table keeps one entry per page written with --hash-pages,
+ * entries are never freed, they live as long as the dump does.
+ */
+
+struct page_hash_ent {
+	struct page_hash_ent	*next;
+	u64			hash;
+	u64			off;
+	u32			id;
+};
+
+#define PAGE_HASH_INIT_SIZE	(1 << 14)
+#define PAGE_HASH_ENTS_CHUNK	4096
+
+static struct page_hash_ent **page_hash_table;
+static unsigned long page_hash_size;
+static unsigned long page_hash_nr;
+
+static struct page_hash_ent *free_ents;
+static unsigned long nr_free_ents;
+
+/* Pages images a hash hit is read back from to compare the contents */
+#define PAGE_HASH_IMGS		8
+
+static struct {
+	u32		id;
+	struct cr_img	*img;
+} rb_imgs[PAGE_HASH_IMGS];
+static int rb_next;
+static void *rb_page;
+
+bool page_zero_filled(void *page)
+{
+	u64 *w = page;
+	unsigned long i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*w); i++)
+		if (w[i])
+			return false;
+
+	return true;
+}
+
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+
+static inline u64 hash_round(u64 acc, u64 w)
+{
+	acc += w * PRIME64_2;
+	acc = (acc << 31) | (acc >> 33);
+	return acc * PRIME64_1;
+}
+
+static inline u64 hash_mix(u64 h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline u64 rotl64(u64 v, int r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+/*
+ * Four independent lanes let the multiplications overlap. Their 256
+ * bits of state are folded into two halves in different ways, the
+ * final mix spreads the bits so that the low ones pick a bucket.
+ */
+void page_hash(void *page, struct page_hash *ph)
+{
+	u64 h[4] = { PRIME64_1, PRIME64_2, 0, -PRIME64_1 };
+	u64 *w = page;
+	unsigned long i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*w); i += 4) {
+		h[0] = hash_round(h[0], w[i + 0]);
+		h[1] = hash_round(h[1], w[i + 1]);
+		h[2] = hash_round(h[2], w[i + 2]);
+		h[3] = hash_round(h[3], w[i + 3]);
+	}
+
+	ph->lo = hash_mix(h[0] ^ (h[1] * 3) ^ (h[2] * 5) ^ (h[3] * 7));
+	ph->hi = hash_mix(rotl64(h[0], 29) ^ (h[1] * 7) ^
+			  rotl64(h[2], 47) ^ (h[3] * 3) ^ ph->lo);
+}
+
+static struct cr_img *rb_image(u32 id)
+{
+	struct cr_img *img;
+	int i;
+
+	for (i = 0; i < PAGE_HASH_IMGS; i++)
+		if (rb_imgs[i].img && rb_imgs[i].id == id)
+			return rb_imgs[i].img;
+
+	img = open_image(CR_FD_PAGES, O_RSTR, id);
+	if (!img)
+		return NULL;
+
+	i = rb_next;
+	rb_next = (rb_next + 1) % PAGE_HASH_IMGS;
+	if (rb_imgs[i].img)
+		close_image(rb_imgs[i].img);
+	rb_imgs[i].img = img;
+	rb_imgs[i].id = id;
+
+	return img;
+}
+
+static void *read_back(struct page_hash_img *hi, struct page_hash_ent *e)
+{
+	struct cr_img *img;
+	size_t curr = 0;
+
+	/* The page may not have reached the image yet */
+	if (e->id == hi->pages_id && e->off >= hi->written)
+		return hi->pending + (e->off - hi->written);
+
+	if (!rb_page) {
+		rb_page = xmalloc(PAGE_SIZE);
+		if (!rb_page)
+			return NULL;
+	}
+
+	img = rb_image(e->id);
+	if (!img)
+		return NULL;
+
+	while (curr < PAGE_SIZE) {
+		ssize_t ret;
+
+		ret = pread(img_raw_fd(img), rb_page + curr,
+			    PAGE_SIZE - curr, e->off + curr);
+		if (ret < 1) {
+			pr_perror("Can't read back page at %"PRIu64" of pages-%u (%zd)",
+				  e->off, e->id, ret);
+			return NULL;
+		}
+		curr += ret;
+	}
+
+	return rb_page;
+}
+
+int page_hash_find(struct page_hash_img *hi, void *page, u64 hash,
+		   u32 *id, u64 *off)
+{
+	struct page_hash_ent *e;
+
+	if (!page_hash_table)
+		return 0;
+
+	for (e = page_hash_table[hash & (page_hash_size - 1)]; e; e = e->next) {
+		void *copy;
+
+		if (e->hash != hash)
+			continue;
+
+		copy = read_back(hi, e);
+		if (!copy)
+			return -1;
+
+		if (memcmp(copy, page, PAGE_SIZE))
+			continue;
+
+		*id = e->id;
+		*off = e->off;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int page_hash_grow(void)
+{
+	struct page_hash_ent **table;
+	unsigned long size, i;
+
+	size = page_hash_size ? page_hash_size * 2 : PAGE_HASH_INIT_SIZE;
+	table = xzalloc(size * sizeof(*table));
+	if (!table)
+		return -1;
+
+	for (i = 0; i < page_hash_size; i++) {
+		struct page_hash_ent *e, *n;
+
+		for (e = page_hash_table[i]; e; e = n) {
+			n = e->next;
+			e->next = table[e->hash & (size - 1)];
+			table[e->hash & (size - 1)] = e;
+		}
+	}
+
+	xfree(page_hash_table);
+	page_hash_table = table;
+	page_hash_size = size;
+
+	pr_debug("Grew to %lu buckets for %lu pages\n", size, page_hash_nr);
+	return 0;
+}
+
+int page_hash_add(u64 hash, u32 id, u64 off)
+{
+	struct page_hash_ent *e, **b;
+
+	if (page_hash_nr >= page_hash_size * 2 && page_hash_grow())
+		return -1;
+
+	if (!nr_free_ents) {
+		free_ents = xmalloc(PAGE_HASH_ENTS_CHUNK * sizeof(*free_ents));
+		if (!free_ents)
+			return -1;
+		nr_free_ents = PAGE_HASH_ENTS_CHUNK;
+	}
+
+	e = &free_ents[--nr_free_ents];
+	e->hash = hash;
+	e->id = id;
+	e->off = off;
+
+	b = &page_hash_table[hash & (page_hash_size - 1)];
+	e->next = *b;
+	*b = e;
+	page_hash_nr++;
+
+	return 0;
+}
+
+int page_hashes_load(u32 pages_id, struct page_hash **hashes,
+		     unsigned long *nr)
+{
+	struct cr_img *img;
+	struct stat st;
+	int ret = -1;
+
+	img = open_image(CR_FD_PAGE_HASHES, O_RSTR, pages_id);
+	if (!img)
+		return -1;
+
+	if (empty_image(img)) {
+		close_image(img);
+		return 0;
+	}
+
+	if (fstat(img_raw_fd(img), &st)) {
+		pr_perror("Can't stat page-hashes-%u", pages_id);
+		goto out;
+	}
+
+	if (st.st_size % sizeof(struct page_hash) || st.st_size > INT_MAX) {
+		pr_warn("Ignoring page-hashes-%u of %lld bytes\n",
+			pages_id, (long long)st.st_size);
+		ret = 0;
+		goto out;
+	}
+
+	*hashes = xmalloc(st.st_size ? : 1);
+	if (!*hashes)
+		goto out;
+
+	if (read_img_buf(img, *hashes, st.st_size) < 0) {
+		xfree(*hashes);
+		goto out;
+	}
+
+	*nr = st.st_size / sizeof(struct page_hash);
+	ret = 1;
+out:
+	close_image(img);
+	return ret;
+}
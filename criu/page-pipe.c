@@ -249,6 +249,33 @@ void page_pipe_reinit(struct page_pipe *pp)
 		BUG(); /* It can't fail, because ppb is in free_bufs */
 }
 
+/*
+ * Same as page_pipe_reinit(), but the pipes are closed rather than
+ * reused. The pages sitting in them are still to be read by a chunk
+ * writer, which has its own copies of the pipes (see mem.c).
+ */
+int page_pipe_reinit_new(struct page_pipe *pp)
+{
+	struct page_pipe_buf *ppb, *n;
+	int i;
+
+	BUG_ON(!(pp->flags & PP_CHUNK_MODE));
+
+	pr_debug("Drop page pipe bufs\n");
+
+	list_splice_init(&pp->free_bufs, &pp->bufs);
+	list_for_each_entry_safe(ppb, n, &pp->bufs, l)
+		ppb_destroy(ppb);
+	INIT_LIST_HEAD(&pp->bufs);
+
+	pp->nr_pipes = 0;
+	for (i = 0; i < PP_PIPE_TYPES; i++)
+		pp->prev[i] = NULL;
+	pp->free_hole = 0;
+
+	return page_pipe_grow(pp, 0);
+}
+
 static inline int try_add_page_to(struct page_pipe *pp, struct page_pipe_buf *ppb,
 		unsigned long addr, unsigned int flags)
 {
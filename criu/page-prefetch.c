@@ -0,0 +1,250 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "page-prefetch: "
+
+#include "types.h"
+#include "common/compiler.h"
+#include "cr_options.h"
+#include "image.h"
+#include "namespaces.h"
+#include "pagemap.h"
+#include "page-prefetch.h"
+#include "pstree.h"
+#include "xmalloc.h"
+#include "log.h"
+
+static pid_t *prefetch_workers;
+static int nr_prefetch_workers;
+
+/*
+ * The pages images are found once, before the workers are forked,
+ * so that they don't each open and parse the pagemaps of all tasks.
+ */
+struct prefetch_image {
+	int	fd;
+	off_t	size;
+};
+
+static struct prefetch_image *prefetch_images;
+static int nr_prefetch_images;
+
+/*
+ * One readahead() call reads no more than the device's readahead
+ * window (often 128K), so chunks are read ahead in such steps.
+ */
+#define PAGES_PREFETCH_STEP	(128 << 10)
+
+static int add_prefetch_image(struct cr_img *img)
+{
+	struct prefetch_image *pi;
+	struct stat st;
+	int fd;
+
+	fd = img_raw_fd(img);
+	if (fd < 0 || fstat(fd, &st))
+		return 0;
+
+	pi = xrealloc(prefetch_images, (nr_prefetch_images + 1) * sizeof(*pi));
+	if (!pi)
+		return -1;
+	prefetch_images = pi;
+
+	pi = &prefetch_images[nr_prefetch_images];
+	pi->fd = dup(fd);
+	if (pi->fd < 0) {
+		pr_perror("Can't dup pages image");
+		return -1;
+	}
+	pi->size = st.st_size;
+	nr_prefetch_images++;
+
+	return 0;
+}
+
+static int collect_prefetch_images(void)
+{
+	struct pstree_item *item;
+
+	for_each_pstree_item(item) {
+		struct page_read pr, *p;
+		int ret = 0;
+
+		if (!task_alive(item))
+			continue;
+
+		if (open_page_read(vpid(item), &pr, PR_TASK) <= 0)
+			continue;
+
+		/* Parents may be read only partly, but are needed likely */
+		for (p = &pr; p && !ret; p = p->parent)
+			ret = add_prefetch_image(p->pi);
+
+		pr.close(&pr);
+		if (ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void free_prefetch_images(void)
+{
+	int i;
+
+	for (i = 0; i < nr_prefetch_images; i++)
+		close(prefetch_images[i].fd);
+
+	xfree(prefetch_images);
+	prefetch_images = NULL;
+	nr_prefetch_images = 0;
+}
+
+static int prefetch_chunk(int fd, off_t off, off_t end)
+{
+	for (; off < end; off += PAGES_PREFETCH_STEP) {
+		if (readahead(fd, off, PAGES_PREFETCH_STEP)) {
+			pr_perror("Can't read ahead %lld of %d", (long long)off, fd);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Chunks are numbered across all the images, so that each worker
+ * gets its share of every big image and the images of the tasks
+ * restored first are read first.
+ */
+static int prefetch_pages(int idx, int nr)
+{
+	unsigned long chunk = 0;
+	int i;
+
+	for (i = 0; i < nr_prefetch_images; i++) {
+		struct prefetch_image *pi = &prefetch_images[i];
+		off_t off;
+
+		for (off = 0; off < pi->size; off += PAGES_PREFETCH_CHUNK, chunk++) {
+			if (chunk % nr != idx)
+				continue;
+
+			if (prefetch_chunk(pi->fd, off,
+					   min_t(off_t, off + PAGES_PREFETCH_CHUNK, pi->size)))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Without a new pid namespace the workers share the pid space with
+ * the tasks being restored, a worker that took some task's pid is
+ * replaced with another one.
+ */
+static bool pid_is_restored(pid_t pid)
+{
+	if (root_ns_mask & CLONE_NEWPID)
+		return false;
+
+	return pstree_pid_by_virt(pid) != NULL;
+}
+
+static pid_t fork_prefetch_worker(int idx, int nr)
+{
+	pid_t pid;
+
+again:
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork pages prefetch worker");
+		return -1;
+	}
+
+	if (pid == 0) {
+		if (pid_is_restored(getpid()))
+			exit(0);
+		exit(prefetch_pages(idx, nr) ? 1 : 0);
+	}
+
+	if (pid_is_restored(pid)) {
+		waitpid(pid, NULL, 0);
+		goto again;
+	}
+
+	return pid;
+}
+
+int start_pages_prefetch(void)
+{
+	int i, nr = opts.mem_restore_workers;
+
+	if (!nr)
+		return 0;
+
+	if (collect_prefetch_images())
+		goto err;
+
+	prefetch_workers = xmalloc(nr * sizeof(pid_t));
+	if (!prefetch_workers)
+		goto err;
+
+	for (i = 0; i < nr; i++) {
+		pid_t pid;
+
+		pid = fork_prefetch_worker(i, nr);
+		if (pid < 0) {
+			stop_pages_prefetch();
+			goto err;
+		}
+
+		prefetch_workers[nr_prefetch_workers++] = pid;
+	}
+
+	/* The workers have their copies of the images */
+	free_prefetch_images();
+
+	pr_info("Started %d pages prefetch workers\n", nr);
+	return 0;
+
+err:
+	free_prefetch_images();
+	return -1;
+}
+
+/*
+ * The workers that are still reading are of no use once the tasks
+ * have their memory, they are reaped by the SIGCHLD handler.
+ */
+void stop_pages_prefetch(void)
+{
+	int i;
+
+	for (i = 0; i < nr_prefetch_workers; i++)
+		if (prefetch_workers[i] > 0)
+			kill(prefetch_workers[i], SIGKILL);
+}
+
+bool pages_prefetch_reaped(pid_t pid, int status)
+{
+	int i;
+
+	for (i = 0; i < nr_prefetch_workers; i++) {
+		if (prefetch_workers[i] != pid)
+			continue;
+
+		prefetch_workers[i] = -1;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			pr_warn("Prefetch worker %d finished with %d\n", pid, status);
+		return true;
+	}
+
+	return false;
+}
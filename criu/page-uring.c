@@ -0,0 +1,336 @@
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef CONFIG_HAS_LIBURING
+#include <liburing.h>
+#endif
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "page-uring: "
+
+#include "types.h"
+#include "common/bug.h"
+#include "page-uring.h"
+#include "xmalloc.h"
+#include "log.h"
+
+#ifdef CONFIG_HAS_LIBURING
+
+struct uring_splice {
+	int		pipe;
+	int		fd;
+	unsigned int	len;
+	int		res;
+};
+
+struct page_uring {
+	struct io_uring		ring;
+	pid_t			owner;
+	unsigned int		nr_reads;	/* readv requests in flight */
+	unsigned int		nr_splices;	/* splices queued */
+	struct io_uring_sqe	*last;		/* ... and the last of them */
+	struct uring_splice	splices[PAGE_URING_DEPTH];
+};
+
+static bool opcode_supported(struct io_uring_probe *probe, int op)
+{
+	return op <= probe->last_op &&
+		(probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+static int ring_init(struct page_uring *pu)
+{
+	struct io_uring_probe *probe;
+	int ret;
+
+	ret = io_uring_queue_init(PAGE_URING_DEPTH, &pu->ring, 0);
+	if (ret < 0) {
+		pr_warn("Can't set up io_uring: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	/* IORING_OP_SPLICE appeared in 5.7, the probe itself in 5.6 */
+	probe = io_uring_get_probe_ring(&pu->ring);
+	if (!probe || !opcode_supported(probe, IORING_OP_READV) ||
+	    !opcode_supported(probe, IORING_OP_SPLICE)) {
+		pr_warn("io_uring can't readv or splice\n");
+		free(probe);
+		io_uring_queue_exit(&pu->ring);
+		return -1;
+	}
+	free(probe);
+
+	pu->owner = getpid();
+	pu->nr_reads = 0;
+	pu->nr_splices = 0;
+	return 0;
+}
+
+/*
+ * The rings are shared with forked children (chunk writers and dump
+ * workers), but liburing keeps its copy of the queue heads in private
+ * memory, so the parent's ring would be broken once a child used it.
+ * Each process sets up a ring of its own instead.
+ */
+static int ring_get(struct page_uring *pu)
+{
+	if (pu->owner == getpid())
+		return 0;
+
+	BUG_ON(pu->nr_reads || pu->nr_splices);
+	if (ring_init(pu)) {
+		pr_err("Can't set up io_uring in %d\n", getpid());
+		return -1;
+	}
+
+	return 0;
+}
+
+struct page_uring *page_uring_open(void)
+{
+	struct page_uring *pu;
+
+	pu = xmalloc(sizeof(*pu));
+	if (!pu)
+		return NULL;
+
+	if (ring_init(pu)) {
+		xfree(pu);
+		return NULL;
+	}
+
+	return pu;
+}
+
+void page_uring_close(struct page_uring *pu)
+{
+	if (pu->owner == getpid())
+		io_uring_queue_exit(&pu->ring);
+	xfree(pu);
+}
+
+int page_uring_readv(struct page_uring *pu, int fd,
+		     struct iovec *iov, int nr, off_t off, void *data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ring_get(pu))
+		return -1;
+
+	BUG_ON(pu->nr_splices || pu->nr_reads == PAGE_URING_DEPTH);
+
+	/* Submitted requests don't take room in the queue */
+	sqe = io_uring_get_sqe(&pu->ring);
+	BUG_ON(!sqe);
+
+	io_uring_prep_readv(sqe, fd, iov, nr, off);
+	io_uring_sqe_set_data(sqe, data);
+	pu->nr_reads++;
+
+	return 0;
+}
+
+static int wait_one(struct page_uring *pu, void **data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	do
+		ret = io_uring_wait_cqe(&pu->ring, &cqe);
+	while (ret == -EINTR);
+
+	if (ret < 0) {
+		pr_err("Can't wait for io_uring completion: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	*data = io_uring_cqe_get_data(cqe);
+	*res = cqe->res;
+	io_uring_cqe_seen(&pu->ring, cqe);
+
+	return 0;
+}
+
+static int submit(struct page_uring *pu, unsigned int nr)
+{
+	int ret;
+
+	ret = io_uring_submit(&pu->ring);
+	if (ret < 0) {
+		pr_err("Can't submit io_uring requests: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	if (ret != nr) {
+		pr_err("Submitted %d io_uring requests of %u\n", ret, nr);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Submits the readv-s queued so far and waits for one of them,
+ * *res is what the respective preadv() would have returned, or
+ * -errno.
+ */
+int page_uring_reap(struct page_uring *pu, void **data, int *res)
+{
+	unsigned int queued;
+
+	BUG_ON(!pu->nr_reads);
+
+	queued = io_uring_sq_ready(&pu->ring);
+	if (queued && submit(pu, queued))
+		return -1;
+
+	if (wait_one(pu, data, res))
+		return -1;
+
+	pu->nr_reads--;
+	return 0;
+}
+
+static int splice_all(int pipe, int fd, unsigned long len)
+{
+	while (len) {
+		ssize_t ret;
+
+		ret = splice(pipe, NULL, fd, NULL, len, SPLICE_F_MOVE);
+		if (ret == -1) {
+			pr_perror("Unable to splice data");
+			return -1;
+		}
+		if (ret == 0) {
+			pr_err("A pipe was closed unexpectedly\n");
+			return -1;
+		}
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int page_uring_splice(struct page_uring *pu, int pipe, int fd,
+		      unsigned long len)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_splice *s;
+
+	if (ring_get(pu))
+		return -1;
+
+	BUG_ON(pu->nr_reads);
+
+	if (len > UINT_MAX)
+		return splice_all(pipe, fd, len);
+
+	if (pu->nr_splices == PAGE_URING_DEPTH && page_uring_sync(pu))
+		return -1;
+
+	sqe = io_uring_get_sqe(&pu->ring);
+	BUG_ON(!sqe);
+
+	s = &pu->splices[pu->nr_splices++];
+	s->pipe = pipe;
+	s->fd = fd;
+	s->len = len;
+	s->res = -ECANCELED;
+
+	/*
+	 * Splices go from the pipes and into the image at their current
+	 * positions, so they are linked to run one after another.
+	 */
+	io_uring_prep_splice(sqe, pipe, -1, fd, -1, len, SPLICE_F_MOVE);
+	io_uring_sqe_set_data(sqe, s);
+	sqe->flags |= IOSQE_IO_LINK;
+	pu->last = sqe;
+
+	return 0;
+}
+
+int page_uring_sync(struct page_uring *pu)
+{
+	unsigned int i, nr = pu->nr_splices;
+
+	if (!nr)
+		return 0;
+
+	BUG_ON(pu->owner != getpid());
+
+	pu->nr_splices = 0;
+	pu->last->flags &= ~IOSQE_IO_LINK;
+	if (submit(pu, nr))
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		struct uring_splice *s;
+		void *data;
+		int res;
+
+		if (wait_one(pu, &data, &res))
+			return -1;
+
+		s = data;
+		s->res = res;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct uring_splice *s = &pu->splices[i];
+		unsigned int done = s->res > 0 ? s->res : 0;
+
+		if (s->res < 0 && s->res != -ECANCELED) {
+			pr_err("Unable to splice data: %s\n", strerror(-s->res));
+			return -1;
+		}
+
+		/*
+		 * A short splice breaks the chain and the rest of it is
+		 * canceled, finish them all in the same order.
+		 */
+		if (done < s->len && splice_all(s->pipe, s->fd, s->len - done))
+			return -1;
+	}
+
+	return 0;
+}
+
+#else /* CONFIG_HAS_LIBURING */
+
+struct page_uring *page_uring_open(void)
+{
+	pr_err("CRIU was built without io_uring support\n");
+	return NULL;
+}
+
+void page_uring_close(struct page_uring *pu)
+{
+}
+
+int page_uring_readv(struct page_uring *pu, int fd,
+		     struct iovec *iov, int nr, off_t off, void *data)
+{
+	return -1;
+}
+
+int page_uring_reap(struct page_uring *pu, void **data, int *res)
+{
+	return -1;
+}
+
+int page_uring_splice(struct page_uring *pu, int pipe, int fd,
+		      unsigned long len)
+{
+	return -1;
+}
+
+int page_uring_sync(struct page_uring *pu)
+{
+	return 0;
+}
+
+#endif /* CONFIG_HAS_LIBURING */
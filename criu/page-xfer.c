@@ -26,9 +26,20 @@
 #include "rst_info.h"
 #include "stats.h"
 #include "tls.h"
+#include "page-compress.h"
+#include "page-hash.h"
+#include "page-uring.h"
 
 static int page_server_sk = -1;
 
+/*
+ * Extra connections to the page server. Pagemaps and pages of
+ * the tasks are striped across them and the page_server_sk.
+ */
+static int *ps_stripes;
+static int nr_ps_stripes;
+static int ps_stripe = -1; /* the one a memory dump worker is bound to */
+
 struct page_server_iov {
 	u32	cmd;
 	u32	nr_pages;
@@ -49,6 +60,7 @@ static void psi2iovec(struct page_server_iov *ps, struct iovec *iov)
 #define PS_IOV_PARENT	5
 #define PS_IOV_ADD_F	6
 #define PS_IOV_GET	7
+#define PS_IOV_STRIPES	8
 
 #define PS_IOV_FLUSH		0x1023
 #define PS_IOV_FLUSH_N_CLOSE	0x1024
@@ -207,6 +219,27 @@ static void close_server_xfer(struct page_xfer *xfer)
 	xfer->sk = -1;
 }
 
+void page_server_use_stripe(int n)
+{
+	BUG_ON(n >= nr_ps_stripes);
+	ps_stripe = n;
+}
+
+static int page_server_stripe_sk(int fd_type, unsigned long img_id)
+{
+	int n;
+
+	if (ps_stripe >= 0)
+		return ps_stripes[ps_stripe];
+
+	/* Workers take the stripes, shmem always goes the main way */
+	if (!nr_ps_stripes || opts.mem_dump_workers || fd_type != CR_FD_PAGEMAP)
+		return page_server_sk;
+
+	n = img_id % (nr_ps_stripes + 1);
+	return n ? ps_stripes[n - 1] : page_server_sk;
+}
+
 static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, unsigned long img_id)
 {
 	char has_parent;
@@ -214,7 +247,7 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, unsigned l
 		.cmd = PS_IOV_OPEN2,
 	};
 
-	xfer->sk = page_server_sk;
+	xfer->sk = page_server_stripe_sk(fd_type, img_id);
 	xfer->write_pagemap = write_pagemap_to_server;
 	xfer->write_pages = write_pages_to_server;
 	xfer->close = close_server_xfer;
@@ -248,6 +281,12 @@ static int write_pages_loc(struct page_xfer *xfer,
 	ssize_t ret;
 	ssize_t curr = 0;
 
+	if (xfer->pc)
+		return page_compress_write(xfer->pc, xfer->pi, p, len);
+
+	if (xfer->pu)
+		return page_uring_splice(xfer->pu, p, img_raw_fd(xfer->pi), len);
+
 	while (1) {
 		ret = splice(p, NULL, img_raw_fd(xfer->pi), NULL, len - curr, SPLICE_F_MOVE);
 		if (ret == -1) {
@@ -266,6 +305,18 @@ static int write_pages_loc(struct page_xfer *xfer,
 	return 0;
 }
 
+/*
+ * With io_uring the pages are only taken from the pipes here,
+ * so it has to be called before the pipes are reused.
+ */
+static int page_xfer_sync(struct page_xfer *xfer)
+{
+	if (opts.use_page_server || !xfer->pu)
+		return 0;
+
+	return page_uring_sync(xfer->pu);
+}
+
 static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 {
 	int ret;
@@ -308,6 +359,52 @@ static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 	}
 }
 
+/*
+ * The working set hint. Lazy pages that were written both since the
+ * previous pre-dump and during that pre-dump (i.e. they are not in
+ * the parent's parent) are likely to be accessed again right after
+ * restore. Their pagemap entries get PE_HOT and the lazy-pages daemon
+ * transfers them before the rest.
+ */
+static int write_lazy_pagemap(struct page_xfer *xfer, PagemapEntry *pe)
+{
+	struct page_read *p = xfer->parent;
+	unsigned long off = pe->vaddr, end = off + pagemap_len(pe);
+	unsigned long start = off;
+	u32 flags = pe->flags;
+	bool run_hot = false;
+
+	while (off < end) {
+		unsigned long next = end;
+		bool hot = false;
+
+		if (p->seek_pagemap(p, off)) {
+			next = min_t(unsigned long, end,
+				     p->pe->vaddr + pagemap_len(p->pe));
+			hot = !pagemap_in_parent(p->pe);
+		} else if (p->pe && p->pe->vaddr > off && p->pe->vaddr < end)
+			next = p->pe->vaddr;
+
+		if (off != start && hot != run_hot) {
+			pe->vaddr = start;
+			pe->nr_pages = (off - start) / PAGE_SIZE;
+			pe->flags = run_hot ? flags | PE_HOT : flags;
+			if (pb_write_one(xfer->pmi, pe, PB_PAGEMAP) < 0)
+				return -1;
+			start = off;
+		}
+
+		run_hot = hot;
+		off = next;
+	}
+
+	pe->vaddr = start;
+	pe->nr_pages = (end - start) / PAGE_SIZE;
+	pe->flags = run_hot ? flags | PE_HOT : flags;
+
+	return pb_write_one(xfer->pmi, pe, PB_PAGEMAP) < 0 ? -1 : 0;
+}
+
 static int write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flags)
 {
 	int ret;
@@ -338,12 +435,274 @@ static int write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flag
 		}
 	}
 
+	if ((flags & PE_LAZY) && xfer->parent && xfer->parent->parent)
+		return write_lazy_pagemap(xfer, &pe);
+
+	if (pb_write_one(xfer->pmi, &pe, PB_PAGEMAP) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Hashing local xfer. Pages of PE_PRESENT entries are read from
+ * the pipe and looked up by contents, the pagemap entry is then
+ * split into runs of new, zero and duplicate pages, each run
+ * being a pagemap entry of its own. Only the new pages go into
+ * the pages image.
+ */
+
+#define HASH_XFER_PAGES	64
+
+enum {
+	HX_NEW,
+	HX_ZERO,
+	HX_DUP,
+};
+
+struct hash_xfer {
+	struct page_hash_img	hi;
+	struct iovec		pend;	/* pagemap entry pages are expected for */
+	u32			flags;
+	int			cnt;	/* stats counter of written pages */
+	void			*buf;	/* pages read from pipe */
+	unsigned long		nr_out;	/* new pages in hi.pending */
+	struct cr_img		*hashes_img;	/* hashes of pages in pages image */
+	struct page_hash	*hashes;	/* ... of the ones in hi.pending */
+
+	/* pages of one kind, to become one pagemap entry */
+	struct iovec		run;
+	int			run_kind;
+	u32			run_id;
+	u64			run_off;
+};
+
+static int write_pagemap_dup(struct page_xfer *xfer, struct iovec *iov,
+			     u32 flags, u32 id, u64 off)
+{
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+
+	pe.vaddr = encode_pointer(iov->iov_base);
+	pe.nr_pages = iov->iov_len / PAGE_SIZE;
+	pe.has_flags = true;
+	pe.flags = (flags & ~PE_PRESENT) | PE_DUP;
+	pe.has_dup_pages_id = true;
+	pe.dup_pages_id = id;
+	pe.has_dup_off = true;
+	pe.dup_off = off;
+
 	if (pb_write_one(xfer->pmi, &pe, PB_PAGEMAP) < 0)
 		return -1;
 
 	return 0;
 }
 
+static int flush_hash_run(struct page_xfer *xfer)
+{
+	struct hash_xfer *hx = xfer->hx;
+	int ret = 0;
+
+	if (!hx->run.iov_len)
+		return 0;
+
+	switch (hx->run_kind) {
+	case HX_NEW:
+		ret = write_pagemap_loc(xfer, &hx->run, hx->flags);
+		break;
+	case HX_ZERO:
+		ret = write_pagemap_loc(xfer, &hx->run,
+					(hx->flags & ~PE_PRESENT) | PE_ZERO);
+		break;
+	case HX_DUP:
+		ret = write_pagemap_dup(xfer, &hx->run, hx->flags,
+					hx->run_id, hx->run_off);
+		break;
+	}
+
+	hx->run.iov_len = 0;
+	return ret;
+}
+
+static int hash_one_page(struct page_xfer *xfer, void *page)
+{
+	struct hash_xfer *hx = xfer->hx;
+	void *vaddr = hx->pend.iov_base;
+	u32 id = 0;
+	u64 off = 0;
+	int kind;
+
+	if (page_zero_filled(page)) {
+		kind = HX_ZERO;
+		cnt_add(CNT_PAGES_ZERO, 1);
+		cnt_sub(hx->cnt, 1);
+	} else {
+		struct page_hash hash;
+		int ret;
+
+		page_hash(page, &hash);
+		ret = page_hash_find(&hx->hi, page, hash.lo, &id, &off);
+		if (ret < 0)
+			return -1;
+
+		if (ret) {
+			kind = HX_DUP;
+			cnt_add(CNT_PAGES_DUP, 1);
+			cnt_sub(hx->cnt, 1);
+		} else {
+			kind = HX_NEW;
+			id = hx->hi.pages_id;
+			off = hx->hi.written + hx->nr_out * PAGE_SIZE;
+			memcpy(hx->hi.pending + hx->nr_out * PAGE_SIZE, page, PAGE_SIZE);
+			hx->hashes[hx->nr_out] = hash;
+			hx->nr_out++;
+			if (page_hash_add(hash.lo, id, off))
+				return -1;
+		}
+	}
+
+	hx->pend.iov_base += PAGE_SIZE;
+	hx->pend.iov_len -= PAGE_SIZE;
+
+	if (hx->run.iov_len && hx->run_kind == kind &&
+	    (kind != HX_DUP || (hx->run_id == id &&
+				hx->run_off + hx->run.iov_len == off))) {
+		hx->run.iov_len += PAGE_SIZE;
+		return 0;
+	}
+
+	if (flush_hash_run(xfer))
+		return -1;
+
+	hx->run.iov_base = vaddr;
+	hx->run.iov_len = PAGE_SIZE;
+	hx->run_kind = kind;
+	hx->run_id = id;
+	hx->run_off = off;
+	return 0;
+}
+
+static int write_pagemap_hash(struct page_xfer *xfer, struct iovec *iov, u32 flags)
+{
+	struct hash_xfer *hx = xfer->hx;
+
+	if (hx->pend.iov_len) {
+		pr_err("Pages %p/%zu were not written\n",
+		       hx->pend.iov_base, hx->pend.iov_len);
+		return -1;
+	}
+
+	if (!(flags & PE_PRESENT))
+		return write_pagemap_loc(xfer, iov, flags);
+
+	hx->pend = *iov;
+	hx->flags = flags;
+	return 0;
+}
+
+static int write_pages_hash(struct page_xfer *xfer, int p, unsigned long len)
+{
+	struct hash_xfer *hx = xfer->hx;
+
+	if (len > hx->pend.iov_len) {
+		pr_err("Got %lu bytes of pages for %zu long pagemap\n",
+		       len, hx->pend.iov_len);
+		return -1;
+	}
+
+	while (len) {
+		unsigned long chunk, curr = 0;
+
+		chunk = min_t(unsigned long, len, HASH_XFER_PAGES * PAGE_SIZE);
+		while (curr < chunk) {
+			ssize_t ret;
+
+			ret = read(p, hx->buf + curr, chunk - curr);
+			if (ret < 0) {
+				pr_perror("Can't read pages from pipe");
+				return -1;
+			}
+			if (ret == 0) {
+				pr_err("A pipe was closed unexpectedly\n");
+				return -1;
+			}
+			curr += ret;
+		}
+
+		for (curr = 0; curr < chunk; curr += PAGE_SIZE)
+			if (hash_one_page(xfer, hx->buf + curr))
+				return -1;
+
+		if (hx->nr_out) {
+			if (write_img_buf(xfer->pi, hx->hi.pending,
+					  hx->nr_out * PAGE_SIZE))
+				return -1;
+			if (hx->hashes_img &&
+			    write_img_buf(hx->hashes_img, hx->hashes,
+					  hx->nr_out * sizeof(*hx->hashes)))
+				return -1;
+			hx->hi.written += hx->nr_out * PAGE_SIZE;
+			hx->nr_out = 0;
+		}
+
+		len -= chunk;
+	}
+
+	if (!hx->pend.iov_len)
+		return flush_hash_run(xfer);
+
+	return 0;
+}
+
+static struct hash_xfer *open_hash_xfer(int fd_type, u32 pages_id)
+{
+	struct hash_xfer *hx;
+
+	hx = xzalloc(sizeof(*hx));
+	if (!hx)
+		return NULL;
+
+	hx->buf = xmalloc(HASH_XFER_PAGES * PAGE_SIZE);
+	hx->hi.pending = xmalloc(HASH_XFER_PAGES * PAGE_SIZE);
+	hx->hashes = xmalloc(HASH_XFER_PAGES * sizeof(*hx->hashes));
+	if (!hx->buf || !hx->hi.pending || !hx->hashes)
+		goto err;
+
+	/*
+	 * Restore compares pages of inherited vmas with the parent's
+	 * ones by these hashes, there are no such vmas in shmem.
+	 */
+	if (fd_type == CR_FD_PAGEMAP) {
+		hx->hashes_img = open_image(CR_FD_PAGE_HASHES, O_DUMP, pages_id);
+		if (!hx->hashes_img)
+			goto err;
+	}
+
+	hx->hi.pages_id = pages_id;
+	hx->cnt = fd_type == CR_FD_PAGEMAP ? CNT_PAGES_WRITTEN : CNT_SHPAGES_WRITTEN;
+	return hx;
+
+err:
+	xfree(hx->buf);
+	xfree(hx->hi.pending);
+	xfree(hx->hashes);
+	xfree(hx);
+	return NULL;
+}
+
+static void close_hash_xfer(struct hash_xfer *hx)
+{
+	if (hx->pend.iov_len)
+		pr_warn("Pages %p/%zu were not written\n",
+			hx->pend.iov_base, hx->pend.iov_len);
+
+	if (hx->hashes_img)
+		close_image(hx->hashes_img);
+	xfree(hx->buf);
+	xfree(hx->hi.pending);
+	xfree(hx->hashes);
+	xfree(hx);
+}
+
 static void close_page_xfer(struct page_xfer *xfer)
 {
 	if (xfer->parent != NULL) {
@@ -351,6 +710,12 @@ static void close_page_xfer(struct page_xfer *xfer)
 		xfree(xfer->parent);
 		xfer->parent = NULL;
 	}
+	if (xfer->pc)
+		page_compress_close(xfer->pc, xfer->pi);
+	if (xfer->hx)
+		close_hash_xfer(xfer->hx);
+	if (xfer->pu)
+		page_uring_close(xfer->pu);
 	close_image(xfer->pi);
 	close_image(xfer->pmi);
 }
@@ -369,6 +734,31 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, unsigned lo
 		return -1;
 	}
 
+	xfer->pc = NULL;
+	if (opts.compress) {
+		xfer->pc = page_compress_open(pages_id);
+		if (!xfer->pc) {
+			close_image(xfer->pi);
+			close_image(xfer->pmi);
+			return -1;
+		}
+	}
+
+	xfer->hx = NULL;
+	if (opts.hash_pages) {
+		xfer->hx = open_hash_xfer(fd_type, pages_id);
+		if (!xfer->hx) {
+			close_image(xfer->pi);
+			close_image(xfer->pmi);
+			return -1;
+		}
+	}
+
+	/* Without a ring pages are spliced one iov at a time */
+	xfer->pu = NULL;
+	if (opts.io_uring && !xfer->pc && !xfer->hx && !opts.stream)
+		xfer->pu = page_uring_open();
+
 	/*
 	 * Open page-read for parent images (if it exists). It will
 	 * be used for two things:
@@ -408,8 +798,13 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, unsigned lo
 	}
 
 out:
-	xfer->write_pagemap = write_pagemap_loc;
-	xfer->write_pages = write_pages_loc;
+	if (xfer->hx) {
+		xfer->write_pagemap = write_pagemap_hash;
+		xfer->write_pages = write_pages_hash;
+	} else {
+		xfer->write_pagemap = write_pagemap_loc;
+		xfer->write_pages = write_pages_loc;
+	}
 	xfer->close = close_page_xfer;
 	return 0;
 }
@@ -872,6 +1267,11 @@ int page_xfer_predump_pages(int pid, struct page_xfer *xfer,
 			}
 		}
 
+		if (page_xfer_sync(xfer)) {
+			munmap(userbuf, BUFFER_SIZE);
+			return -1;
+		}
+
 		timing_stop(TIME_MEMWRITE);
 	}
 
@@ -917,9 +1317,33 @@ int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp)
 		}
 	}
 
+	if (page_xfer_sync(xfer))
+		return -1;
+
 	return dump_holes(xfer, pp, &cur_hole, NULL);
 }
 
+/*
+ * Local pagemaps are buffered and nothing may be left in the
+ * buffer when the xfer is handed over to a forked chunk writer
+ * (see mem.c), nor when the writer is done with it.
+ */
+int page_xfer_flush(struct page_xfer *xfer)
+{
+	if (opts.use_page_server)
+		return 0;
+
+	if (page_xfer_sync(xfer))
+		return -1;
+
+	if (bflush(&xfer->pmi->_x) < 0) {
+		pr_perror("Can't flush pagemap image");
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Return:
  *	 1 - if a parent image exists
@@ -1118,20 +1542,34 @@ static int page_server_add(int sk, struct page_server_iov *pi, u32 flags)
 				return -1;
 			}
 		} else {
-			chunk = splice(sk, NULL, cxfer.p[1], NULL, chunk,
-					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			ssize_t ret, got = 0;
 
-			if (chunk < 0) {
-				pr_perror("Can't read from socket");
-				return -1;
-			}
-			if (chunk == 0) {
-				pr_err("A socket was closed unexpectedly\n");
-				return -1;
+			/*
+			 * Take all the socket has already received before
+			 * draining the pipe, one splice only moves what is
+			 * in the socket queue at the moment.
+			 */
+			while (got < chunk) {
+				ret = splice(sk, NULL, cxfer.p[1], NULL, chunk - got,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (ret < 0) {
+					if (got && errno == EAGAIN)
+						break;
+					pr_perror("Can't read from socket");
+					return -1;
+				}
+				if (ret == 0) {
+					pr_err("A socket was closed unexpectedly\n");
+					return -1;
+				}
+				got += ret;
 			}
+
+			chunk = got;
 		}
 
-		if (lxfer->write_pages(lxfer, cxfer.p[0], chunk))
+		if (lxfer->write_pages(lxfer, cxfer.p[0], chunk) ||
+		    page_xfer_sync(lxfer))
 			return -1;
 
 		len -= chunk;
@@ -1186,6 +1624,99 @@ static int page_server_get_pages(int sk, struct page_server_iov *pi)
 	return 0;
 }
 
+/*
+ * Each extra connection the client asks for is served by a forked
+ * page server. They all write into the same images dir, so the
+ * images of the tasks sent through any of them form one set.
+ */
+static int ps_listen_sk = -1;
+static pid_t *ps_stripe_pids;
+static int nr_ps_stripe_pids;
+
+static int page_server_serve(int sk);
+
+static int page_server_stripes(int sk, struct page_server_iov *pi)
+{
+	int32_t nr = 0;
+	int i;
+
+	if (ps_listen_sk >= 0 && !ps_stripe_pids && !opts.lazy_pages)
+		nr = min_t(int32_t, pi->nr_pages, opts.ps_connections - 1);
+
+	if (__send(sk, &nr, sizeof(nr), 0) != sizeof(nr)) {
+		pr_perror("Unable to send response");
+		return -1;
+	}
+
+	if (!nr)
+		return 0;
+
+	ps_stripe_pids = xmalloc(nr * sizeof(pid_t));
+	if (!ps_stripe_pids)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		pid_t pid;
+		int ask;
+
+		ask = accept(ps_listen_sk, NULL, NULL);
+		if (ask < 0) {
+			pr_perror("Can't accept connection %d to page server", i + 1);
+			return -1;
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			pr_perror("Can't fork page server for connection %d", i + 1);
+			close(ask);
+			return -1;
+		}
+
+		if (pid == 0) {
+			close(sk);
+			close_safe(&ps_listen_sk);
+			close(cxfer.p[0]);
+			close(cxfer.p[1]);
+			nr_ps_stripe_pids = 0;
+
+			stripe_page_ids(i + 1);
+			exit(page_server_serve(ask) ? 1 : 0);
+		}
+
+		close(ask);
+		ps_stripe_pids[nr_ps_stripe_pids++] = pid;
+	}
+
+	pr_info("Serving %d extra connections\n", nr);
+	return 0;
+}
+
+static int wait_page_server_stripes(void)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < nr_ps_stripe_pids; i++) {
+		int status;
+
+		if (waitpid(ps_stripe_pids[i], &status, 0) != ps_stripe_pids[i]) {
+			pr_perror("Can't wait page server %d", ps_stripe_pids[i]);
+			ret = -1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			pr_err("Page server %d finished with error %d\n",
+			       ps_stripe_pids[i], status);
+			ret = -1;
+		}
+	}
+
+	xfree(ps_stripe_pids);
+	ps_stripe_pids = NULL;
+	nr_ps_stripe_pids = 0;
+	return ret;
+}
+
 static int page_server_serve(int sk)
 {
 	int ret = -1;
@@ -1206,6 +1737,15 @@ static int page_server_serve(int sk)
 			return -1;
 		}
 
+		/*
+		 * Pages go from the socket into the image through this pipe
+		 * with no copies, the larger it is the less splices it takes
+		 * and the more socket buffer fragments it holds at once.
+		 * Unprivileged page server may be limited by pipe-max-size.
+		 */
+		if (fcntl(cxfer.p[0], F_SETPIPE_SZ, PIPE_MAX_SIZE * PAGE_SIZE) < 0)
+			pr_info("Can't grow xfer pipe, using the default one\n");
+
 		cxfer.pipe_size = fcntl(cxfer.p[0], F_GETPIPE_SZ, 0);
 		pr_debug("Created xfer pipe size %u\n", cxfer.pipe_size);
 	} else {
@@ -1278,6 +1818,9 @@ static int page_server_serve(int sk)
 		case PS_IOV_GET:
 			ret = page_server_get_pages(sk, &pi);
 			break;
+		case PS_IOV_STRIPES:
+			ret = page_server_stripes(sk, &pi);
+			break;
 		default:
 			pr_err("Unknown command %u\n", pi.cmd);
 			ret = -1;
@@ -1308,6 +1851,13 @@ static int page_server_serve(int sk)
 
 	tls_terminate_session();
 	page_server_close();
+	close_safe(&ps_listen_sk);
+
+	if (wait_page_server_stripes())
+		ret = -1;
+
+	if (page_compress_failed())
+		ret = -1;
 
 	pr_info("Session over\n");
 
@@ -1315,6 +1865,59 @@ static int page_server_serve(int sk)
 	return ret;
 }
 
+/*
+ * Compressed pages can't be spliced and zero or duplicate ones
+ * are not in the pages image at all, so read them with the page
+ * read and push into the pipe by hands. The pages go into pipes
+ * in the pagemap order, so the page read only walks forward.
+ */
+static int fill_page_pipe_read(struct page_read *pr,
+			       struct page_pipe_buf *ppb, struct iovec *iov)
+{
+	unsigned long vaddr = (unsigned long)iov->iov_base;
+	unsigned long end = vaddr + iov->iov_len;
+	void *buf, *p;
+	int ret = -1;
+	size_t curr = 0;
+
+	buf = xmalloc(iov->iov_len);
+	if (!buf)
+		return -1;
+
+	for (p = buf; vaddr < end; ) {
+		unsigned long len;
+
+		if (pr->seek_pagemap(pr, vaddr) <= 0) {
+			pr_err("Missing %lx in pagemap\n", vaddr);
+			goto out;
+		}
+
+		len = min_t(unsigned long, end,
+			    pr->pe->vaddr + pagemap_len(pr->pe)) - vaddr;
+		if (pr->read_pages(pr, vaddr, len / PAGE_SIZE, p, 0) < 0)
+			goto out;
+
+		vaddr += len;
+		p += len;
+	}
+
+	while (curr < iov->iov_len) {
+		ssize_t n;
+
+		n = write(ppb->p[1], buf + curr, iov->iov_len - curr);
+		if (n < 0) {
+			pr_perror("Can't write pages into pipe");
+			goto out;
+		}
+		curr += n;
+	}
+
+	ret = 0;
+out:
+	xfree(buf);
+	return ret;
+}
+
 static int fill_page_pipe(struct page_read *pr, struct page_pipe *pp)
 {
 	struct page_pipe_buf *ppb;
@@ -1337,10 +1940,18 @@ static int fill_page_pipe(struct page_read *pr, struct page_pipe *pp)
 		}
 	}
 
+	pr->reset(pr);
+
 	list_for_each_entry(ppb, &pp->bufs, l) {
 		for (i = 0; i < ppb->nr_segs; i++) {
 			struct iovec iov = ppb->iov[i];
 
+			if (pr->pd || pr->elided) {
+				if (fill_page_pipe_read(pr, ppb, &iov))
+					return -1;
+				continue;
+			}
+
 			if (splice(img_raw_fd(pr->pi), NULL, ppb->p[1], NULL,
 				   iov.iov_len, SPLICE_F_MOVE) != iov.iov_len) {
 				pr_perror("Splice failed");
@@ -1365,7 +1976,7 @@ static int page_pipe_from_pagemap(struct page_pipe **pp, int pid)
 	}
 
 	while (pr.advance(&pr))
-		if (pagemap_present(pr.pe))
+		if (!pagemap_in_parent(pr.pe))
 			nr_pages += pr.pe->nr_pages;
 
 	*pp = create_page_pipe(nr_pages, NULL, 0);
@@ -1438,6 +2049,16 @@ int cr_page_server(bool daemon_mode, bool lazy_dump, int cfd)
 	sk = setup_tcp_server("page", opts.addr, &opts.port);
 	if (sk == -1)
 		return -1;
+
+	/* The run_tcp_server() closes it after the first accept */
+	if (opts.ps_connections > 1) {
+		ps_listen_sk = dup(sk);
+		if (ps_listen_sk < 0) {
+			pr_perror("Can't keep page server socket");
+			close(sk);
+			return -1;
+		}
+	}
 no_server:
 
 	if (!daemon_mode && cfd >= 0) {
@@ -1453,8 +2074,10 @@ no_server:
 	}
 
 	ret = run_tcp_server(daemon_mode, &ask, cfd, sk);
-	if (ret != 0)
+	if (ret != 0) {
+		close_safe(&ps_listen_sk);
 		return ret > 0 ? 0 : -1;
+	}
 
 	if (tls_x509_init(ask, true)) {
 		close(sk);
@@ -1499,16 +2122,95 @@ out:
 	return 0;
 }
 
+static int connect_to_page_server_stripes(void)
+{
+	struct page_server_iov pi = {
+		.cmd = PS_IOV_STRIPES,
+		.nr_pages = opts.ps_connections - 1,
+	};
+	int32_t nr;
+
+	if (opts.ps_connections <= 1)
+		return 0;
+
+	if (send_psi(page_server_sk, &pi))
+		return -1;
+
+	tcp_nodelay(page_server_sk, true);
+
+	if (__recv(page_server_sk, &nr, sizeof(nr), 0) != sizeof(nr)) {
+		pr_perror("The page server doesn't answer");
+		return -1;
+	}
+
+	if (nr < 0 || nr > pi.nr_pages) {
+		pr_err("The page server accepts %d connections of %u\n",
+		       nr, pi.nr_pages);
+		return -1;
+	}
+
+	if (nr < pi.nr_pages)
+		pr_warn("The page server accepts %d extra connections of %u\n",
+			nr, pi.nr_pages);
+
+	if (!nr)
+		goto out;
+
+	ps_stripes = xmalloc(nr * sizeof(int));
+	if (!ps_stripes)
+		return -1;
+
+	while (nr_ps_stripes < nr) {
+		int sk;
+
+		sk = setup_tcp_client(opts.addr);
+		if (sk == -1)
+			return -1;
+
+		tcp_cork(sk, true);
+		ps_stripes[nr_ps_stripes++] = sk;
+	}
+
+	pr_info("Connected to the page server %d more times\n", nr);
+out:
+	/* Each memory dump worker sends pages through its own stripe */
+	if (opts.mem_dump_workers > nr) {
+		pr_warn("Only %d memory dump workers have connections "
+			"to the page server\n", nr);
+		opts.mem_dump_workers = nr;
+	}
+
+	return 0;
+}
+
 int connect_to_page_server_to_send(void)
 {
-	return connect_to_page_server();
+	if (connect_to_page_server())
+		return -1;
+
+	return connect_to_page_server_stripes();
 }
 
-int disconnect_from_page_server(void)
+static int flush_page_server(int sk, u32 cmd)
 {
-	struct page_server_iov pi = { };
+	struct page_server_iov pi = { .cmd = cmd, };
 	int32_t status = -1;
-	int ret = -1;
+
+	if (send_psi(sk, &pi))
+		return -1;
+
+	if (__recv(sk, &status, sizeof(status), 0) != sizeof(status)) {
+		pr_perror("The page server doesn't answer");
+		return -1;
+	}
+
+	return status;
+}
+
+int disconnect_from_page_server(void)
+{
+	int ret = 0;
+	u32 cmd;
 
 	if (!opts.use_page_server)
 		return 0;
@@ -1518,30 +2220,33 @@ int disconnect_from_page_server(void)
 
 	pr_info("Disconnect from the page server\n");
 
+	while (nr_ps_stripes) {
+		int sk = ps_stripes[--nr_ps_stripes];
+
+		if (!ret)
+			ret = flush_page_server(sk, PS_IOV_FLUSH);
+		close(sk);
+	}
+	xfree(ps_stripes);
+	ps_stripes = NULL;
+
 	if (opts.ps_socket != -1)
 		/*
 		 * The socket might not get closed (held by
 		 * the parent process) so we must order the
 		 * page-server to terminate itself.
 		 */
-		pi.cmd = PS_IOV_FLUSH_N_CLOSE;
+		cmd = PS_IOV_FLUSH_N_CLOSE;
 	else
-		pi.cmd = PS_IOV_FLUSH;
+		cmd = PS_IOV_FLUSH;
 
-	if (send_psi(page_server_sk, &pi))
-		goto out;
-
-	if (__recv(page_server_sk, &status, sizeof(status), 0) != sizeof(status)) {
-		pr_perror("The page server doesn't answer");
-		goto out;
-	}
+	if (!ret)
+		ret = flush_page_server(page_server_sk, cmd);
 
-	ret = 0;
-out:
 	tls_terminate_session();
 	close_safe(&page_server_sk);
 
-	return ret ? : status;
+	return ret;
 }
 
 struct ps_async_read {
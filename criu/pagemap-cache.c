@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "page.h"
 #include "pagemap-cache.h"
@@ -10,18 +11,42 @@
 #include "vma.h"
 #include "mem.h"
 #include "kerndat.h"
+#include "stats.h"
 
 #undef	LOG_PREFIX
 #define LOG_PREFIX "pagemap-cache: "
 
-/* To carry up to 2M of physical memory */
-#define PMC_SHIFT		(21)
-#define PMC_SIZE		(1ul << PMC_SHIFT)
-#define PMC_MASK		(~(PMC_SIZE - 1))
-#define PMC_SIZE_GAP		(PMC_SIZE / 4)
+/*
+ * The cache is filled with pagemap of a batch of VMAs, each one is
+ * read as a whole. A batch takes VMAs following each other in the
+ * list until either the buffer or the VMAs table is full, or there
+ * is a hole of more than PMC_GAP_MAX between two VMAs. Pagemap of
+ * the whole batch is read with one preadv(), VMAs are packed in the
+ * buffer and pagemap of the holes between them goes to a scratch
+ * buffer.
+ *
+ * The benefit (apart from reducing the number of read() calls) is
+ * to walk page tables less.
+ */
+
+/* To carry up to 64M of physical memory */
+#define PMC_SIZE		(64ul << 20)
+#define PMC_NR_VMAS		512
+#define PMC_NR_IOVS		256
+
+/* Holes are read over, unless they are bigger than this */
+#define PMC_GAP_MAX		(2ul << 20)
+
+#define PMC_NR_REGS		512
 
 #define PAGEMAP_LEN(addr)	(PAGE_PFN(addr) * sizeof(u64))
 
+struct pmc_vma {
+	unsigned long		start;
+	unsigned long		end;
+	unsigned long		off;		/* index of its pagemap in map */
+};
+
 /*
  * It's a workaround for a kernel bug. In the 3.19 kernel when pagemap are read
  * for a few vma-s for one read call, it returns incorrect data.
@@ -38,6 +63,7 @@ static inline void pmc_reset(pmc_t *pmc)
 static inline void pmc_zap(pmc_t *pmc)
 {
 	pmc->start = pmc->end = 0;
+	pmc->nr_vmas = pmc->cur = 0;
 }
 
 int pmc_init(pmc_t *pmc, pid_t pid, const struct list_head *vma_head, size_t size)
@@ -52,9 +78,17 @@ int pmc_init(pmc_t *pmc, pid_t pid, const struct list_head *vma_head, size_t siz
 	pmc->vma_head	= vma_head;
 
 	pmc->map = xmalloc(pmc->map_len);
-	if (!pmc->map)
+	pmc->gap = xmalloc(PAGEMAP_LEN(PMC_GAP_MAX));
+	pmc->vmas = xmalloc(PMC_NR_VMAS * sizeof(*pmc->vmas));
+	if (!pmc->map || !pmc->gap || !pmc->vmas)
 		goto err;
 
+	if (kdat.has_pagemap_scan) {
+		pmc->regs = xmalloc(PMC_NR_REGS * sizeof(*pmc->regs));
+		if (!pmc->regs)
+			goto err;
+	}
+
 	if (pagemap_cache_disabled)
 		pr_warn_once("The pagemap cache is disabled\n");
 
@@ -87,74 +121,87 @@ err:
 	return -1;
 }
 
-static inline u64 *__pmc_get_map(pmc_t *pmc, unsigned long addr)
+static u64 *__pmc_get_map(pmc_t *pmc, const struct vma_area *vma)
 {
-	return &pmc->map[PAGE_PFN(addr - pmc->start)];
+	unsigned int i;
+
+	if (vma->e->start < pmc->start || vma->e->end > pmc->end)
+		return NULL;
+
+	/* VMAs are asked for in the order of the list */
+	for (i = pmc->cur; i < pmc->nr_vmas; i++) {
+		struct pmc_vma *v = &pmc->vmas[i];
+
+		if (v->start > vma->e->start)
+			break;
+
+		if (v->start == vma->e->start && v->end >= vma->e->end) {
+			pmc->cur = i;
+			return &pmc->map[v->off];
+		}
+	}
+
+	return NULL;
 }
 
 static int pmc_fill_cache(pmc_t *pmc, const struct vma_area *vma)
 {
-	unsigned long low = vma->e->start & PMC_MASK;
-	unsigned long high = low + PMC_SIZE;
-	size_t len = vma_area_len(vma);
-	size_t size_map;
-
-	if (high > kdat.task_size)
-		high = kdat.task_size;
+	struct iovec iov[PMC_NR_IOVS];
+	unsigned long end = vma->e->start;
+	size_t off = 0, size_map = 0;
+	int nr_iovs = 0;
 
+	pmc_zap(pmc);
 	pmc->start = vma->e->start;
-	pmc->end = vma->e->end;
-
-	pr_debug("%d: filling VMA %lx-%lx (%zuK) [l:%lx h:%lx]\n",
-		 pmc->pid, (long)vma->e->start, (long)vma->e->end, len >> 10, low, high);
-
-	/*
-	 * If we meet a small VMA, lets try to fit 2M cache
-	 * window at least 75% full, otherwise left as a plain
-	 * "one vma at a time" read. Note the VMAs in cache must
-	 * fit in solid manner, iow -- either the whole vma fits
-	 * the cache window, either plain read is used.
-	 *
-	 * The benefit (apart redusing the number of read() calls)
-	 * is to walk page tables less.
-	 */
-	if (!pagemap_cache_disabled &&
-	    len < PMC_SIZE && (vma->e->start - low) < PMC_SIZE_GAP) {
-		size_t size_cov = len;
-		size_t nr_vmas = 1;
-
-		pr_debug("\t%d: %16lx-%-16lx nr:%-5zu cov:%zu\n",
-			 pmc->pid, (long)vma->e->start, (long)vma->e->end, nr_vmas, size_cov);
-
-		list_for_each_entry_continue(vma, pmc->vma_head, list) {
-			if (vma->e->start > high || vma->e->end > high)
-				break;
 
-			BUG_ON(vma->e->start < low);
-			size_cov += vma_area_len(vma);
-			nr_vmas++;
+	list_for_each_entry_from(vma, pmc->vma_head, list) {
+		size_t len = PAGEMAP_LEN(vma_area_len(vma));
+		unsigned long gap = vma->e->start - end;
+
+		/*
+		 * The first VMA always fits, the map is at least as
+		 * long as the longest VMA.
+		 */
+		if (pmc->nr_vmas) {
+			if (pagemap_cache_disabled ||
+			    pmc->nr_vmas == PMC_NR_VMAS ||
+			    gap > PMC_GAP_MAX ||
+			    off + len > pmc->map_len ||
+			    (gap && nr_iovs + 2 > PMC_NR_IOVS))
+				break;
+		}
 
-			pr_debug("\t%d: %16lx-%-16lx nr:%-5zu cov:%zu\n",
-				 pmc->pid, (long)vma->e->start, (long)vma->e->end, nr_vmas, size_cov);
+		if (gap) {
+			iov[nr_iovs].iov_base = pmc->gap;
+			iov[nr_iovs].iov_len = PAGEMAP_LEN(gap);
+			size_map += iov[nr_iovs++].iov_len;
 		}
 
-		if (nr_vmas > 1) {
-			/*
-			 * Note we don't touch low bound since it's set
-			 * to first VMA start already and not updating it
-			 * allows us to save a couple of code bytes.
-			 */
-			pmc->end = high;
-			pr_debug("\t%d: cache  mode [l:%lx h:%lx]\n", pmc->pid, pmc->start, pmc->end);
+		if (gap || !nr_iovs) {
+			iov[nr_iovs].iov_base = (void *)pmc->map + off;
+			iov[nr_iovs++].iov_len = len;
 		} else
-			pr_debug("\t%d: simple mode [l:%lx h:%lx]\n", pmc->pid, pmc->start, pmc->end);
+			iov[nr_iovs - 1].iov_len += len;
+
+		pmc->vmas[pmc->nr_vmas].start = vma->e->start;
+		pmc->vmas[pmc->nr_vmas].end = vma->e->end;
+		pmc->vmas[pmc->nr_vmas].off = off / sizeof(u64);
+		pmc->nr_vmas++;
+
+		off += len;
+		size_map += len;
+		end = vma->e->end;
 	}
 
-	size_map = PAGEMAP_LEN(pmc->end - pmc->start);
-	BUG_ON(pmc->map_len < size_map);
+	pmc->end = end;
+
+	pr_debug("%d: filling %lx-%lx with %u VMAs (%zuK of pagemap, %d iovs)\n",
+		 pmc->pid, pmc->start, pmc->end, pmc->nr_vmas, off >> 10, nr_iovs);
+
 	BUG_ON(pmc->fd < 0);
 
-	if (pread(pmc->fd, pmc->map, size_map, PAGEMAP_PFN_OFF(pmc->start)) != size_map) {
+	cnt_add(CNT_PAGEMAP_MISSES, 1);
+	if (preadv(pmc->fd, iov, nr_iovs, PAGEMAP_PFN_OFF(pmc->start)) != size_map) {
 		pmc_zap(pmc);
 		pr_perror("Can't read %d's pagemap file", pmc->pid);
 		return -1;
@@ -165,9 +212,14 @@ static int pmc_fill_cache(pmc_t *pmc, const struct vma_area *vma)
 
 u64 *pmc_get_map(pmc_t *pmc, const struct vma_area *vma)
 {
+	u64 *map;
+
 	/* Hit */
-	if (likely(pmc->start <= vma->e->start && pmc->end >= vma->e->end))
-		return __pmc_get_map(pmc, vma->e->start);
+	map = __pmc_get_map(pmc, vma);
+	if (likely(map)) {
+		cnt_add(CNT_PAGEMAP_HITS, 1);
+		return map;
+	}
 
 	/* Miss, refill the cache */
 	if (pmc_fill_cache(pmc, vma)) {
@@ -177,13 +229,44 @@ u64 *pmc_get_map(pmc_t *pmc, const struct vma_area *vma)
 	}
 
 	/* Hit for sure */
-	return __pmc_get_map(pmc, vma->e->start);
+	return &pmc->map[0];
+}
+
+long pmc_scan(pmc_t *pmc, unsigned long start, unsigned long end,
+	      unsigned long *walk_end)
+{
+	struct pm_scan_arg arg = {
+		.size			= sizeof(arg),
+		.start			= start,
+		.end			= end,
+		.vec			= (unsigned long)pmc->regs,
+		.vec_len		= PMC_NR_REGS,
+		.category_anyof_mask	= PAGE_IS_PRESENT | PAGE_IS_SWAPPED,
+		.return_mask		= PAGE_IS_PRESENT | PAGE_IS_SWAPPED |
+					  PAGE_IS_FILE | PAGE_IS_PFNZERO |
+					  PAGE_IS_SOFT_DIRTY,
+	};
+	long ret;
+
+	BUG_ON(!pmc->regs);
+
+	ret = ioctl(pmc->fd, PAGEMAP_SCAN, &arg);
+	if (ret < 0) {
+		pr_perror("Can't scan %d's pagemap %lx-%lx", pmc->pid, start, end);
+		return -1;
+	}
+
+	*walk_end = arg.walk_end;
+	return ret;
 }
 
 void pmc_fini(pmc_t *pmc)
 {
 	close_safe(&pmc->fd);
 	xfree(pmc->map);
+	xfree(pmc->gap);
+	xfree(pmc->vmas);
+	xfree(pmc->regs);
 	pmc_reset(pmc);
 }
 
@@ -13,6 +13,8 @@
 #include "restorer.h"
 #include "rst-malloc.h"
 #include "page-xfer.h"
+#include "page-compress.h"
+#include "page-uring.h"
 
 #include "fault-injection.h"
 #include "xmalloc.h"
@@ -53,6 +55,11 @@ static int punch_hole(struct page_read *pr, unsigned long off,
 	int ret;
 	struct iovec * bunch = &pr->bunch;
 
+	if (pr->pd) {
+		pr_warn_once("Can't dedup compressed pages images\n");
+		return 0;
+	}
+
 	if (!cleanup && can_extend_bunch(bunch, off, len)) {
 		pr_debug("pr%lu-%u:Extend bunch len from %zu to %lu\n", pr->img_id,
 			 pr->id, bunch->iov_len, bunch->iov_len + len);
@@ -100,7 +107,7 @@ int dedup_one_iovec(struct page_read *pr, unsigned long off, unsigned long len)
 		if (!pr->pe)
 			return -1;
 		piov_end = pr->pe->vaddr + pagemap_len(pr->pe);
-		if (!pagemap_in_parent(pr->pe)) {
+		if (pagemap_present(pr->pe)) {
 			ret = punch_hole(pr, pr->pi_off, min(piov_end, iov_end) - off, false);
 			if (ret == -1)
 				return ret;
@@ -254,6 +261,9 @@ static int read_local_page(struct page_read *pr, unsigned long vaddr,
 		return -1;
 
 	pr_debug("\tpr%lu-%u Read page from self %lx/%"PRIx64"\n", pr->img_id, pr->id, pr->cvaddr, pr->pi_off);
+	if (pr->pd)
+		return page_decompress_read(pr->pd, pr->pi, buf, len, pr->pi_off);
+
 	while (1) {
 		ret = pread(fd, buf + curr, len - curr, pr->pi_off + curr);
 		if (ret < 1) {
@@ -391,9 +401,10 @@ static int maybe_read_page_local(struct page_read *pr, unsigned long vaddr,
 	 * There's no API in the kernel to start asynchronous
 	 * cached read (or write), so in case someone is asking
 	 * for us for urgent async read, just do the regular
-	 * cached read.
+	 * cached read. Compressed pages are always read right
+	 * away, as preadv can't inflate them.
 	 */
-	if ((flags & (PR_ASYNC|PR_ASAP)) == PR_ASYNC)
+	if ((flags & (PR_ASYNC|PR_ASAP)) == PR_ASYNC && !pr->pd)
 		ret = pagemap_enqueue_iovec(pr, buf, len, &pr->async);
 	else {
 		ret = read_local_page(pr, vaddr, len, buf);
@@ -481,6 +492,74 @@ static int maybe_read_page_remote(struct page_read *pr, unsigned long vaddr,
 	return ret;
 }
 
+static int read_dup_page(struct page_read *pr, unsigned long vaddr,
+			 int nr, void *buf)
+{
+	PagemapEntry *pe = pr->pe;
+	off_t off = pe->dup_off + (vaddr - pe->vaddr);
+	unsigned long len = nr * PAGE_SIZE;
+	struct cr_img *pi = pr->pi;
+	size_t curr = 0;
+
+	if (pe->dup_pages_id != pr->pages_img_id) {
+		if (pr->dpi && pr->dpi_id != pe->dup_pages_id) {
+			close_image(pr->dpi);
+			pr->dpi = NULL;
+		}
+
+		if (!pr->dpi) {
+			pr->dpi = open_image_at(pr->dfd, CR_FD_PAGES, O_RSTR,
+						pe->dup_pages_id);
+			if (!pr->dpi)
+				return -1;
+			if (empty_image(pr->dpi)) {
+				pr_err("No pages-%u for duplicate pages\n",
+				       pe->dup_pages_id);
+				close_image(pr->dpi);
+				pr->dpi = NULL;
+				return -1;
+			}
+			pr->dpi_id = pe->dup_pages_id;
+		}
+
+		pi = pr->dpi;
+	}
+
+	pr_debug("\tpr%lu-%u Read page from pages-%u %lx/%jd\n", pr->img_id,
+		 pr->id, pe->dup_pages_id, vaddr, (intmax_t)off);
+
+	while (curr < len) {
+		ssize_t ret;
+
+		ret = pread(img_raw_fd(pi), buf + curr, len - curr, off + curr);
+		if (ret < 1) {
+			pr_perror("Can't read duplicate page %zd", ret);
+			return -1;
+		}
+		curr += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Zero and duplicate pages have nothing in our pages image, so
+ * they are always read synchronously and pi_off stays intact.
+ */
+static int read_elided_page(struct page_read *pr, unsigned long vaddr,
+			    int nr, void *buf)
+{
+	if (pagemap_zero(pr->pe))
+		memset(buf, 0, nr * PAGE_SIZE);
+	else if (read_dup_page(pr, vaddr, nr, buf))
+		return -1;
+
+	if (pr->io_complete)
+		return pr->io_complete(pr, vaddr, nr);
+
+	return 0;
+}
+
 static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 			     void *buf, unsigned flags)
 {
@@ -490,6 +569,9 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 	if (pagemap_in_parent(pr->pe)) {
 		if (read_parent_page(pr, vaddr, nr, buf, flags) < 0)
 			return -1;
+	} else if (pagemap_zero(pr->pe) || pagemap_dup(pr->pe)) {
+		if (read_elided_page(pr, vaddr, nr, buf) < 0)
+			return -1;
 	} else {
 		if (pr->maybe_read_page(pr, vaddr, nr, buf, flags) < 0)
 			return -1;
@@ -502,11 +584,7 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 
 static void free_pagemaps(struct page_read *pr)
 {
-	int i;
-
-	for (i = 0; i < pr->nr_pmes; i++)
-		pagemap_entry__free_unpacked(pr->pmes[i], NULL);
-
+	pb_arena_free(&pr->pmes_arena);
 	xfree(pr->pmes);
 	pr->pmes = NULL;
 }
@@ -536,62 +614,170 @@ static void advance_piov(struct page_read_iov *piov, ssize_t len)
 			olen, onr, piov->nr, len);
 }
 
-static int process_async_reads(struct page_read *pr)
+/*
+ * Reads the whole piov, it's modified in-place, so the caller
+ * has to remember where it started and where its iovs are.
+ */
+static int read_async_iov(int fd, struct page_read_iov *piov)
+{
+	ssize_t ret;
+
+	pr_debug("Read piov iovs %d, from %ju, len %ju, first %p:%zu\n",
+			piov->nr, piov->from, piov->end - piov->from,
+			piov->to->iov_base, piov->to->iov_len);
+more:
+	ret = preadv(fd, piov->to, piov->nr, piov->from);
+	if (fault_injected(FI_PARTIAL_PAGES)) {
+		/*
+		 * We might have read everything, but for debug
+		 * purposes let's try to force the advance_piov()
+		 * and re-read tail.
+		 */
+		if (ret > 0 && piov->nr >= 2) {
+			pr_debug("`- trim preadv %zu\n", ret);
+			ret /= 2;
+		}
+	}
+
+	if (ret != piov->end - piov->from) {
+		if (ret < 0) {
+			pr_err("Can't read async pr bytes (%zd / %ju read, %ju off, %d iovs)\n",
+					ret, piov->end - piov->from, piov->from, piov->nr);
+			return -1;
+		}
+
+		/*
+		 * The preadv() can return less than requested. It's
+		 * valid and doesn't mean error or EOF. We should advance
+		 * the iovecs and continue
+		 *
+		 * Modify the piov in-place, we're going to drop this one
+		 * anyway.
+		 */
+
+		advance_piov(piov, ret);
+		goto more;
+	}
+
+	return 0;
+}
+
+static int complete_async_iov(struct page_read *pr, struct page_read_iov *piov,
+			      off_t start, struct iovec *iovs)
+{
+	if (opts.auto_dedup && punch_hole(pr, start, piov->end - start, false))
+		return -1;
+
+	BUG_ON(pr->io_complete); /* FIXME -- implement once needed */
+
+	list_del(&piov->l);
+	xfree(iovs);
+	xfree(piov);
+
+	return 0;
+}
+
+static int reap_async_iov(struct page_read *pr, struct page_uring *pu, int fd)
+{
+	struct page_read_iov *piov;
+	struct iovec *iovs;
+	off_t start;
+	void *data;
+	int res;
+
+	if (page_uring_reap(pu, &data, &res))
+		return -1;
+
+	piov = data;
+
+	if (res < 0) {
+		pr_err("Can't read async pr bytes (%d / %ju read, %ju off, %d iovs)\n",
+				res, piov->end - piov->from, piov->from, piov->nr);
+		return -1;
+	}
+
+	start = piov->from;
+	iovs = piov->to;
+	if (res != piov->end - piov->from) {
+		/* As with preadv() it's not an error, read the rest here */
+		advance_piov(piov, res);
+		if (read_async_iov(fd, piov))
+			return -1;
+	}
+
+	return complete_async_iov(pr, piov, start, iovs);
+}
+
+/*
+ * Set once the ring couldn't be set up, all the following reads
+ * go without it and don't warn about this again.
+ */
+static bool page_uring_failed;
+
+/*
+ * Keeps up to PAGE_URING_DEPTH piovs in flight. If the ring can't
+ * be set up, the piovs are left for process_async_reads() to read.
+ */
+static int read_async_uring(struct page_read *pr)
 {
-	int fd, ret = 0;
 	struct page_read_iov *piov, *n;
+	struct page_uring *pu;
+	int fd, nr = 0;
 
-	fd = img_raw_fd(pr->pi);
-	list_for_each_entry_safe(piov, n, &pr->async, l) {
-		ssize_t ret;
-		off_t start = piov->from;
-		struct iovec *iovs = piov->to;
+	if (!pr->pu) {
+		if (page_uring_failed)
+			return 0;
 
-		pr_debug("Read piov iovs %d, from %ju, len %ju, first %p:%zu\n",
-				piov->nr, piov->from, piov->end - piov->from,
-				piov->to->iov_base, piov->to->iov_len);
-more:
-		ret = preadv(fd, piov->to, piov->nr, piov->from);
-		if (fault_injected(FI_PARTIAL_PAGES)) {
-			/*
-			 * We might have read everything, but for debug
-			 * purposes let's try to force the advance_piov()
-			 * and re-read tail.
-			 */
-			if (ret > 0 && piov->nr >= 2) {
-				pr_debug("`- trim preadv %zu\n", ret);
-				ret /= 2;
-			}
+		pr->pu = page_uring_open();
+		if (!pr->pu) {
+			pr_info("Reading pages without io_uring\n");
+			page_uring_failed = true;
+			return 0;
 		}
+	}
+	pu = pr->pu;
 
-		if (ret != piov->end - piov->from) {
-			if (ret < 0) {
-				pr_err("Can't read async pr bytes (%zd / %ju read, %ju off, %d iovs)\n",
-						ret, piov->end - piov->from, piov->from, piov->nr);
+	fd = img_raw_fd(pr->pi);
+	list_for_each_entry_safe(piov, n, &pr->async, l) {
+		/* Only the piovs before this one are reaped */
+		if (nr == PAGE_URING_DEPTH) {
+			if (reap_async_iov(pr, pu, fd))
 				return -1;
-			}
-
-			/*
-			 * The preadv() can return less than requested. It's
-			 * valid and doesn't mean error or EOF. We should advance
-			 * the iovecs and continue
-			 *
-			 * Modify the piov in-place, we're going to drop this one
-			 * anyway.
-			 */
-
-			advance_piov(piov, ret);
-			goto more;
+			nr--;
 		}
 
-		if (opts.auto_dedup && punch_hole(pr, start, ret, false))
+		if (page_uring_readv(pu, fd, piov->to, piov->nr, piov->from, piov))
 			return -1;
+		nr++;
+	}
+
+	while (nr) {
+		if (reap_async_iov(pr, pu, fd))
+			return -1;
+		nr--;
+	}
+
+	return 0;
+}
+
+static int process_async_reads(struct page_read *pr)
+{
+	int fd, ret = 0;
+	struct page_read_iov *piov, *n;
+
+	if (opts.io_uring && !list_empty(&pr->async) && read_async_uring(pr))
+		return -1;
 
-		BUG_ON(pr->io_complete); /* FIXME -- implement once needed */
+	fd = img_raw_fd(pr->pi);
+	list_for_each_entry_safe(piov, n, &pr->async, l) {
+		off_t start = piov->from;
+		struct iovec *iovs = piov->to;
 
-		list_del(&piov->l);
-		xfree(iovs);
-		xfree(piov);
+		if (read_async_iov(fd, piov))
+			return -1;
+
+		if (complete_async_iov(pr, piov, start, iovs))
+			return -1;
 	}
 
 	if (pr->parent)
@@ -623,6 +809,14 @@ static void close_page_read(struct page_read *pr)
 		close_image(pr->pmi);
 	if (pr->pi)
 		close_image(pr->pi);
+	if (pr->dpi)
+		close_image(pr->dpi);
+	if (pr->dfd >= 0)
+		close(pr->dfd);
+
+	page_decompress_close(pr->pd);
+	if (pr->pu)
+		page_uring_close(pr->pu);
 
 	if (pr->pmes)
 		free_pagemaps(pr);
@@ -729,18 +923,25 @@ static int init_pagemaps(struct page_read *pr)
 	if (!pr->pmes)
 		return -1;
 
+	if (!empty_image(pr->pmi))
+		bprefetch(&pr->pmi->_x);
+
 	pr->nr_pmes = 0;
 	pr->curr_pme = -1;
+	pb_arena_init(&pr->pmes_arena);
 
 	while (1) {
-		int ret = pb_read_one_eof(pr->pmi, &pr->pmes[pr->nr_pmes],
-					  PB_PAGEMAP);
+		int ret = pb_read_one_arena(pr->pmi, &pr->pmes[pr->nr_pmes],
+					    PB_PAGEMAP, &pr->pmes_arena);
 		if (ret < 0)
 			goto free_pagemaps;
 		if (ret == 0)
 			break;
 
 		init_compat_pagemap_entry(pr->pmes[pr->nr_pmes]);
+		if (pagemap_zero(pr->pmes[pr->nr_pmes]) ||
+		    pagemap_dup(pr->pmes[pr->nr_pmes]))
+			pr->elided = true;
 
 		pr->nr_pmes++;
 		if (pr->nr_pmes >= nr_pmes) {
@@ -803,6 +1004,11 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 	pr->bunch.iov_base = NULL;
 	pr->pmes = NULL;
 	pr->pieok = false;
+	pr->pd = NULL;
+	pr->pu = NULL;
+	pr->elided = false;
+	pr->dfd = -1;
+	pr->dpi = NULL;
 
 	pr->pmi = open_image_at(dfd, i_typ, O_RSTR, img_id);
 	if (!pr->pmi)
@@ -824,11 +1030,26 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 		return -1;
 	}
 
+	if (!opts.stream &&
+	    page_decompress_open(dfd, pr->pages_img_id, &pr->pd) < 0) {
+		close_page_read(pr);
+		return -1;
+	}
+
 	if (init_pagemaps(pr)) {
 		close_page_read(pr);
 		return -1;
 	}
 
+	if (pr->elided) {
+		pr->dfd = dup(dfd);
+		if (pr->dfd < 0) {
+			pr_perror("Can't keep images dir for duplicate pages");
+			close_page_read(pr);
+			return -1;
+		}
+	}
+
 	pr->read_pages = read_pagemap_page;
 	pr->advance = advance;
 	pr->close = close_page_read;
@@ -846,7 +1067,9 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 		pr->maybe_read_page = maybe_read_page_img_streamer;
 	else {
 		pr->maybe_read_page = maybe_read_page_local;
-		if (!pr->parent && !opts.lazy_pages)
+		/* With --io-uring all pages are read by criu, not restorer */
+		if (!pr->parent && !opts.lazy_pages && !pr->pd && !pr->elided &&
+		    !opts.io_uring)
 			pr->pieok = true;
 	}
 
@@ -871,6 +1094,8 @@ void dup_page_read(struct page_read *src, struct page_read *dst)
 
 	memcpy(dst, src, sizeof(*dst));
 	INIT_LIST_HEAD(&dst->async);
+	/* The copy opens duplicate pages images on its own */
+	dst->dpi = NULL;
 	dst->id = src->id + DUP_IDS_BASE * dup_ids++;
 	dst->reset(dst);
 }
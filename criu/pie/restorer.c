@@ -1511,26 +1511,6 @@ long __export_restore_task(struct task_restore_args *args)
 			goto core_restore_end;
 	}
 
-	if (args->uffd > -1) {
-		/* re-enable THP if we disabled it previously */
-		if (args->has_thp_enabled) {
-			int ret;
-			ret = sys_prctl(PR_SET_THP_DISABLE, 0, 0, 0, 0);
-			if (ret) {
-				pr_err("Cannot re-enable THP: %d\n", ret);
-				goto core_restore_end;
-			}
-		}
-
-		pr_debug("lazy-pages: closing uffd %d\n", args->uffd);
-		/*
-		 * All userfaultfd configuration has finished at this point.
-		 * Let's close the UFFD file descriptor, so that the restored
-		 * process does not have an opened UFFD FD for ever.
-		 */
-		sys_close(args->uffd);
-	}
-
 	/*
 	 * OK, lets try to map new one.
 	 */
@@ -1550,6 +1530,36 @@ long __export_restore_task(struct task_restore_args *args)
 			pr_err("Can't restore %"PRIx64" mapping with %lx\n", vma_entry->start, va);
 			goto core_restore_end;
 		}
+
+		/*
+		 * Shared anonymous memory is created without the content
+		 * in lazy mode, unless some task has it locked, see
+		 * open_shmem(). The pages that come in via some other
+		 * mapping are not missing here any more.
+		 */
+		if (vma_entry_is(vma_entry, VMA_LAZY_SHMEM) &&
+		    enable_uffd(args->uffd, va, vma_entry_len(vma_entry)))
+			goto core_restore_end;
+	}
+
+	if (args->uffd > -1) {
+		/* re-enable THP if we disabled it previously */
+		if (args->has_thp_enabled) {
+			int ret;
+			ret = sys_prctl(PR_SET_THP_DISABLE, 0, 0, 0, 0);
+			if (ret) {
+				pr_err("Cannot re-enable THP: %d\n", ret);
+				goto core_restore_end;
+			}
+		}
+
+		pr_debug("lazy-pages: closing uffd %d\n", args->uffd);
+		/*
+		 * All userfaultfd configuration has finished at this point.
+		 * Let's close the UFFD file descriptor, so that the restored
+		 * process does not have an opened UFFD FD for ever.
+		 */
+		sys_close(args->uffd);
 	}
 
 	/*
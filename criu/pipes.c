@@ -387,6 +387,7 @@ struct collect_image_info pipe_cinfo = {
 	.pb_type = PB_PIPE,
 	.priv_size = sizeof(struct pipe_info),
 	.collect = collect_one_pipe,
+	.flags = COLLECT_ARENA,
 };
 
 static int collect_pipe_data(void *obj, ProtobufCMessage *msg, struct cr_img *img)
@@ -106,6 +106,66 @@ bool is_vma_range_fmt(char *line)
 	return __is_vma_range_fmt(line);
 }
 
+static inline int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * A replacement for sscanf's %llu, %llx and %lli (@base is 0) on
+ * the files parsed while tasks are frozen. Skips leading blanks
+ * like sscanf does and returns the position after the number, or
+ * NULL if there's no number there.
+ */
+static char *parse_ull(char *str, unsigned long long *val, int base)
+{
+	unsigned long long v = 0;
+	int d;
+
+	while (*str == ' ' || *str == '\t')
+		str++;
+
+	if (base == 0) {
+		base = 10;
+		if (str[0] == '0') {
+			base = 8;
+			if (str[1] == 'x' || str[1] == 'X') {
+				base = 16;
+				str += 2;
+			}
+		}
+	} else if (base == 16 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+		str += 2;
+
+	d = hex_digit(*str);
+	if (d < 0 || d >= base)
+		return NULL;
+
+	do {
+		v = v * base + d;
+		d = hex_digit(*++str);
+	} while (d >= 0 && d < base);
+
+	*val = v;
+	return str;
+}
+
+static char *parse_int(char *str, int *val, int base)
+{
+	unsigned long long v;
+
+	str = parse_ull(str, &v, base);
+	if (str)
+		*val = v;
+	return str;
+}
+
 static void __parse_vmflags(char *buf, u32 *flags, u64 *madv, int *io_pf)
 {
 	char *tok;
@@ -366,11 +426,95 @@ static int vma_get_mapfile_user(const char *fname, struct vma_area *vma,
 	return 0;
 }
 
+/*
+ * Files are often mapped by vmas that are not adjacent, e.g. when
+ * a library is mapped in pieces or several times. Remember the first
+ * vma that opened and stat-ed the file, so that the others can borrow
+ * from it too without touching map_files.
+ */
+#define VMA_FILE_HASH_SIZE	64
+#define VMA_FILE_CACHE_MAX	1024
+
+struct vma_file_cache {
+	struct hlist_node	hash;
+	struct vma_file_info	vfi;
+	char			*path;
+	int			fd;
+};
+
+static struct hlist_head vma_file_hash[VMA_FILE_HASH_SIZE];
+static unsigned int vma_file_cache_nr;
+
+static inline struct hlist_head *vma_file_chain(struct vma_file_info *vfi)
+{
+	return &vma_file_hash[(vfi->ino ^ vfi->dev_min) % VMA_FILE_HASH_SIZE];
+}
+
+static struct vma_file_cache *vma_file_cache_find(struct vma_file_info *vfi,
+						  const char *fname)
+{
+	struct vma_file_cache *vfc;
+
+	/*
+	 * The path is compared too, this makes it very unlikely to
+	 * borrow a file from another mount namespace.
+	 */
+	hlist_for_each_entry(vfc, vma_file_chain(vfi), hash)
+		if (vfi_equal(&vfc->vfi, vfi) && !strcmp(vfc->path, fname))
+			return vfc;
+
+	return NULL;
+}
+
+static void vma_file_cache_add(struct vma_file_info *vfi, struct vma_area *vma,
+			       const char *fname, int fd)
+{
+	struct vma_file_cache *vfc;
+
+	if (vma_file_cache_nr >= VMA_FILE_CACHE_MAX)
+		return;
+
+	vfc = xmalloc(sizeof(*vfc));
+	if (!vfc)
+		return;
+
+	vfc->path = xstrdup(fname);
+	vfc->fd = dup(fd);
+	if (!vfc->path || vfc->fd < 0) {
+		xfree(vfc->path);
+		xfree(vfc);
+		return;
+	}
+
+	vfc->vfi = *vfi;
+	vfc->vfi.vma = vma;
+	hlist_add_head(&vfc->hash, vma_file_chain(vfi));
+	vma_file_cache_nr++;
+}
+
+static void vma_file_cache_fini(void)
+{
+	struct vma_file_cache *vfc;
+	struct hlist_node *n;
+	int i;
+
+	for (i = 0; i < VMA_FILE_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(vfc, n, &vma_file_hash[i], hash) {
+			hlist_del(&vfc->hash);
+			close(vfc->fd);
+			xfree(vfc->path);
+			xfree(vfc);
+		}
+	}
+	vma_file_cache_nr = 0;
+}
+
 static int vma_get_mapfile(const char *fname, struct vma_area *vma, DIR *mfd,
 			   struct vma_file_info *vfi,
 			   struct vma_file_info *prev_vfi,
 			   int *vm_file_fd)
 {
+	struct vma_file_cache *vfc;
 	char path[32];
 	int flags;
 
@@ -399,8 +543,10 @@ static int vma_get_mapfile(const char *fname, struct vma_area *vma, DIR *mfd,
 		 * FIXME -- in theory there can be vmas that have
 		 * dev:ino match, but live in different mount
 		 * namespaces. However, we only borrow files for
-		 * subsequent vmas. These are _very_ likely to
-		 * have files from the same namespaces.
+		 * subsequent vmas, or via vma_file_cache for vmas
+		 * of the same task with the same path too. These
+		 * are _very_ likely to have files from the same
+		 * namespaces.
 		 */
 		vma->file_borrowed = true;
 
@@ -408,6 +554,21 @@ static int vma_get_mapfile(const char *fname, struct vma_area *vma, DIR *mfd,
 	}
 	close_safe(vm_file_fd);
 
+	vfc = vma_file_cache_find(vfi, fname);
+	if (vfc) {
+		*vm_file_fd = dup(vfc->fd);
+		if (*vm_file_fd < 0) {
+			pr_perror("Can't dup cached map_files fd");
+			return -1;
+		}
+
+		pr_debug("vma %"PRIx64" borrows vfi from %"PRIx64"\n",
+				vma->e->start, vfc->vfi.vma->e->start);
+		*prev_vfi = vfc->vfi;
+		vma->file_borrowed = true;
+		return 0;
+	}
+
 	/*
 	 * Note that we "open" it in dumper process space
 	 * so later we might refer to it via /proc/self/fd/vm_file_fd
@@ -461,7 +622,72 @@ static int vma_get_mapfile(const char *fname, struct vma_area *vma, DIR *mfd,
 		return -1;
 	}
 
-	return vma_stat(vma, *vm_file_fd);
+	if (vma_stat(vma, *vm_file_fd))
+		return -1;
+
+	/*
+	 * Only regular files are shared, AUFS vmas get their paths
+	 * fixed up per vma and special files are better re-opened.
+	 */
+	if (!opts.aufs && flags == O_PATH && S_ISREG(vma->vmst->st_mode))
+		vma_file_cache_add(vfi, vma, fname, *vm_file_fd);
+
+	return 0;
+}
+
+static int self_maps_add(struct vm_area_list *vms, struct vma_area **prev,
+			 unsigned long s, unsigned long e)
+{
+	struct vma_area *vma;
+
+	if (*prev && (*prev)->e->end == s)
+		/*
+		 * This list is needed for one thing only -- to
+		 * get the idea of what parts of current address
+		 * space are busy. So merge them altogether.
+		 */
+		(*prev)->e->end = e;
+	else {
+		vma = alloc_vma_area();
+		if (!vma)
+			return -1;
+
+		vma->e->start = s;
+		vma->e->end = e;
+		list_add_tail(&vma->list, &vms->h);
+		vms->nr++;
+		*prev = vma;
+	}
+
+	pr_debug("Parsed %"PRIx64"-%"PRIx64" vma\n", (*prev)->e->start, (*prev)->e->end);
+	return 0;
+}
+
+/*
+ * With PROCMAP_QUERY the kernel reports vmas one by one in binary
+ * form, without formatting the whole maps file into text.
+ */
+static int parse_self_maps_query(struct vm_area_list *vms, int fd)
+{
+	struct vma_area *prev = NULL;
+	struct procmap_query q = {
+		.size		= sizeof(q),
+		.query_flags	= PROCMAP_QUERY_COVERING_OR_NEXT_VMA,
+	};
+
+	while (1) {
+		if (ioctl(fd, PROCMAP_QUERY, &q) < 0) {
+			if (errno == ENOENT)
+				return 0;
+			pr_perror("Can't query self maps at %"PRIx64, q.query_addr);
+			return -1;
+		}
+
+		if (self_maps_add(vms, &prev, q.vma_start, q.vma_end))
+			return -1;
+
+		q.query_addr = q.vma_end;
+	}
 }
 
 int parse_self_maps_lite(struct vm_area_list *vms)
@@ -476,11 +702,18 @@ int parse_self_maps_lite(struct vm_area_list *vms)
 	if (maps.fd < 0)
 		return -1;
 
+	if (kdat.has_procmap_query) {
+		int ret;
+
+		ret = parse_self_maps_query(vms, maps.fd);
+		close(maps.fd);
+		return ret;
+	}
+
 	if (bfdopenr(&maps))
 		return -1;
 
 	while (1) {
-		struct vma_area *vma;
 		char *end;
 		unsigned long s, e;
 
@@ -493,26 +726,8 @@ int parse_self_maps_lite(struct vm_area_list *vms)
 		s = strtoul(buf, &end, 16);
 		e = strtoul(end + 1, NULL, 16);
 
-		if (prev && prev->e->end == s)
-			/*
-			 * This list is needed for one thing only -- to
-			 * get the idea of what parts of current address
-			 * space are busy. So merge them altogether.
-			 */
-			prev->e->end = e;
-		else {
-			vma = alloc_vma_area();
-			if (!vma)
-				goto err;
-
-			vma->e->start = s;
-			vma->e->end = e;
-			list_add_tail(&vma->list, &vms->h);
-			vms->nr++;
-			prev = vma;
-		}
-
-		pr_debug("Parsed %"PRIx64"-%"PRIx64" vma\n", prev->e->start, prev->e->end);
+		if (self_maps_add(vms, &prev, s, e))
+			goto err;
 	}
 
 	bclose(&maps);
@@ -580,7 +795,7 @@ static int handle_vma(pid_t pid, struct vma_area *vma_area,
 		 * and have full match with the previous.
 		 */
 		vma_area->e->flags |= (prev->e->flags & MAP_ANONYMOUS);
-		vma_area->e->status = prev->e->status;
+		vma_area->e->status = prev->e->status & ~VMA_AREA_THP;
 		vma_area->e->shmid = prev->e->shmid;
 		vma_area->vmst = prev->vmst;
 		vma_area->mnt_id = prev->mnt_id;
@@ -702,6 +917,79 @@ static int vma_list_add(struct vma_area *vma_area,
 	return 0;
 }
 
+/*
+ * Parses a hex number ending with @sep and returns the
+ * position right after the separator or NULL.
+ */
+static char *parse_hex_sep(char *str, unsigned long *val, char sep)
+{
+	unsigned long v = 0;
+	int d;
+
+	if (hex_digit(*str) < 0)
+		return NULL;
+
+	while ((d = hex_digit(*str)) >= 0) {
+		v = (v << 4) | d;
+		str++;
+	}
+
+	if (*str != sep)
+		return NULL;
+
+	*val = v;
+	return str + 1;
+}
+
+/*
+ * Parses the "start-end perms pgoff maj:min ino   path" head of
+ * a vma line and returns the offset of the path in it. There's
+ * one such line per vma and sscanf() is too slow for them.
+ */
+static int parse_vma_head(char *str, unsigned long *start, unsigned long *end,
+			  char *perms, unsigned long *pgoff,
+			  struct vma_file_info *vfi)
+{
+	unsigned long maj, min;
+	char *p = str;
+
+	p = parse_hex_sep(p, start, '-');
+	if (!p)
+		return -1;
+	p = parse_hex_sep(p, end, ' ');
+	if (!p)
+		return -1;
+
+	if (!p[0] || !p[1] || !p[2] || !p[3] || p[4] != ' ')
+		return -1;
+	memcpy(perms, p, 4);
+	p += 5;
+
+	p = parse_hex_sep(p, pgoff, ' ');
+	if (!p)
+		return -1;
+	p = parse_hex_sep(p, &maj, ':');
+	if (!p)
+		return -1;
+	p = parse_hex_sep(p, &min, ' ');
+	if (!p)
+		return -1;
+
+	if (*p < '0' || *p > '9')
+		return -1;
+	vfi->ino = 0;
+	while (*p >= '0' && *p <= '9')
+		vfi->ino = vfi->ino * 10 + (*p++ - '0');
+
+	vfi->dev_maj = maj;
+	vfi->dev_min = min;
+
+	while (*p == ' ')
+		p++;
+
+	return p - str;
+}
+
 /*
  * On s390 we have old kernels where the global task size assumption of
  * criu does not work. See also compel_task_size() for s390.
@@ -723,7 +1011,7 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
 {
 	struct vma_area *vma_area = NULL;
 	unsigned long start, end, pgoff, prev_end = 0;
-	char r, w, x, s;
+	char perms[4];
 	int ret = -1, vm_file_fd = -1;
 	struct vma_file_info vfi;
 	struct vma_file_info prev_vfi = {};
@@ -745,7 +1033,7 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
 		goto err;
 
 	while (1) {
-		int num, path_off;
+		int path_off;
 		bool eof;
 		char *str;
 
@@ -769,6 +1057,11 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
 				BUG_ON(!vma_area);
 				parse_vma_vmflags(&str[9], vma_area);
 				continue;
+			} else if (!strncmp(str, "AnonHugePages:", 14)) {
+				BUG_ON(!vma_area);
+				if (strtoul(&str[14], NULL, 10))
+					vma_area->e->status |= VMA_AREA_THP;
+				continue;
 			} else
 				continue;
 		}
@@ -784,10 +1077,8 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
 		if (!vma_area)
 			goto err;
 
-		num = sscanf(str, "%lx-%lx %c%c%c%c %lx %x:%x %lu %n",
-			     &start, &end, &r, &w, &x, &s, &pgoff,
-			     &vfi.dev_maj, &vfi.dev_min, &vfi.ino, &path_off);
-		if (num < 10) {
+		path_off = parse_vma_head(str, &start, &end, perms, &pgoff, &vfi);
+		if (path_off < 0) {
 			pr_err("Can't parse: %s\n", str);
 			goto err;
 		}
@@ -800,19 +1091,19 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
 		if (task_size_check(pid, vma_area->e))
 			goto err;
 
-		if (r == 'r')
+		if (perms[0] == 'r')
 			vma_area->e->prot |= PROT_READ;
-		if (w == 'w')
+		if (perms[1] == 'w')
 			vma_area->e->prot |= PROT_WRITE;
-		if (x == 'x')
+		if (perms[2] == 'x')
 			vma_area->e->prot |= PROT_EXEC;
 
-		if (s == 's')
+		if (perms[3] == 's')
 			vma_area->e->flags = MAP_SHARED;
-		else if (s == 'p')
+		else if (perms[3] == 'p')
 			vma_area->e->flags = MAP_PRIVATE;
 		else {
-			pr_err("Unexpected VMA met (%c)\n", s);
+			pr_err("Unexpected VMA met (%c)\n", perms[3]);
 			goto err;
 		}
 
@@ -835,6 +1126,7 @@ err:
 	bclose(&f);
 err_n:
 	close_safe(&vm_file_fd);
+	vma_file_cache_fini();
 	if (map_files_dir)
 		closedir(map_files_dir);
 
@@ -1031,13 +1323,18 @@ static int ids_parse(char *str, unsigned int *arr)
 
 static int cap_parse(char *str, unsigned int *res)
 {
-	int i, ret;
+	int i, j, d;
 
 	for (i = 0; i < PROC_CAP_SIZE; i++) {
-		ret = sscanf(str, "%08x", &res[PROC_CAP_SIZE - 1 - i]);
-		if (ret != 1)
-			return -1;
-		str += 8;
+		unsigned int v = 0;
+
+		for (j = 0; j < 8; j++) {
+			d = hex_digit(*str++);
+			if (d < 0)
+				return -1;
+			v = (v << 4) | d;
+		}
+		res[PROC_CAP_SIZE - 1 - i] = v;
 	}
 
 	return 0;
@@ -1076,7 +1373,7 @@ int parse_pid_status(pid_t pid, struct seize_task_status *ss, void *data)
 		}
 
 		if (!strncmp(str, "PPid:", 5)) {
-			if (sscanf(str, "PPid:\t%d", &cr->s.ppid) != 1) {
+			if (!parse_int(str + 5, &cr->s.ppid, 10)) {
 				pr_err("Unable to parse: %s\n", str);
 				goto err_parse;
 			}
@@ -1133,7 +1430,7 @@ int parse_pid_status(pid_t pid, struct seize_task_status *ss, void *data)
 		}
 
 		if (!strncmp(str, "Seccomp:", 8)) {
-			if (sscanf(str + 9, "%d", &cr->s.seccomp_mode) != 1) {
+			if (!parse_int(str + 9, &cr->s.seccomp_mode, 10)) {
 				goto err_parse;
 			}
 
@@ -1145,7 +1442,7 @@ int parse_pid_status(pid_t pid, struct seize_task_status *ss, void *data)
 		if (!strncmp(str, "ShdPnd:", 7)) {
 			unsigned long long sigpnd;
 
-			if (sscanf(str + 7, "%llx", &sigpnd) != 1)
+			if (!parse_ull(str + 7, &sigpnd, 16))
 				goto err_parse;
 			cr->s.shdpnd |= sigpnd;
 
@@ -1155,7 +1452,7 @@ int parse_pid_status(pid_t pid, struct seize_task_status *ss, void *data)
 		if (!strncmp(str, "SigPnd:", 7)) {
 			unsigned long long sigpnd;
 
-			if (sscanf(str + 7, "%llx", &sigpnd) != 1)
+			if (!parse_ull(str + 7, &sigpnd, 16))
 				goto err_parse;
 			cr->s.sigpnd |= sigpnd;
 
@@ -1352,7 +1649,7 @@ replace:
 static int parse_mountinfo_ent(char *str, struct mount_info *new, char **fsname)
 {
 	struct fd_link root_link;
-	unsigned int kmaj, kmin;
+	int kmaj, kmin;
 	int ret, n;
 	char *sub, *opt = NULL;
 
@@ -1361,11 +1658,24 @@ static int parse_mountinfo_ent(char *str, struct mount_info *new, char **fsname)
 		goto err;
 
 	new->mountpoint[0] = '.';
-	ret = sscanf(str, "%i %i %u:%u %ms %s %ms %n",
-			&new->mnt_id, &new->parent_mnt_id,
-			&kmaj, &kmin, &new->root, new->mountpoint + 1,
-			&opt, &n);
-	if (ret != 7)
+
+	/* The numbers are parsed by hand, sscanf is slow on them */
+	str = parse_int(str, &new->mnt_id, 0);
+	if (!str)
+		goto err;
+	str = parse_int(str, &new->parent_mnt_id, 0);
+	if (!str)
+		goto err;
+	str = parse_int(str, &kmaj, 10);
+	if (!str || *str++ != ':')
+		goto err;
+	str = parse_int(str, &kmin, 10);
+	if (!str)
+		goto err;
+
+	ret = sscanf(str, " %ms %s %ms %n",
+			&new->root, new->mountpoint + 1, &opt, &n);
+	if (ret != 3)
 		goto err;
 
 	cure_path(new->mountpoint);
@@ -1766,8 +2076,7 @@ static int parse_fdinfo_pid_s(int pid, int fd, int type, void *arg)
 
 			if (type != FD_TYPES__UND)
 				continue;
-			ret = sscanf(str, "%*s %lli", &val);
-			if (ret != 1)
+			if (!parse_ull(strchr(str, ':') + 1, &val, 0))
 				goto parse_err;
 
 			if (fdinfo_field(str, "pos"))
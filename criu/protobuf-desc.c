@@ -103,6 +103,8 @@ void cr_pb_init(void)
 	CR_PB_DESC(REMAP_FPATH,		RemapFilePath,	remap_file_path);
 	CR_PB_DESC(NETDEV,		NetDevice,	net_device);
 	CR_PB_MDESC_INIT(cr_pb_descs[PB_PAGEMAP_HEAD],	PagemapHead,	pagemap_head);
+	CR_PB_MDESC_INIT(cr_pb_descs[PB_PAGES_FRAMES_HEAD],	PagesFramesHead,	pages_frames_head);
+	CR_PB_DESC(PAGES_FRAME,		PagesFrame,	pages_frame);
 
 #include "protobuf-desc-gen.h"
 }
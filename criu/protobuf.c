@@ -19,6 +19,8 @@
 #include "bfd.h"
 #include "protobuf.h"
 #include "util.h"
+#include "stats.h"
+#include "xmalloc.h"
 
 #define  image_name(img, buf) __image_name(img, buf, sizeof(buf))
 static char *__image_name(struct cr_img *img, char *image_path, size_t image_path_size)
@@ -43,10 +45,12 @@ static char *__image_name(struct cr_img *img, char *image_path, size_t image_pat
  * -1 on error (or EOF met and @eof set to false)
  *  0 on EOF and @eof set to true
  *
- * Don't forget to free memory granted to unpacked object in calling code if needed
+ * Don't forget to free memory granted to unpacked object in calling code if needed,
+ * unless it was unpacked into the @arena
  */
 
-int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
+int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof,
+		   struct pb_arena *arena)
 {
 	char img_name_buf[PATH_MAX];
 	u8 local[PB_PKOBJ_LOCAL_SIZE];
@@ -81,6 +85,17 @@ int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
 		return -1;
 	}
 
+	if (bfd_mapped(&img->_x)) {
+		/* Unpack right from the image */
+		buf = bread_ptr(&img->_x, size);
+		if (!buf) {
+			pr_err("Short read of %d bytes from %s\n",
+			       size, image_name(img, img_name_buf));
+			return -1;
+		}
+		goto unpack;
+	}
+
 	if (size > sizeof(local)) {
 		ret = -1;
 		buf = xmalloc(size);
@@ -100,7 +115,8 @@ int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
 		goto err;
 	}
 
-	*pobj = cr_pb_descs[type].unpack(NULL, size, buf);
+unpack:
+	*pobj = cr_pb_descs[type].unpack(arena ? &arena->allocator : NULL, size, buf);
 	if (!*pobj) {
 		ret = -1;
 		pr_err("Failed unpacking object %p from %s\n",
@@ -108,9 +124,11 @@ int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
 		goto err;
 	}
 
+	cnt_pb_decoded(type, size);
+
 	ret = 1;
 err:
-	if (buf != (void *)&local)
+	if (buf != (void *)&local && !bfd_mapped(&img->_x))
 		xfree(buf);
 
 	return ret;
@@ -131,6 +149,7 @@ int pb_write_one(struct cr_img *img, void *obj, int type)
 	u32 size, packed;
 	int ret = -1;
 	struct iovec iov[2];
+	void *ptr;
 
 	if (!cr_pb_descs[type].pb_desc) {
 		pr_err("Wrong object requested %d\n", type);
@@ -141,6 +160,26 @@ int pb_write_one(struct cr_img *img, void *obj, int type)
 		return -1;
 
 	size = cr_pb_descs[type].getpksize(obj);
+
+	/* Pack the record right into the image buffer if it fits there */
+	ptr = bwrite_reserve(&img->_x, sizeof(size) + size);
+	if (IS_ERR(ptr)) {
+		pr_perror("Can't flush the image buffer");
+		return -1;
+	}
+
+	if (ptr) {
+		memcpy(ptr, &size, sizeof(size));
+		packed = cr_pb_descs[type].pack(obj, ptr + sizeof(size));
+		if (packed != size) {
+			pr_err("Failed packing PB object %p\n", obj);
+			return -1;
+		}
+
+		bwrite_commit(&img->_x, sizeof(size) + size);
+		return 0;
+	}
+
 	if (size > (u32)sizeof(local)) {
 		buf = xmalloc(size);
 		if (!buf)
@@ -171,6 +210,75 @@ err:
 	return ret;
 }
 
+#define PB_ARENA_CHUNK_SIZE	(64 << 10)
+#define PB_ARENA_ALIGN		16
+
+struct pb_arena_chunk {
+	struct pb_arena_chunk	*prev;
+	size_t			size;
+	u8			data[] __aligned(PB_ARENA_ALIGN);
+};
+
+static void *pb_arena_alloc(void *data, size_t size)
+{
+	struct pb_arena *arena = data;
+	struct pb_arena_chunk *c = arena->chunk;
+	void *ret;
+
+	size = round_up(size, PB_ARENA_ALIGN);
+	if (!c || arena->used + size > c->size) {
+		size_t csize = max_t(size_t, size, PB_ARENA_CHUNK_SIZE);
+
+		c = xmalloc(sizeof(*c) + csize);
+		if (!c)
+			return NULL;
+
+		c->prev = arena->chunk;
+		c->size = csize;
+		arena->chunk = c;
+		arena->used = 0;
+	}
+
+	ret = c->data + arena->used;
+	arena->used += size;
+	return ret;
+}
+
+static void pb_arena_free_one(void *data, void *ptr)
+{
+	/* Everything goes away in pb_arena_free */
+}
+
+void pb_arena_init(struct pb_arena *arena)
+{
+	arena->allocator.alloc = pb_arena_alloc;
+	arena->allocator.free = pb_arena_free_one;
+	arena->allocator.allocator_data = arena;
+	arena->chunk = NULL;
+	arena->used = 0;
+}
+
+void pb_arena_free(struct pb_arena *arena)
+{
+	struct pb_arena_chunk *c = arena->chunk;
+
+	while (c) {
+		struct pb_arena_chunk *prev = c->prev;
+
+		xfree(c);
+		c = prev;
+	}
+
+	arena->chunk = NULL;
+	arena->used = 0;
+}
+
+/*
+ * Entries collected with COLLECT_ARENA live till criu exits,
+ * so is this arena.
+ */
+static struct pb_arena collect_arena;
+
 int collect_entry(ProtobufCMessage *msg, struct collect_image_info *cinfo)
 {
 	void *obj;
@@ -206,16 +314,28 @@ int collect_image(struct collect_image_info *cinfo)
 {
 	int ret;
 	struct cr_img *img;
+	struct pb_arena *arena = NULL;
 	void *(*o_alloc)(size_t size) = malloc;
 	void (*o_free)(void *ptr) = free;
 
 	pr_info("Collecting %d/%d (flags %x)\n",
 			cinfo->fd_type, cinfo->pb_type, cinfo->flags);
 
+	if (cinfo->flags & COLLECT_ARENA) {
+		BUG_ON(!cinfo->priv_size && !(cinfo->flags & COLLECT_NOFREE));
+		if (!collect_arena.allocator.alloc)
+			pb_arena_init(&collect_arena);
+		arena = &collect_arena;
+	}
+
 	img = open_image(cinfo->fd_type, O_RSTR);
 	if (!img)
 		return -1;
 
+	/* All the entries are read right now */
+	if (!empty_image(img))
+		bprefetch(&img->_x);
+
 	if (cinfo->flags & COLLECT_SHARED) {
 		o_alloc = shmalloc;
 		o_free = shfree_last;
@@ -233,7 +353,7 @@ int collect_image(struct collect_image_info *cinfo)
 		} else
 			obj = NULL;
 
-		ret = pb_read_one_eof(img, &msg, cinfo->pb_type);
+		ret = do_pb_read_one(img, (void **)&msg, cinfo->pb_type, true, arena);
 		if (ret <= 0) {
 			o_free(obj);
 			break;
@@ -243,7 +363,8 @@ int collect_image(struct collect_image_info *cinfo)
 		ret = cinfo->collect(obj, msg, img);
 		if (ret < 0) {
 			o_free(obj);
-			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+			if (!arena)
+				cr_pb_descs[cinfo->pb_type].free(msg, NULL);
 			break;
 		}
 
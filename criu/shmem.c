@@ -24,6 +24,7 @@
 #include "page.h"
 #include "util.h"
 #include "memfd.h"
+#include "uffd.h"
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
 
@@ -83,6 +84,9 @@ struct shmem_info {
 			 */
 			int		count;		/* the number of regions */
 			int		self_count;	/* the number of regions, which belongs to "pid" */
+
+			/* The content is injected by lazy-pages daemon */
+			bool		lazy;
 		};
 
 		struct { /* For sysvipc restore */
@@ -401,6 +405,8 @@ int collect_shmem(int pid, struct vma_area *vma)
 		if (si->size < size)
 			si->size = size;
 		si->count++;
+		if (!vma_entry_can_be_lazy_shmem(vi))
+			si->lazy = false;
 
 		/*
 		 * Only the shared mapping with a lowest
@@ -434,6 +440,8 @@ int collect_shmem(int pid, struct vma_area *vma)
 	si->fd    = -1;
 	si->count = 1;
 	si->self_count = 1;
+	si->lazy = opts.lazy_pages && uffd_lazy_shmem() &&
+		   vma_entry_can_be_lazy_shmem(vi);
 	futex_init(&si->lock);
 	shmem_hash_add(si);
 
@@ -553,6 +561,10 @@ static int open_shmem(int pid, struct vma_area *vma)
 
 	BUG_ON(si->pid == SYSVIPC_SHMEM_PID);
 
+	/* Tell the restorer which mappings to register with uffd */
+	if (si->lazy)
+		vi->status |= VMA_LAZY_SHMEM;
+
 	if (si->pid != pid)
 		return shmem_wait_and_open(si, vi);
 
@@ -596,7 +608,9 @@ static int open_shmem(int pid, struct vma_area *vma)
 		goto err;
 	}
 
-	if (restore_shmem_content(addr, si) < 0) {
+	if (si->lazy)
+		pr_info("Leave shmid=0x%"PRIx64" content to lazy-pages\n", vi->shmid);
+	else if (restore_shmem_content(addr, si) < 0) {
 		pr_err("Can't restore shmem content\n");
 		goto err;
 	}
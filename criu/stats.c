@@ -9,13 +9,13 @@
 #include "stats.h"
 #include "util.h"
 #include "image.h"
+#include "pstree.h"
+#include "rst_info.h"
+#include "restorer.h"
+#include "trace-event.h"
+#include "xmalloc.h"
 #include "images/stats.pb-c.h"
 
-struct timing {
-	struct timeval start;
-	struct timeval total;
-};
-
 struct dump_stats {
 	struct timing	timings[DUMP_TIME_NR_STATS];
 	unsigned long	counts[DUMP_CNT_NR_STATS];
@@ -24,6 +24,9 @@ struct dump_stats {
 struct restore_stats {
 	struct timing	timings[RESTORE_TIME_NS_STATS];
 	atomic_t	counts[RESTORE_CNT_NR_STATS];
+	struct timeval	stages[CR_STATE_COMPLETE + 1];
+	unsigned long	pb_objs[PB_MAX];
+	unsigned long	pb_bytes[PB_MAX];
 };
 
 struct dump_stats *dstats;
@@ -33,7 +36,7 @@ void cnt_add(int c, unsigned long val)
 {
 	if (dstats != NULL) {
 		BUG_ON(c >= DUMP_CNT_NR_STATS);
-		dstats->counts[c] += val;
+		__atomic_fetch_add(&dstats->counts[c], val, __ATOMIC_RELAXED);
 	} else if (rstats != NULL) {
 		BUG_ON(c >= RESTORE_CNT_NR_STATS);
 		atomic_add(val, &rstats->counts[c]);
@@ -45,7 +48,7 @@ void cnt_sub(int c, unsigned long val)
 {
 	if (dstats != NULL) {
 		BUG_ON(c >= DUMP_CNT_NR_STATS);
-		dstats->counts[c] -= val;
+		__atomic_fetch_sub(&dstats->counts[c], val, __ATOMIC_RELAXED);
 	} else if (rstats != NULL) {
 		BUG_ON(c >= RESTORE_CNT_NR_STATS);
 		atomic_add(-val, &rstats->counts[c]);
@@ -53,6 +56,15 @@ void cnt_sub(int c, unsigned long val)
 		BUG();
 }
 
+void cnt_pb_decoded(int pb_type, unsigned long size)
+{
+	if (rstats == NULL)
+		return;
+
+	__atomic_fetch_add(&rstats->pb_objs[pb_type], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&rstats->pb_bytes[pb_type], size, __ATOMIC_RELAXED);
+}
+
 static void timeval_accumulate(const struct timeval *from, const struct timeval *to,
 		struct timeval *res)
 {
@@ -107,6 +119,235 @@ void timing_stop(int t)
 	timeval_accumulate(&tm->start, &now, &tm->total);
 }
 
+void timing_stage(int stage)
+{
+	if (!rstats || stage < CR_STATE_ROOT_TASK || stage > CR_STATE_COMPLETE)
+		return;
+
+	gettimeofday(&rstats->stages[stage], NULL);
+}
+
+void task_timing_start(struct pstree_item *t, int tm)
+{
+	struct task_timings *tt = &rsti(t)->timings;
+
+	BUG_ON(tm >= TASK_TIME_NR_STATS);
+	gettimeofday(&tt->timings[tm].start, NULL);
+	if (!timerisset(&tt->first[tm]))
+		tt->first[tm] = tt->timings[tm].start;
+}
+
+void task_timing_stop(struct pstree_item *t, int tm)
+{
+	struct task_timings *tt = &rsti(t)->timings;
+
+	BUG_ON(tm >= TASK_TIME_NR_STATS);
+	gettimeofday(&tt->last[tm], NULL);
+	timeval_accumulate(&tt->timings[tm].start, &tt->last[tm],
+			&tt->timings[tm].total);
+}
+
+void task_timing_mark(struct pstree_item *t, int mark)
+{
+	BUG_ON(mark >= TASK_MARK_NR_STATS);
+	gettimeofday(&rsti(t)->timings.marks[mark], NULL);
+}
+
+static u_int32_t tv_to_usec(const struct timeval *tv)
+{
+	return tv->tv_sec * USEC_PER_SEC + tv->tv_usec;
+}
+
+static u_int32_t usec_between(const struct timeval *from, const struct timeval *to)
+{
+	struct timeval res = {};
+
+	timeval_accumulate(from, to, &res);
+	return tv_to_usec(&res);
+}
+
+static bool encode_stage(int stage, u_int32_t *to)
+{
+	struct timeval *start = &rstats->stages[stage];
+	struct timeval *end = &rstats->stages[stage + 1];
+
+	if (!timerisset(start) || !timerisset(end))
+		return false;
+
+	*to = usec_between(start, end);
+	return true;
+}
+
+static bool encode_mark(struct task_timings *tt, int mark, u_int32_t *to)
+{
+	if (!timerisset(&tt->marks[mark]) ||
+	    !timerisset(&rstats->stages[CR_STATE_ROOT_TASK]))
+		return false;
+
+	*to = usec_between(&rstats->stages[CR_STATE_ROOT_TASK], &tt->marks[mark]);
+	return true;
+}
+
+static int encode_task_stats(RestoreStatsEntry *rs_entry)
+{
+	RestoreTaskStatsEntry *entries;
+	struct pstree_item *pi;
+	int n = 0;
+
+	for_each_pstree_item(pi)
+		if (pi->pid->state != TASK_HELPER)
+			n++;
+	if (!n)
+		return 0;
+
+	rs_entry->tasks = xmalloc(n * sizeof(*rs_entry->tasks));
+	entries = xmalloc(n * sizeof(*entries));
+	if (!rs_entry->tasks || !entries) {
+		xfree(rs_entry->tasks);
+		rs_entry->tasks = NULL;
+		xfree(entries);
+		return -1;
+	}
+
+	for_each_pstree_item(pi) {
+		struct task_timings *tt = &rsti(pi)->timings;
+		RestoreTaskStatsEntry *e;
+
+		if (pi->pid->state == TASK_HELPER)
+			continue;
+
+		e = &entries[rs_entry->n_tasks];
+		restore_task_stats_entry__init(e);
+		e->pid = vpid(pi);
+		e->fork_time = tv_to_usec(&tt->timings[TASK_TIME_FORK].total);
+		e->mem_time = tv_to_usec(&tt->timings[TASK_TIME_MEM].total);
+		e->files_time = tv_to_usec(&tt->timings[TASK_TIME_FILES].total);
+		e->sockets_time = tv_to_usec(&tt->timings[TASK_TIME_SOCKETS].total);
+		e->has_forked_at = encode_mark(tt, TASK_MARK_FORKED, &e->forked_at);
+		e->has_restorer_at = encode_mark(tt, TASK_MARK_RESTORER, &e->restorer_at);
+
+		rs_entry->tasks[rs_entry->n_tasks++] = e;
+	}
+
+	return 0;
+}
+
+static int encode_pb_stats(RestoreStatsEntry *rs_entry)
+{
+	RestorePbStatsEntry *entries;
+	int i, n = 0;
+
+	for (i = 0; i < PB_MAX; i++)
+		if (rstats->pb_objs[i])
+			n++;
+	if (!n)
+		return 0;
+
+	rs_entry->decoded = xmalloc(n * sizeof(*rs_entry->decoded));
+	entries = xmalloc(n * sizeof(*entries));
+	if (!rs_entry->decoded || !entries) {
+		xfree(rs_entry->decoded);
+		rs_entry->decoded = NULL;
+		xfree(entries);
+		return -1;
+	}
+
+	for (i = 0; i < PB_MAX; i++) {
+		RestorePbStatsEntry *e;
+
+		if (!rstats->pb_objs[i])
+			continue;
+
+		e = &entries[rs_entry->n_decoded];
+		restore_pb_stats_entry__init(e);
+		e->type = (char *)cr_pb_descs[i].pb_desc->name;
+		e->objects = rstats->pb_objs[i];
+		e->bytes = rstats->pb_bytes[i];
+
+		rs_entry->decoded[rs_entry->n_decoded++] = e;
+	}
+
+	return 0;
+}
+
+static void free_restore_stats(RestoreStatsEntry *rs_entry)
+{
+	if (rs_entry->n_tasks)
+		xfree(rs_entry->tasks[0]);
+	xfree(rs_entry->tasks);
+	if (rs_entry->n_decoded)
+		xfree(rs_entry->decoded[0]);
+	xfree(rs_entry->decoded);
+}
+
+static const char *stage_names[] = {
+	[CR_STATE_ROOT_TASK]		= "root task",
+	[CR_STATE_PREPARE_NAMESPACES]	= "prepare namespaces",
+	[CR_STATE_FORKING]		= "forking",
+	[CR_STATE_RESTORE]		= "restore",
+	[CR_STATE_RESTORE_SIGCHLD]	= "restore sigchld",
+	[CR_STATE_RESTORE_CREDS]	= "restore creds",
+};
+
+static const char *task_time_names[] = {
+	[TASK_TIME_FORK]	= "fork",
+	[TASK_TIME_MEM]		= "mem",
+	[TASK_TIME_FILES]	= "files",
+	[TASK_TIME_SOCKETS]	= "sockets",
+};
+
+/*
+ * Stages go to the criu track, each task gets its own one with a
+ * thread per timing. Timings which are started several times are
+ * shown as one span from the first start till the last stop with
+ * the accumulated time as an argument.
+ */
+static void write_restore_trace(void)
+{
+	struct pstree_item *pi;
+	int s, tm;
+
+	if (trace_open(opts.trace_file))
+		return;
+
+	for (s = CR_STATE_ROOT_TASK; s < CR_STATE_COMPLETE; s++) {
+		struct timeval *start = &rstats->stages[s];
+		struct timeval *end = &rstats->stages[s + 1];
+
+		if (!timerisset(start) || !timerisset(end))
+			continue;
+
+		trace_complete(stage_names[s], "stage", 0, 0, start, end, NULL, 0);
+	}
+
+	for_each_pstree_item(pi) {
+		struct task_timings *tt = &rsti(pi)->timings;
+		int pid = vpid(pi);
+
+		if (pi->pid->state == TASK_HELPER)
+			continue;
+
+		for (tm = 0; tm < TASK_TIME_NR_STATS; tm++) {
+			if (!timerisset(&tt->first[tm]))
+				continue;
+
+			trace_name_thread(pid, tm, task_time_names[tm]);
+			trace_complete(task_time_names[tm], "task", pid, tm,
+				       &tt->first[tm], &tt->last[tm], "total_us",
+				       tv_to_usec(&tt->timings[tm].total));
+		}
+
+		if (timerisset(&tt->marks[TASK_MARK_FORKED]))
+			trace_instant("forked", "task", pid, 0,
+				      &tt->marks[TASK_MARK_FORKED]);
+		if (timerisset(&tt->marks[TASK_MARK_RESTORER]))
+			trace_instant("restorer", "task", pid, 0,
+				      &tt->marks[TASK_MARK_RESTORER]);
+	}
+
+	trace_close();
+}
+
 static void encode_time(int t, u_int32_t *to)
 {
 	struct timing *tm;
@@ -117,6 +358,8 @@ static void encode_time(int t, u_int32_t *to)
 
 static void display_stats(int what, StatsEntry *stats)
 {
+	int i;
+
 	if (what == DUMP_STATS) {
 		pr_msg("Displaying dump stats:\n");
 		pr_msg("Freezing time: %d us\n", stats->dump->freezing_time);
@@ -134,6 +377,18 @@ static void display_stats(int what, StatsEntry *stats)
 				stats->dump->pages_written);
 		pr_msg("Lazy memory pages: %" PRIu64 " (0x%" PRIx64 ")\n", stats->dump->pages_lazy,
 				stats->dump->pages_lazy);
+		if (stats->dump->has_pages_zero)
+			pr_msg("Zero memory pages: %" PRIu64 " (0x%" PRIx64 ")\n",
+					stats->dump->pages_zero, stats->dump->pages_zero);
+		if (stats->dump->has_pages_dup)
+			pr_msg("Duplicate memory pages: %" PRIu64 " (0x%" PRIx64 ")\n",
+					stats->dump->pages_dup, stats->dump->pages_dup);
+		if (stats->dump->has_pagemap_hits)
+			pr_msg("Pagemap cache hits: %" PRIu64 "\n",
+					stats->dump->pagemap_hits);
+		if (stats->dump->has_pagemap_misses)
+			pr_msg("Pagemap cache misses: %" PRIu64 "\n",
+					stats->dump->pagemap_misses);
 	} else if (what == RESTORE_STATS) {
 		pr_msg("Displaying restore stats:\n");
 		pr_msg("Pages compared: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_compared,
@@ -145,6 +400,34 @@ static void display_stats(int what, StatsEntry *stats)
 					stats->restore->pages_restored);
 		pr_msg("Restore time: %d us\n", stats->restore->restore_time);
 		pr_msg("Forking time: %d us\n", stats->restore->forking_time);
+		if (stats->restore->has_root_task_time)
+			pr_msg("Root task stage: %d us\n", stats->restore->root_task_time);
+		if (stats->restore->has_prepare_namespaces_time)
+			pr_msg("Prepare namespaces stage: %d us\n",
+					stats->restore->prepare_namespaces_time);
+		if (stats->restore->has_forking_stage_time)
+			pr_msg("Forking stage: %d us\n", stats->restore->forking_stage_time);
+		if (stats->restore->has_restore_stage_time)
+			pr_msg("Restore stage: %d us\n", stats->restore->restore_stage_time);
+		if (stats->restore->has_restore_sigchld_time)
+			pr_msg("Restore sigchld stage: %d us\n",
+					stats->restore->restore_sigchld_time);
+		if (stats->restore->has_restore_creds_time)
+			pr_msg("Restore creds stage: %d us\n",
+					stats->restore->restore_creds_time);
+		for (i = 0; i < stats->restore->n_tasks; i++) {
+			RestoreTaskStatsEntry *e = stats->restore->tasks[i];
+
+			pr_msg("Task %d: fork %d us, mem %d us, files %d us, sockets %d us\n",
+					e->pid, e->fork_time, e->mem_time,
+					e->files_time, e->sockets_time);
+		}
+		for (i = 0; i < stats->restore->n_decoded; i++) {
+			RestorePbStatsEntry *e = stats->restore->decoded[i];
+
+			pr_msg("Decoded %s: %" PRIu64 " objects, %" PRIu64 " bytes\n",
+					e->type, e->objects, e->bytes);
+		}
 	} else
 		return;
 }
@@ -184,6 +467,16 @@ void write_stats(int what)
 		ds_entry.shpages_written = dstats->counts[CNT_SHPAGES_WRITTEN];
 		ds_entry.has_shpages_written = true;
 
+		ds_entry.pages_zero = dstats->counts[CNT_PAGES_ZERO];
+		ds_entry.has_pages_zero = true;
+		ds_entry.pages_dup = dstats->counts[CNT_PAGES_DUP];
+		ds_entry.has_pages_dup = true;
+
+		ds_entry.pagemap_hits = dstats->counts[CNT_PAGEMAP_HITS];
+		ds_entry.has_pagemap_hits = true;
+		ds_entry.pagemap_misses = dstats->counts[CNT_PAGEMAP_MISSES];
+		ds_entry.has_pagemap_misses = true;
+
 		name = "dump";
 	} else if (what == RESTORE_STATS) {
 		stats.restore = &rs_entry;
@@ -196,6 +489,27 @@ void write_stats(int what)
 		encode_time(TIME_FORK, &rs_entry.forking_time);
 		encode_time(TIME_RESTORE, &rs_entry.restore_time);
 
+		rs_entry.has_root_task_time =
+			encode_stage(CR_STATE_ROOT_TASK, &rs_entry.root_task_time);
+		rs_entry.has_prepare_namespaces_time =
+			encode_stage(CR_STATE_PREPARE_NAMESPACES, &rs_entry.prepare_namespaces_time);
+		rs_entry.has_forking_stage_time =
+			encode_stage(CR_STATE_FORKING, &rs_entry.forking_stage_time);
+		rs_entry.has_restore_stage_time =
+			encode_stage(CR_STATE_RESTORE, &rs_entry.restore_stage_time);
+		rs_entry.has_restore_sigchld_time =
+			encode_stage(CR_STATE_RESTORE_SIGCHLD, &rs_entry.restore_sigchld_time);
+		rs_entry.has_restore_creds_time =
+			encode_stage(CR_STATE_RESTORE_CREDS, &rs_entry.restore_creds_time);
+
+		if (encode_task_stats(&rs_entry))
+			pr_warn("Can't encode per-task stats\n");
+		if (encode_pb_stats(&rs_entry))
+			pr_warn("Can't encode decoding stats\n");
+
+		if (opts.trace_file)
+			write_restore_trace();
+
 		name = "restore";
 	} else
 		return;
@@ -208,6 +522,9 @@ void write_stats(int what)
 
 	if (opts.display_stats)
 		display_stats(what, &stats);
+
+	if (what == RESTORE_STATS)
+		free_restore_stats(&rs_entry);
 }
 
 int init_stats(int what)
@@ -219,7 +536,9 @@ int init_stats(int what)
 		 * when dumping namespaces we fork() a separate process
 		 * for it and when it goes and dumps shmem segments
 		 * it will alter the CNT_SHPAGES_ counters, so we need
-		 * to have them in shmem.
+		 * to have them in shmem. The --mem-dump-workers update
+		 * the page counters concurrently, thus they are updated
+		 * atomically.
 		 */
 		dstats = shmalloc(sizeof(*dstats));
 		return dstats ? 0 : -1;
@@ -0,0 +1,131 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "int.h"
+#include "trace-event.h"
+#include "log.h"
+
+bool trace_enabled;
+static int trace_fd = -1;
+
+static void trace_write(const char *fmt, ...)
+{
+	char buf[512];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (len < 0 || len >= sizeof(buf)) {
+		pr_warn("Trace event is too long, skipping\n");
+		return;
+	}
+
+	if (write(trace_fd, buf, len) != len)
+		pr_perror("Can't write trace event");
+}
+
+int trace_open(const char *path)
+{
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (trace_fd < 0) {
+		pr_perror("Can't open trace file %s", path);
+		return -1;
+	}
+
+	/*
+	 * Having the first event written here lets all the others
+	 * start with a comma, even those from forked processes.
+	 */
+	trace_write("{\"traceEvents\":[\n"
+		    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+		    "\"args\":{\"name\":\"criu\"}}");
+	trace_enabled = true;
+	return 0;
+}
+
+void trace_close(void)
+{
+	if (!trace_enabled)
+		return;
+
+	trace_write("\n],\"displayTimeUnit\":\"ms\"}\n");
+	close(trace_fd);
+	trace_fd = -1;
+	trace_enabled = false;
+}
+
+static unsigned long long tv_usec(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+void trace_name_process(int pid, const char *name)
+{
+	if (!trace_enabled)
+		return;
+
+	trace_write(",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		    "\"args\":{\"name\":\"%s\"}}", pid, name);
+}
+
+void trace_name_thread(int pid, int tid, const char *name)
+{
+	if (!trace_enabled)
+		return;
+
+	trace_write(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		    "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, tid, name);
+}
+
+void trace_complete(const char *name, const char *cat, int pid, int tid,
+		    const struct timeval *start, const struct timeval *end,
+		    const char *arg, unsigned long val)
+{
+	unsigned long long ts, te;
+
+	if (!trace_enabled)
+		return;
+
+	ts = tv_usec(start);
+	te = tv_usec(end);
+	if (te < ts)
+		te = ts;
+
+	if (arg)
+		trace_write(",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			    "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,"
+			    "\"args\":{\"%s\":%lu}}",
+			    name, cat, ts, te - ts, pid, tid, arg, val);
+	else
+		trace_write(",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			    "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d}",
+			    name, cat, ts, te - ts, pid, tid);
+}
+
+void trace_instant(const char *name, const char *cat, int pid, int tid,
+		   const struct timeval *at)
+{
+	if (!trace_enabled)
+		return;
+
+	trace_write(",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"p\","
+		    "\"ts\":%llu,\"pid\":%d,\"tid\":%d}",
+		    name, cat, tv_usec(at), pid, tid);
+}
+
+void __trace_span_end(struct trace_span *s)
+{
+	struct timeval end;
+
+	if (!s->name) /* never started */
+		return;
+
+	gettimeofday(&end, NULL);
+	trace_complete(s->name, s->cat, s->pid, s->pid, &s->start, &end,
+		       s->arg, s->val);
+}
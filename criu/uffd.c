@@ -25,6 +25,7 @@
 #include "files-reg.h"
 #include "kerndat.h"
 #include "mem.h"
+#include "vma.h"
 #include "uffd.h"
 #include "util-pie.h"
 #include "protobuf.h"
@@ -41,6 +42,7 @@
 #include "fdstore.h"
 #include "util.h"
 #include "namespaces.h"
+#include "bitops.h"
 
 #undef  LOG_PREFIX
 #define LOG_PREFIX "uffd: "
@@ -69,13 +71,46 @@
 #define DEFAULT_XFER_LEN (64 << 10)
 #define MAX_XFER_LEN (4 << 20)
 
+/*
+ * Without page faults for that long the background transfer size
+ * grows twice at each step rather than by DEFAULT_XFER_LEN
+ */
+#define QUIET_PF_MSEC	10
+
 static mutex_t *lazy_sock_mutex;
 
+/*
+ * Shared anonymous memory is read from its own pages images, for
+ * all the tasks mapping it. A page copied via any of the mappings
+ * becomes present in all of them, so it's marked in the copied
+ * bitmap and dropped from the IOVs of the other mappings. The
+ * bitmap is shared with the workers, they don't see each other's
+ * IOVs, but check the bitmap before reading pages.
+ */
+struct lazy_shmem {
+	struct list_head l;
+	unsigned long shmid;
+	struct page_read pr;
+	unsigned long nr_pages;
+	unsigned long *copied;
+};
+
+static LIST_HEAD(lazy_shmems);
+
+/*
+ * Shmem segments mapped locked by some task have their content
+ * restored by open_shmem() right away, see collect_shmem(), so none
+ * of their mappings is registered with uffd.
+ */
+static unsigned long *eager_shmids;
+static int nr_eager_shmids;
+
 struct lazy_iov {
 	struct list_head l;
 	unsigned long start;	/* run-time start address, tracks remaps */
 	unsigned long end;	/* run-time end address, tracks remaps */
 	unsigned long img_start;	/* start address at the dump time */
+	struct lazy_shmem *shm;	/* img_start is the offset in there */
 };
 
 struct lazy_pages_info {
@@ -84,6 +119,8 @@ struct lazy_pages_info {
 
 	struct list_head iovs;
 	struct list_head reqs;
+	struct list_head hot;	/* PE_HOT ranges, transferred first */
+	struct lazy_iov *hot_iov;	/* where to look for hot ones from */
 
 	struct lazy_pages_info *parent;
 	unsigned ref_cnt;
@@ -108,10 +145,22 @@ static LIST_HEAD(exiting_lpis);
 static LIST_HEAD(pending_lpis);
 static int epollfd;
 static bool restore_finished;
+static struct timespec last_pf;
 static struct epoll_rfd lazy_sk_rfd;
 /* socket for communication with lazy-pages daemon */
 static int lazy_pages_sk_id = -1;
 
+/*
+ * With --lazy-pages-workers the uffds are spread over forked worker
+ * processes, each one serves page faults and background transfers
+ * of its own tasks with its own epoll loop and page_read-s. Only the
+ * main daemon talks to cr-restore, it closes the pipe to let the
+ * workers know the restore has finished.
+ */
+static pid_t *lazy_workers;
+static int nr_lazy_workers;
+static int lazy_workers_pipe = -1;
+
 static int handle_uffd_event(struct epoll_rfd *lpfd);
 
 static struct lazy_pages_info *lpi_init(void)
@@ -125,6 +174,7 @@ static struct lazy_pages_info *lpi_init(void)
 	memset(lpi, 0, sizeof(*lpi));
 	INIT_LIST_HEAD(&lpi->iovs);
 	INIT_LIST_HEAD(&lpi->reqs);
+	INIT_LIST_HEAD(&lpi->hot);
 	INIT_LIST_HEAD(&lpi->l);
 	lpi->lpfd.read_event = handle_uffd_event;
 	lpi->xfer_len = DEFAULT_XFER_LEN;
@@ -146,6 +196,13 @@ static void free_iovs(struct lazy_pages_info *lpi)
 		list_del(&p->l);
 		xfree(p);
 	}
+
+	list_for_each_entry_safe(p, n, &lpi->hot, l) {
+		list_del(&p->l);
+		xfree(p);
+	}
+
+	lpi->hot_iov = NULL;
 }
 
 static void lpi_fini(struct lazy_pages_info *lpi);
@@ -174,6 +231,8 @@ static void lpi_fini(struct lazy_pages_info *lpi)
 		lpi_put(lpi->parent);
 	if (!lpi->parent && lpi->pr.close)
 		lpi->pr.close(&lpi->pr);
+	else if (lpi->parent && lpi->pr.dpi)
+		close_image(lpi->pr.dpi);
 	xfree(lpi);
 }
 
@@ -299,6 +358,11 @@ err:
 	return -1;
 }
 
+bool uffd_lazy_shmem(void)
+{
+	return kdat.uffd_features & UFFD_FEATURE_MISSING_SHMEM;
+}
+
 /* This function is used by 'criu restore --lazy-pages' */
 int setup_uffd(int pid, struct task_restore_args *task_args)
 {
@@ -424,6 +488,18 @@ static struct lazy_iov *find_iov(struct lazy_pages_info *lpi,
 	return NULL;
 }
 
+/* Keep hot_iov in lpi->iovs when @iov leaves it */
+static void hot_iov_skip(struct lazy_pages_info *lpi, struct lazy_iov *iov)
+{
+	if (lpi->hot_iov != iov)
+		return;
+
+	if (list_is_last(&iov->l, &lpi->iovs))
+		lpi->hot_iov = NULL;
+	else
+		lpi->hot_iov = list_entry(iov->l.next, struct lazy_iov, l);
+}
+
 static int split_iov(struct lazy_iov *iov, unsigned long addr)
 {
 	struct lazy_iov *new;
@@ -435,6 +511,7 @@ static int split_iov(struct lazy_iov *iov, unsigned long addr)
 	new->start = addr;
 	new->img_start = iov->img_start + addr - iov->start;
 	new->end = iov->end;
+	new->shm = iov->shm;
 	iov->end = addr;
 	list_add(&new->l, &iov->l);
 
@@ -486,6 +563,7 @@ static int __copy_iov_list(struct list_head *src, struct list_head *dst)
 		new->start = iov->start;
 		new->img_start = iov->img_start;
 		new->end = iov->end;
+		new->shm = iov->shm;
 
 		list_add_tail(&new->l, dst);
 	}
@@ -502,6 +580,9 @@ static int copy_iovs(struct lazy_pages_info *src, struct lazy_pages_info *dst)
 	if (__copy_iov_list(&src->reqs, &dst->reqs))
 		goto free_iovs;
 
+	if (__copy_iov_list(&src->hot, &dst->hot))
+		goto free_iovs;
+
 	/*
 	 * The IOVs already in flight for the parent process need to be
 	 * transferred again for the child process
@@ -523,7 +604,8 @@ free_iovs:
  * Purge range (addr, addr + len) from lazy_iovs. The range may
  * cover several continuous IOVs.
  */
-static int __drop_iovs(struct list_head *iovs, unsigned long addr, int len)
+static int __drop_iovs(struct lazy_pages_info *lpi, struct list_head *iovs,
+		       unsigned long addr, int len)
 {
 	struct lazy_iov *iov, *n;
 
@@ -568,6 +650,7 @@ static int __drop_iovs(struct list_head *iovs, unsigned long addr, int len)
 		 * and continue to the next one with the updated range
 		 */
 		if (addr == start) {
+			hot_iov_skip(lpi, iov);
 			list_del(&iov->l);
 			xfree(iov);
 		} else {
@@ -583,10 +666,10 @@ static int __drop_iovs(struct list_head *iovs, unsigned long addr, int len)
 
 static int drop_iovs(struct lazy_pages_info *lpi, unsigned long addr, int len)
 {
-	if (__drop_iovs(&lpi->iovs, addr, len))
+	if (__drop_iovs(lpi, &lpi->iovs, addr, len))
 		return -1;
 
-	if (__drop_iovs(&lpi->reqs, addr, len))
+	if (__drop_iovs(lpi, &lpi->reqs, addr, len))
 		return -1;
 
 	return 0;
@@ -661,6 +744,9 @@ static int __remap_iovs(struct list_head *iovs,	unsigned long from,
 static int remap_iovs(struct lazy_pages_info *lpi, unsigned long from,
 		      unsigned long to, unsigned long len)
 {
+	/* The remapped iovs are moved around the list */
+	lpi->hot_iov = NULL;
+
 	if (__remap_iovs(&lpi->iovs, from, to, len))
 		return -1;
 
@@ -670,6 +756,220 @@ static int remap_iovs(struct lazy_pages_info *lpi, unsigned long from,
 	return 0;
 }
 
+static struct lazy_shmem *get_lazy_shmem(unsigned long shmid)
+{
+	struct lazy_shmem *shm;
+
+	list_for_each_entry(shm, &lazy_shmems, l)
+		if (shm->shmid == shmid)
+			return shm;
+
+	shm = xzalloc(sizeof(*shm));
+	if (!shm)
+		return NULL;
+
+	if (open_page_read(shmid, &shm->pr, PR_SHMEM) <= 0) {
+		pr_err("Failed to open pagemap of shmem 0x%lx\n", shmid);
+		xfree(shm);
+		return NULL;
+	}
+
+	while (shm->pr.advance(&shm->pr)) {
+		PagemapEntry *pe = shm->pr.pe;
+
+		shm->nr_pages = max_t(unsigned long, shm->nr_pages,
+				      pe->vaddr / PAGE_SIZE + pe->nr_pages);
+	}
+	shm->pr.reset(&shm->pr);
+
+	/* The workers are forked after all the shmems are collected */
+	shm->copied = mmap(NULL, BITS_TO_LONGS(shm->nr_pages) * sizeof(long) ?: PAGE_SIZE,
+			   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm->copied == MAP_FAILED) {
+		pr_perror("Can't map copied bitmap of shmem 0x%lx", shmid);
+		shm->pr.close(&shm->pr);
+		xfree(shm);
+		return NULL;
+	}
+
+	shm->shmid = shmid;
+	list_add(&shm->l, &lazy_shmems);
+	return shm;
+}
+
+static int collect_eager_shmids(void)
+{
+	struct pstree_item *item;
+
+	for_each_pstree_item(item) {
+		struct cr_img *img;
+		MmEntry *mm;
+		int i, ret;
+
+		img = open_image(CR_FD_MM, O_RSTR, vpid(item));
+		if (!img)
+			return -1;
+
+		ret = pb_read_one_eof(img, &mm, PB_MM);
+		close_image(img);
+		if (ret <= 0) {
+			if (ret < 0)
+				return -1;
+			continue;
+		}
+
+		for (i = 0; i < mm->n_vmas; i++) {
+			VmaEntry *vma = mm->vmas[i];
+
+			if (!vma_entry_is(vma, VMA_ANON_SHARED) ||
+			    vma_entry_is(vma, VMA_AREA_SYSVIPC) ||
+			    vma_entry_can_be_lazy_shmem(vma))
+				continue;
+
+			if (xrealloc_safe(&eager_shmids, (nr_eager_shmids + 1) *
+					  sizeof(*eager_shmids))) {
+				mm_entry__free_unpacked(mm, NULL);
+				return -1;
+			}
+			eager_shmids[nr_eager_shmids++] = vma->shmid;
+		}
+
+		mm_entry__free_unpacked(mm, NULL);
+	}
+
+	return 0;
+}
+
+static bool vma_is_lazy_shmem(VmaEntry *vma)
+{
+	int i;
+
+	if (!vma_entry_can_be_lazy_shmem(vma))
+		return false;
+
+	for (i = 0; i < nr_eager_shmids; i++)
+		if (eager_shmids[i] == vma->shmid)
+			return false;
+
+	return true;
+}
+
+/*
+ * The shmem pagemap is in offsets, the IOVs are the parts of it that
+ * are mapped by the vma.
+ */
+static int collect_shmem_iovs(struct lazy_pages_info *lpi, VmaEntry *vma,
+			      int *max_iov_len)
+{
+	unsigned long vma_len = vma->end - vma->start;
+	struct lazy_shmem *shm;
+	struct page_read *pr;
+	int nr_pages = 0;
+
+	shm = get_lazy_shmem(vma->shmid);
+	if (!shm)
+		return -1;
+
+	pr = &shm->pr;
+	pr->reset(pr);
+
+	while (pr->advance(pr)) {
+		unsigned long start = pr->pe->vaddr;
+		unsigned long end = start + pr->pe->nr_pages * PAGE_SIZE;
+		struct lazy_iov *iov;
+
+		start = max_t(unsigned long, start, vma->pgoff);
+		end = min_t(unsigned long, end, vma->pgoff + vma_len);
+		if (start >= end)
+			continue;
+
+		iov = xzalloc(sizeof(*iov));
+		if (!iov)
+			return -1;
+
+		INIT_LIST_HEAD(&iov->l);
+		iov->start = vma->start + start - vma->pgoff;
+		iov->end = iov->start + end - start;
+		iov->img_start = start;
+		iov->shm = shm;
+		iov_list_insert(iov, &lpi->iovs);
+
+		if (end - start > *max_iov_len)
+			*max_iov_len = end - start;
+		nr_pages += (end - start) / PAGE_SIZE;
+	}
+
+	lp_debug(lpi, "Found %d pages of shmem 0x%"PRIx64" at %"PRIx64"\n",
+		 nr_pages, vma->shmid, vma->start);
+
+	return nr_pages;
+}
+
+/* Returns how many pages from @off on are (@copied) or are not copied */
+static int shmem_copied_run(struct lazy_shmem *shm, unsigned long off,
+			    int nr, bool copied)
+{
+	unsigned long pg = off / PAGE_SIZE;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		bool c = pg + i < shm->nr_pages && test_bit(pg + i, shm->copied);
+
+		if (c != copied)
+			break;
+	}
+
+	return i;
+}
+
+static int drop_shmem_iovs(struct lazy_pages_info *lpi, struct lazy_shmem *shm,
+			   unsigned long off, unsigned long len)
+{
+	struct lazy_iov *iov;
+
+again:
+	list_for_each_entry(iov, &lpi->iovs, l) {
+		unsigned long s, e;
+
+		if (iov->shm != shm)
+			continue;
+
+		s = max(off, iov->img_start);
+		e = min(off + len, iov->img_start + iov->end - iov->start);
+		if (s >= e)
+			continue;
+
+		if (drop_iovs(lpi, iov->start + s - iov->img_start, e - s))
+			return -1;
+		lpi->copied_pages += (e - s) / PAGE_SIZE;
+		goto again;
+	}
+
+	return 0;
+}
+
+/*
+ * The pages are present in all the mappings of @shm now, none of
+ * them should read and copy them again.
+ */
+static int shmem_pages_copied(struct lazy_shmem *shm, unsigned long off, int nr)
+{
+	struct lazy_pages_info *lpi;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		set_bit(off / PAGE_SIZE + i, shm->copied);
+
+	list_for_each_entry(lpi, &lpis, l) {
+		if (lpi->exited)
+			continue;
+		if (drop_shmem_iovs(lpi, shm, off, nr * PAGE_SIZE))
+			return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Create a list of IOVs that can be handled using userfaultfd. The
  * IOVs generally correspond to lazy pagemap entries, except the cases
@@ -683,7 +983,7 @@ static int collect_iovs(struct lazy_pages_info *lpi)
 	struct page_read *pr = &lpi->pr;
 	struct lazy_iov *iov;
 	MmEntry *mm;
-	int nr_pages = 0, n_vma = 0, max_iov_len = 0;
+	int nr_pages = 0, nr_hot = 0, n_vma = 0, max_iov_len = 0;
 	int ret = -1;
 	unsigned long start, end, len;
 
@@ -699,6 +999,17 @@ static int collect_iovs(struct lazy_pages_info *lpi)
 		end = start + pr->pe->nr_pages * page_size();
 		nr_pages += pr->pe->nr_pages;
 
+		if (pagemap_hot(pr->pe)) {
+			iov = xzalloc(sizeof(*iov));
+			if (!iov)
+				goto free_iovs;
+
+			iov->start = iov->img_start = start;
+			iov->end = end;
+			list_add_tail(&iov->l, &lpi->hot);
+			nr_hot += pr->pe->nr_pages;
+		}
+
 		for (; n_vma < mm->n_vmas; n_vma++) {
 			VmaEntry *vma = mm->vmas[n_vma];
 
@@ -725,6 +1036,22 @@ static int collect_iovs(struct lazy_pages_info *lpi)
 		}
 	}
 
+	if (nr_hot)
+		lp_debug(lpi, "%d of the pages are hot\n", nr_hot);
+
+	for (n_vma = 0; uffd_lazy_shmem() && n_vma < mm->n_vmas; n_vma++) {
+		VmaEntry *vma = mm->vmas[n_vma];
+		int nr;
+
+		if (!vma_is_lazy_shmem(vma))
+			continue;
+
+		nr = collect_shmem_iovs(lpi, vma, &max_iov_len);
+		if (nr < 0)
+			goto free_iovs;
+		nr_pages += nr;
+	}
+
 	lpi->buf_size = max_iov_len;
 	if (posix_memalign(&lpi->buf, PAGE_SIZE, lpi->buf_size))
 		goto free_iovs;
@@ -857,7 +1184,24 @@ static int uffd_check_op_error(struct lazy_pages_info *lpi, const char *op,
 	return 0;
 }
 
-static int uffd_copy(struct lazy_pages_info *lpi, __u64 address, int *nr_pages)
+static int uffd_wake(struct lazy_pages_info *lpi, __u64 address, unsigned long len)
+{
+	struct uffdio_range range = {
+		.start = address,
+		.len = len,
+	};
+
+	lp_debug(lpi, "uffd_wake: 0x%llx/%lu\n", address, len);
+	if (ioctl(lpi->lpfd.fd, UFFDIO_WAKE, &range)) {
+		lp_perror(lpi, "Failed to wake at %llx", address);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int uffd_copy(struct lazy_pages_info *lpi, __u64 address, int *nr_pages,
+		     bool shm)
 {
 	struct uffdio_copy uffdio_copy;
 	unsigned long len = *nr_pages * page_size();
@@ -869,24 +1213,37 @@ static int uffd_copy(struct lazy_pages_info *lpi, __u64 address, int *nr_pages)
 	uffdio_copy.copy = 0;
 
 	lp_debug(lpi, "uffd_copy: 0x%llx/%ld\n", uffdio_copy.dst, len);
-	if (ioctl(lpi->lpfd.fd, UFFDIO_COPY, &uffdio_copy) &&
-	    uffd_check_op_error(lpi, "copy", nr_pages, uffdio_copy.copy))
-		return -1;
+	if (ioctl(lpi->lpfd.fd, UFFDIO_COPY, &uffdio_copy)) {
+		/*
+		 * A shared page may be already there, when another worker
+		 * has copied it via another mapping. Nothing wakes the
+		 * task that might have faulted on it in this case.
+		 */
+		if (shm && uffdio_copy.copy == -EEXIST) {
+			*nr_pages = 1;
+			return uffd_wake(lpi, address, page_size());
+		}
+
+		if (uffd_check_op_error(lpi, "copy", nr_pages, uffdio_copy.copy))
+			return -1;
+	}
 
 	lpi->copied_pages += *nr_pages;
 
 	return 0;
 }
 
-static int uffd_io_complete(struct page_read *pr, unsigned long img_addr, int nr)
+/*
+ * With @present the pages are already there and the task is only
+ * woken up, that's for shmem pages copied via another mapping.
+ */
+static int complete_req(struct lazy_pages_info *lpi, struct lazy_shmem *shm,
+			unsigned long img_addr, int nr, bool present)
 {
-	struct lazy_pages_info *lpi;
 	unsigned long addr = 0;
 	int req_pages, ret;
 	struct lazy_iov *req;
 
-	lpi = container_of(pr, struct lazy_pages_info, pr);
-
 	/*
 	 * The process may exit while we still have requests in
 	 * flight. We just drop the request and the received data in
@@ -896,7 +1253,7 @@ static int uffd_io_complete(struct page_read *pr, unsigned long img_addr, int nr
 		return 0;
 
 	list_for_each_entry(req, &lpi->reqs, l) {
-		if (req->img_start == img_addr) {
+		if (req->shm == shm && req->img_start == img_addr) {
 			addr = req->start;
 			break;
 		}
@@ -916,7 +1273,10 @@ static int uffd_io_complete(struct page_read *pr, unsigned long img_addr, int nr
 	req_pages = (req->end - req->start) / PAGE_SIZE;
 	nr = min(nr, req_pages);
 
-	ret = uffd_copy(lpi, addr, &nr);
+	if (present)
+		ret = uffd_wake(lpi, addr, nr * PAGE_SIZE);
+	else
+		ret = uffd_copy(lpi, addr, &nr, shm != NULL);
 	if (ret < 0)
 		return ret;
 
@@ -930,7 +1290,24 @@ static int uffd_io_complete(struct page_read *pr, unsigned long img_addr, int nr
 	 * list and let drop_iovs do the range math, free memory etc.
 	 */
 	iov_list_insert(req, &lpi->iovs);
-	return drop_iovs(lpi, addr, nr * PAGE_SIZE);
+	if (lpi->hot_iov && req->start < lpi->hot_iov->start)
+		lpi->hot_iov = req;
+	if (drop_iovs(lpi, addr, nr * PAGE_SIZE))
+		return -1;
+
+	if (shm && !present)
+		return shmem_pages_copied(shm, img_addr, nr);
+
+	return 0;
+}
+
+static int uffd_io_complete(struct page_read *pr, unsigned long img_addr, int nr)
+{
+	struct lazy_pages_info *lpi;
+
+	lpi = container_of(pr, struct lazy_pages_info, pr);
+
+	return complete_req(lpi, NULL, img_addr, nr, false);
 }
 
 static int uffd_zero(struct lazy_pages_info *lpi, __u64 address, int nr_pages)
@@ -960,13 +1337,14 @@ static int uffd_zero(struct lazy_pages_info *lpi, __u64 address, int nr_pages)
  * Returns 0 for zero pages, 1 for "real" pages and negative value on
  * error
  */
-static int uffd_seek_pages(struct lazy_pages_info *lpi, __u64 address, int nr)
+static int uffd_seek_pages(struct lazy_pages_info *lpi, struct page_read *pr,
+			   __u64 address, int nr)
 {
 	int ret;
 
-	lpi->pr.reset(&lpi->pr);
+	pr->reset(pr);
 
-	ret = lpi->pr.seek_pagemap(&lpi->pr, address);
+	ret = pr->seek_pagemap(pr, address);
 	if (!ret) {
 		lp_err(lpi, "no pagemap covers %llx\n", address);
 		return -1;
@@ -975,26 +1353,91 @@ static int uffd_seek_pages(struct lazy_pages_info *lpi, __u64 address, int nr)
 	return 0;
 }
 
-static int uffd_handle_pages(struct lazy_pages_info *lpi, __u64 address, int nr, unsigned flags)
+/*
+ * Shmem pages images are always local and read synchronously, the
+ * request is completed right here.
+ */
+static int uffd_handle_pages(struct lazy_pages_info *lpi, struct lazy_iov *req,
+			     int nr, unsigned flags)
 {
+	struct page_read *pr = req->shm ? &req->shm->pr : &lpi->pr;
+	unsigned long address = req->img_start;
+	struct lazy_shmem *shm = req->shm;
 	int ret;
 
-	ret = uffd_seek_pages(lpi, address, nr);
+	if (shm) {
+		int copied;
+
+		copied = shmem_copied_run(shm, address, nr, true);
+		if (copied)
+			return complete_req(lpi, shm, address, copied, true);
+
+		nr = shmem_copied_run(shm, address, nr, false);
+		flags = 0;
+	}
+
+	ret = uffd_seek_pages(lpi, pr, address, nr);
 	if (ret)
 		return ret;
 
-	ret = lpi->pr.read_pages(&lpi->pr, address, nr, lpi->buf, flags);
+	ret = pr->read_pages(pr, address, nr, lpi->buf, flags);
 	if (ret <= 0) {
-		lp_err(lpi, "failed reading pages at %llx\n", address);
+		lp_err(lpi, "failed reading pages at %lx\n", address);
 		return ret;
 	}
 
+	if (shm)
+		return complete_req(lpi, shm, address, nr, false);
+
 	return 0;
 }
 
-static struct lazy_iov *pick_next_range(struct lazy_pages_info *lpi)
+/*
+ * Hot ranges go first, then the rest in address order. A hot range is
+ * dropped once none of its pages is left to transfer, as well as when
+ * its pages have been remapped somewhere else. Both lists are sorted,
+ * so the iovs are walked from where the previous hot range was found.
+ */
+static struct lazy_iov *pick_next_range(struct lazy_pages_info *lpi,
+					unsigned long *start, unsigned long *end)
 {
-	return list_first_entry(&lpi->iovs, struct lazy_iov, l);
+	struct lazy_iov *hot, *n, *iov;
+
+	iov = lpi->hot_iov ?: list_first_entry(&lpi->iovs, struct lazy_iov, l);
+	list_for_each_entry_safe(hot, n, &lpi->hot, l) {
+		list_for_each_entry_from(iov, &lpi->iovs, l) {
+			if (iov->start >= hot->end)
+				break;
+			if (iov->end <= hot->start)
+				continue;
+
+			lpi->hot_iov = iov;
+			*start = max(iov->start, hot->start);
+			*end = min(iov->end, hot->end);
+			return iov;
+		}
+
+		list_del(&hot->l);
+		xfree(hot);
+	}
+	lpi->hot_iov = NULL;
+
+	iov = list_first_entry(&lpi->iovs, struct lazy_iov, l);
+	*start = iov->start;
+	*end = iov->end;
+	return iov;
+}
+
+static bool page_faults_quiet(void)
+{
+	struct timespec now;
+	long msec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msec = (now.tv_sec - last_pf.tv_sec) * 1000 +
+		(now.tv_nsec - last_pf.tv_nsec) / 1000000;
+
+	return msec >= QUIET_PF_MSEC;
 }
 
 /*
@@ -1002,11 +1445,25 @@ static struct lazy_iov *pick_next_range(struct lazy_pages_info *lpi)
  * The idea is to transfer larger chunks when there is no page faults
  * and drop the background transfer size each time #PF occurs to some
  * default value. The default is empirically set to 64Kbytes
+ *
+ * Background transfers of all the tasks share one loop with the #PF
+ * handling, so a #PF drops the transfer size for all of them, not to
+ * keep the following faults waiting behind large copies. While there
+ * are no faults the size grows faster.
  */
 static void update_xfer_len(struct lazy_pages_info *lpi, bool pf)
 {
-	if (pf)
-		lpi->xfer_len = DEFAULT_XFER_LEN;
+	struct lazy_pages_info *p;
+
+	if (pf) {
+		clock_gettime(CLOCK_MONOTONIC, &last_pf);
+		list_for_each_entry(p, &lpis, l)
+			p->xfer_len = DEFAULT_XFER_LEN;
+		return;
+	}
+
+	if (page_faults_quiet())
+		lpi->xfer_len *= 2;
 	else
 		lpi->xfer_len += DEFAULT_XFER_LEN;
 
@@ -1018,25 +1475,26 @@ static int xfer_pages(struct lazy_pages_info *lpi)
 {
 	struct lazy_iov *iov;
 	unsigned int nr_pages;
-	unsigned long len;
+	unsigned long start, end, len;
 	int err;
 
-	iov = pick_next_range(lpi);
+	iov = pick_next_range(lpi, &start, &end);
 	if (!iov)
 		return 0;
 
-	len = min(iov->end - iov->start, lpi->xfer_len);
+	len = min(end - start, lpi->xfer_len);
 
-	iov = extract_range(iov, iov->start, iov->start + len);
+	iov = extract_range(iov, start, start + len);
 	if (!iov)
 		return -1;
+	hot_iov_skip(lpi, iov);
 	list_move(&iov->l, &lpi->reqs);
 
 	nr_pages = (iov->end - iov->start) / PAGE_SIZE;
 
 	update_xfer_len(lpi, false);
 
-	err = uffd_handle_pages(lpi, iov->img_start, nr_pages, PR_ASYNC | PR_ASAP);
+	err = uffd_handle_pages(lpi, iov, nr_pages, PR_ASYNC | PR_ASAP);
 	if (err < 0) {
 		lp_err(lpi, "Error during UFFD copy\n");
 		return -1;
@@ -1185,11 +1643,12 @@ static int handle_page_fault(struct lazy_pages_info *lpi, struct uffd_msg *msg)
 	if (!iov)
 		return -1;
 
+	hot_iov_skip(lpi, iov);
 	list_move(&iov->l, &lpi->reqs);
 
 	update_xfer_len(lpi, true);
 
-	ret = uffd_handle_pages(lpi, iov->img_start, 1, PR_ASYNC | PR_ASAP);
+	ret = uffd_handle_pages(lpi, iov, 1, PR_ASYNC | PR_ASAP);
 	if (ret < 0) {
 		lp_err(lpi, "Error during regular page copy\n");
 		return -1;
@@ -1365,6 +1824,7 @@ static int lazy_sk_read_event(struct epoll_rfd *rfd)
 	}
 
 	restore_finished = true;
+	close_safe(&lazy_workers_pipe);
 
 	return 1;
 }
@@ -1379,7 +1839,132 @@ static int lazy_sk_hangup_event(struct epoll_rfd *rfd)
 	return 0;
 }
 
-static int prepare_uffds(int listen, int epollfd)
+static int lazy_worker_hangup_event(struct epoll_rfd *rfd)
+{
+	restore_finished = true;
+	return 1;
+}
+
+static int lazy_worker_read_event(struct epoll_rfd *rfd)
+{
+	return 0;
+}
+
+/* Keeps every nr-th of the uffds starting from idx-th */
+static void keep_lpis(int idx, int nr)
+{
+	struct lazy_pages_info *lpi, *n;
+	int i = 0;
+
+	list_for_each_entry_safe(lpi, n, &lpis, l) {
+		if (i++ % nr == idx)
+			continue;
+
+		list_del(&lpi->l);
+		lpi_put(lpi);
+	}
+}
+
+static void stop_lazy_workers(void)
+{
+	int i;
+
+	for (i = 0; i < nr_lazy_workers; i++)
+		kill(lazy_workers[i], SIGKILL);
+}
+
+static int wait_lazy_workers(void)
+{
+	int i, status, ret = 0;
+
+	for (i = 0; i < nr_lazy_workers; i++) {
+		if (waitpid(lazy_workers[i], &status, 0) != lazy_workers[i]) {
+			pr_perror("Unable to wait lazy-pages worker %d",
+				  lazy_workers[i]);
+			ret = -1;
+			continue;
+		}
+
+		if (status) {
+			pr_err("Lazy-pages worker %d failed (%d)\n",
+			       lazy_workers[i], status);
+			ret = -1;
+		}
+	}
+
+	nr_lazy_workers = 0;
+	xfree(lazy_workers);
+	lazy_workers = NULL;
+
+	return ret;
+}
+
+static int start_lazy_workers(void)
+{
+	struct lazy_pages_info *lpi;
+	int nr = 0, i, p[2];
+
+	list_for_each_entry(lpi, &lpis, l)
+		nr++;
+
+	nr = min(nr, opts.lazy_pages_workers);
+	if (nr < 2)
+		return 0;
+
+	if (pipe(p)) {
+		pr_perror("Can't create lazy-pages workers pipe");
+		return -1;
+	}
+
+	lazy_workers = xmalloc((nr - 1) * sizeof(*lazy_workers));
+	if (!lazy_workers) {
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+
+	for (i = 1; i < nr; i++) {
+		pid_t pid;
+
+		pid = fork();
+		if (pid < 0) {
+			pr_perror("Can't fork lazy-pages worker");
+			close(p[0]);
+			close(p[1]);
+			stop_lazy_workers();
+			wait_lazy_workers();
+			return -1;
+		}
+
+		if (pid == 0) {
+			close(p[1]);
+			xfree(lazy_workers);
+			lazy_workers = NULL;
+			nr_lazy_workers = 0;
+
+			keep_lpis(i, nr);
+
+			/* The restore is followed by the main daemon */
+			close_safe(&lazy_sk_rfd.fd);
+			lazy_sk_rfd.fd = p[0];
+			lazy_sk_rfd.read_event = lazy_worker_read_event;
+			lazy_sk_rfd.hangup_event = lazy_worker_hangup_event;
+
+			return 0;
+		}
+
+		lazy_workers[nr_lazy_workers++] = pid;
+	}
+
+	close(p[0]);
+	lazy_workers_pipe = p[1];
+	keep_lpis(0, nr);
+
+	pr_info("Started %d lazy-pages workers\n", nr_lazy_workers);
+	return 0;
+}
+
+static int prepare_uffds(int listen)
 {
 	int i;
 	int client;
@@ -1398,17 +1983,11 @@ static int prepare_uffds(int listen, int epollfd)
 		struct lazy_pages_info *lpi = NULL;
 		if (ud_open(client, &lpi))
 			goto close_uffd;
-		if (lpi == NULL)
-			continue;
-		if (epoll_add_rfd(epollfd, &lpi->lpfd))
-			goto close_uffd;
 	}
 
 	lazy_sk_rfd.fd = client;
 	lazy_sk_rfd.read_event = lazy_sk_read_event;
 	lazy_sk_rfd.hangup_event = lazy_sk_hangup_event;
-	if (epoll_add_rfd(epollfd, &lazy_sk_rfd))
-		goto close_uffd;
 
 	close(listen);
 	return 0;
@@ -1419,6 +1998,17 @@ close_uffd:
 	return -1;
 }
 
+static int add_lazy_rfds(int epollfd)
+{
+	struct lazy_pages_info *lpi;
+
+	list_for_each_entry(lpi, &lpis, l)
+		if (epoll_add_rfd(epollfd, &lpi->lpfd))
+			return -1;
+
+	return epoll_add_rfd(epollfd, &lazy_sk_rfd);
+}
+
 int cr_lazy_pages(bool daemon)
 {
 	struct epoll_event *events;
@@ -1432,6 +2022,9 @@ int cr_lazy_pages(bool daemon)
 	if (prepare_dummy_pstree())
 		return -1;
 
+	if (uffd_lazy_shmem() && collect_eager_shmids())
+		return -1;
+
 	lazy_sk = prepare_lazy_socket();
 	if (lazy_sk < 0)
 		return -1;
@@ -1459,27 +2052,49 @@ int cr_lazy_pages(bool daemon)
 	if (status_ready())
 		return -1;
 
+	if (prepare_uffds(lazy_sk))
+		return -1;
+
+	if (opts.lazy_pages_workers > 1 && start_lazy_workers())
+		return -1;
+
 	/*
 	 * we poll nr_tasks userfault fds, UNIX socket between lazy-pages
-	 * daemon and the cr-restore, and, optionally TCP socket for
-	 * remote pages
+	 * daemon and the cr-restore (or the pipe from the main daemon
+	 * for workers), and, optionally TCP socket for remote pages
 	 */
 	nr_fds = task_entries->nr_tasks + (opts.use_page_server ? 2 : 1);
 	epollfd = epoll_prepare(nr_fds, &events);
 	if (epollfd < 0)
-		return -1;
+		goto err;
 
-	if (prepare_uffds(lazy_sk, epollfd))
-		return -1;
+	if (add_lazy_rfds(epollfd))
+		goto err;
 
 	if (opts.use_page_server) {
 		if (connect_to_page_server_to_recv(epollfd))
-			return -1;
+			goto err;
 	}
 
 	ret = handle_requests(epollfd, events, nr_fds);
 
 	tls_terminate_session();
 
+	if (!lazy_workers)
+		return ret;
+
+	close_safe(&lazy_workers_pipe);
+	if (ret)
+		stop_lazy_workers();
+	if (wait_lazy_workers())
+		ret = -1;
+
 	return ret;
+
+err:
+	if (lazy_workers) {
+		stop_lazy_workers();
+		wait_lazy_workers();
+	}
+	return -1;
 }
@@ -185,13 +185,18 @@ class pagemap_handler:
     """
     Special entry handler for pagemap.img, which is unique in a way
     that it has a header of pagemap_head type followed by entries
-    of pagemap_entry type.
+    of pagemap_entry type. The page-frames.img is laid out the same
+    way with pages_frames_head and pages_frame_entry.
     """
 
+    def __init__(self, head=pb.pagemap_head, entry=pb.pagemap_entry):
+        self.head = head
+        self.entry = entry
+
     def load(self, f, pretty=False, no_payload=False):
         entries = []
 
-        pbuff = pb.pagemap_head()
+        pbuff = self.head()
         while True:
             buf = f.read(4)
             if buf == b'':
@@ -200,7 +205,7 @@ class pagemap_handler:
             pbuff.ParseFromString(f.read(size))
             entries.append(pb2dict.pb2dict(pbuff, pretty))
 
-            pbuff = pb.pagemap_entry()
+            pbuff = self.entry()
 
         return entries
 
@@ -209,7 +214,7 @@ class pagemap_handler:
         return self.load(f, pretty)
 
     def dump(self, entries, f):
-        pbuff = pb.pagemap_head()
+        pbuff = self.head()
         for item in entries:
             pb2dict.dict2pb(item, pbuff)
             pb_str = pbuff.SerializeToString()
@@ -217,7 +222,7 @@ class pagemap_handler:
             f.write(struct.pack('i', size))
             f.write(pb_str)
 
-            pbuff = pb.pagemap_entry()
+            pbuff = self.entry()
 
     def dumps(self, entries):
         f = io.BytesIO('')
@@ -490,6 +495,8 @@ handlers = {
                                 tcp_stream_extra_handler()),
     'STATS': entry_handler(pb.stats_entry),
     'PAGEMAP': pagemap_handler(),  # Special one
+    'PAGES_FRAMES': pagemap_handler(pb.pages_frames_head,
+                                    pb.pages_frame_entry),
     'PSTREE': entry_handler(pb.pstree_entry),
     'REG_FILES': entry_handler(pb.reg_file_entry),
     'NS_FILES': entry_handler(pb.ns_file_entry),
@@ -102,6 +102,8 @@ mmap_status_map = [
     ('VMA_AREA_SOCKET', 1 << 11),
     ('VMA_AREA_VVAR', 1 << 12),
     ('VMA_AREA_AIORING', 1 << 13),
+    ('VMA_AREA_MEMFD', 1 << 14),
+    ('VMA_AREA_THP', 1 << 15),
     ('VMA_UNSUPP', 1 << 31),
 ]
 
@@ -136,6 +138,9 @@ pmap_flags_map = [
     ('PE_PARENT', 1 << 0),
     ('PE_LAZY', 1 << 1),
     ('PE_PRESENT', 1 << 2),
+    ('PE_ZERO', 1 << 3),
+    ('PE_DUP', 1 << 4),
+    ('PE_HOT', 1 << 5),
 ]
 
 flags_maps = {
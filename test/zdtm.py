@@ -8,6 +8,7 @@ import datetime
 import errno
 import fcntl
 import glob
+import json
 import linecache
 import mmap
 import os
@@ -1201,10 +1202,33 @@ class criu:
         subprocess.Popen([self.__crit_bin, "show",
                           self.__stats_file(action)]).wait()
 
+    def check_trace(self, action):
+        if action == "restore":
+            opts = self.__test.getropts()
+        else:
+            opts = self.__test.getdopts()
+        if "--trace-file" not in opts:
+            return
+
+        fname = opts[opts.index("--trace-file") + 1]
+        try:
+            with open(fname) as f:
+                events = json.load(f)['traceEvents']
+        except (IOError, ValueError, KeyError) as e:
+            print("ERROR: bad %s trace %s: %s" % (action, fname, e))
+            raise test_fail_exc("%s trace" % action)
+
+        if len(events) < 2:
+            raise test_fail_exc("no events in %s trace" % action)
+
     def check_pages_counts(self):
         if not os.access(self.__stats_file("dump"), os.R_OK):
             return
 
+        # Compressed pages images are not page aligned
+        if '--compress' in self.__test.getdopts():
+            return
+
         stats_written = -1
         with open(self.__stats_file("dump"), 'rb') as stfile:
             stats = crpc.images.load(stfile)
@@ -1303,6 +1327,12 @@ class criu:
             if self.__dedup:
                 ps_opts += ["--auto-dedup"]
 
+            # The page server has to accept all the connections
+            dopts = self.__test.getdopts()
+            if "--ps-connections" in dopts:
+                i = dopts.index("--ps-connections")
+                ps_opts += dopts[i:i + 2]
+
             self.__page_server_p = self.__criu_act("page-server",
                                                    opts=ps_opts,
                                                    nowait=True)
@@ -1350,6 +1380,8 @@ class criu:
 
         self.show_stats("dump")
         self.check_pages_counts()
+        if not nowait:
+            self.check_trace(action)
 
         if self.__leave_stopped:
             pstree_check_stopped(self.__test.getpid())
@@ -1403,6 +1435,12 @@ class criu:
                 self.__page_server_p = self.__criu_act("page-server",
                                                        opts=ps_opts,
                                                        nowait=True)
+            # The daemon is the one to spread the tasks over workers
+            ropts = self.__test.getropts()
+            if "--lazy-pages-workers" in ropts:
+                i = ropts.index("--lazy-pages-workers")
+                lp_opts += ropts[i:i + 2]
+
             self.__lazy_pages_p = self.__criu_act("lazy-pages",
                                                   opts=lp_opts,
                                                   nowait=True)
@@ -1418,6 +1456,7 @@ class criu:
                 raise test_fail_exc("criu-image-streamer exited with %d" % ret)
 
         self.show_stats("restore")
+        self.check_trace("restore")
 
         if self.__leave_stopped:
             pstree_check_stopped(self.__test.getpid())
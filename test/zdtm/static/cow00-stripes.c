@@ -0,0 +1 @@
+cow00.c
\ No newline at end of file
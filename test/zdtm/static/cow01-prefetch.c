@@ -0,0 +1 @@
+cow01.c
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <linux/limits.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that pages changed after fork, even by one byte, "
+			  "are restored, and the others stay cow";
+const char *test_author	= "agent <agent@local>";
+
+#define NR_PAGES	64
+
+/*
+ * Pages 4n + 1 get one byte changed by the child, 4n + 2 have their
+ * byte written back unchanged, 4n + 3 are rewritten as a whole. The
+ * parent changes one byte in pages 8n + 4.
+ */
+static char expected(int i, int off, bool child)
+{
+	char v = i + 1;
+
+	if (child) {
+		if (i % 4 == 1 && off == PAGE_SIZE - 1)
+			return v + 1;
+		if (i % 4 == 3)
+			return ~v;
+	} else if (i % 8 == 4 && off == 0)
+		return v + 1;
+
+	return v;
+}
+
+static void change_pages(char *m, bool child)
+{
+	int i, off;
+
+	for (i = 0; i < NR_PAGES; i++) {
+		char *p = m + i * PAGE_SIZE;
+
+		if (child && i % 4 == 2)
+			*(volatile char *)p = p[0];
+
+		for (off = 0; off < PAGE_SIZE; off++)
+			if (p[off] != expected(i, off, child))
+				p[off] = expected(i, off, child);
+	}
+}
+
+static int check_pages(char *m, bool child)
+{
+	int i, off;
+
+	for (i = 0; i < NR_PAGES; i++) {
+		char *p = m + i * PAGE_SIZE;
+
+		for (off = 0; off < PAGE_SIZE; off++) {
+			if (p[off] == expected(i, off, child))
+				continue;
+
+			pr_err("%s page %d: %d at %d instead of %d\n",
+			       child ? "Child's" : "Parent's", i, p[off], off,
+			       expected(i, off, child));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int is_cow(void *addr, pid_t p1, pid_t p2)
+{
+	char buf[PATH_MAX];
+	unsigned long pfn = (unsigned long) addr / PAGE_SIZE;
+	uint64_t map1, map2;
+	int fd1, fd2, i;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/pagemap", p1);
+	fd1 = open(buf, O_RDONLY);
+	if (fd1 < 0) {
+		pr_perror("Unable to open file %s", buf);
+		return -1;
+	}
+
+	snprintf(buf, sizeof(buf), "/proc/%d/pagemap", p2);
+	fd2 = open(buf, O_RDONLY);
+	if (fd2 < 0) {
+		pr_perror("Unable to open file %s", buf);
+		close(fd1);
+		return -1;
+	}
+
+	/* A page can be swapped or unswapped, try several times */
+	for (i = 0; i < 10; i++) {
+		if (pread(fd1, &map1, sizeof(map1), pfn * sizeof(map1)) != sizeof(map1) ||
+		    pread(fd2, &map2, sizeof(map2), pfn * sizeof(map2)) != sizeof(map2)) {
+			pr_perror("Unable to read pagemap");
+			map1 = 0;
+			map2 = 1;
+			break;
+		}
+
+		if (map1 == map2)
+			break;
+	}
+
+	close(fd1);
+	close(fd2);
+
+	return map1 == map2;
+}
+
+int main(int argc, char **argv)
+{
+	task_waiter_t t;
+	int i, status, ret = 1;
+	pid_t pid;
+	char *m;
+
+	test_init(argc, argv);
+	task_waiter_init(&t);
+
+	m = mmap(NULL, NR_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		pr_perror("Can't allocate memory");
+		return 1;
+	}
+
+	for (i = 0; i < NR_PAGES; i++)
+		memset(m + i * PAGE_SIZE, i + 1, PAGE_SIZE);
+
+	pid = test_fork();
+	if (pid < 0) {
+		pr_perror("Unable to fork a new process");
+		return 1;
+	}
+
+	if (pid == 0) {
+		change_pages(m, true);
+		task_waiter_complete(&t, 1);
+		test_waitsig();
+
+		return check_pages(m, true) ? 1 : 0;
+	}
+
+	change_pages(m, false);
+	task_waiter_wait4(&t, 1);
+
+	test_daemon();
+	test_waitsig();
+
+	if (check_pages(m, false)) {
+		fail("Parent's memory is corrupted");
+		goto out;
+	}
+
+	for (i = 0; i < NR_PAGES; i += 4) {
+		if (i % 8 == 4)
+			continue;
+
+		if (is_cow(m + i * PAGE_SIZE, pid, getpid()) != 1) {
+			fail("Page %d is not shared", i);
+			goto out;
+		}
+	}
+
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait for the child");
+		return 1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fail("Child's memory is corrupted");
+		return 1;
+	}
+
+	pass();
+	return 0;
+out:
+	kill(pid, SIGTERM);
+	wait(NULL);
+	return ret;
+}
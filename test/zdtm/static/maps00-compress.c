@@ -0,0 +1 @@
+maps00.c
\ No newline at end of file
@@ -0,0 +1 @@
+maps04.c
\ No newline at end of file
@@ -0,0 +1 @@
+pipe00.c
\ No newline at end of file
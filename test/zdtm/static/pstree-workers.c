@@ -0,0 +1 @@
+pstree.c
\ No newline at end of file
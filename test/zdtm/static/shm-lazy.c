@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check shared anonymous memory mapped by two tasks "
+			  "that read it in different orders after restore";
+const char *test_author	= "agent <agent@local>";
+
+#define NR_PAGES	1024
+#define MEM_SIZE	(NR_PAGES * PAGE_SIZE)
+
+/* Every third page is left untouched and must read back as zeroes */
+static inline char page_val(int i)
+{
+	return i % 3 ? (i & 0x7f) + 1 : 0;
+}
+
+static int check_pages(char *m, bool backwards)
+{
+	int i, j;
+
+	for (j = 0; j < NR_PAGES; j++) {
+		char *p;
+
+		i = backwards ? NR_PAGES - 1 - j : j;
+		p = m + i * PAGE_SIZE;
+
+		if (p[0] != page_val(i) || p[PAGE_SIZE - 1] != page_val(i)) {
+			pr_err("Page %d: %d/%d instead of %d\n", i,
+			       p[0], p[PAGE_SIZE - 1], page_val(i));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	task_waiter_t t;
+	int i, status;
+	pid_t pid;
+	char *m;
+
+	test_init(argc, argv);
+	task_waiter_init(&t);
+
+	m = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		pr_perror("Can't map shared memory");
+		return 1;
+	}
+
+	for (i = 0; i < NR_PAGES; i++)
+		if (page_val(i))
+			memset(m + i * PAGE_SIZE, page_val(i), PAGE_SIZE);
+
+	pid = test_fork();
+	if (pid < 0) {
+		pr_perror("Can't fork");
+		return 1;
+	}
+
+	if (pid == 0) {
+		task_waiter_complete(&t, 1);
+		test_waitsig();
+
+		/* The other mapper goes from the other end */
+		return check_pages(m, true) ? 1 : 0;
+	}
+
+	task_waiter_wait4(&t, 1);
+
+	test_daemon();
+	test_waitsig();
+
+	kill(pid, SIGTERM);
+
+	if (check_pages(m, false)) {
+		fail("Shared memory is corrupted in the parent");
+		goto err;
+	}
+
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait for the child");
+		return 1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fail("Shared memory is corrupted in the child");
+		return 1;
+	}
+
+	pass();
+	return 0;
+err:
+	waitpid(pid, NULL, 0);
+	return 1;
+}
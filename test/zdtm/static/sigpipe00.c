@@ -0,0 +1,147 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that a child with its own memory keeps default "
+			  "SIGPIPE and SIGUSR1 actions its parent doesn't have";
+const char *test_author	= "agent <agent@local>";
+
+/*
+ * The child re-executes the test, so it shares no vmas with the parent
+ * and is forked before the parent restores its memory and sigactions.
+ */
+#define CHILD_ENV	"SIGPIPE00_CHILD"
+
+static void usr1_handler(int sig)
+{
+}
+
+static bool sig_dfl(int sig)
+{
+	struct sigaction sa;
+
+	if (sigaction(sig, NULL, &sa))
+		return false;
+
+	return sa.sa_handler == SIG_DFL;
+}
+
+/* Answers each byte from stdin with whether its actions are default */
+static int sigpipe_child(void)
+{
+	char c;
+
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+
+	while (read(0, &c, 1) == 1) {
+		c = sig_dfl(SIGPIPE) && sig_dfl(SIGUSR1);
+		if (write(1, &c, 1) != 1)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int child_actions_dfl(int in, int out)
+{
+	char c = 0;
+
+	if (write(in, &c, 1) != 1 || read(out, &c, 1) != 1) {
+		pr_perror("Can't talk to the child");
+		return -1;
+	}
+
+	return c;
+}
+
+int main(int argc, char **argv)
+{
+	int pipe_in[2], pipe_out[2];
+	int status, ret;
+	pid_t pid;
+
+	if (getenv(CHILD_ENV))
+		return sigpipe_child();
+
+	test_init(argc, argv);
+
+	if (pipe(pipe_in) || pipe(pipe_out)) {
+		pr_perror("Can't create pipes");
+		return 1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork");
+		return 1;
+	}
+
+	if (pid == 0) {
+		if (dup2(pipe_in[0], 0) < 0 || dup2(pipe_out[1], 1) < 0) {
+			pr_perror("Can't set up the child's stdio");
+			return 1;
+		}
+
+		close(pipe_in[0]);
+		close(pipe_in[1]);
+		close(pipe_out[0]);
+		close(pipe_out[1]);
+
+		if (setenv(CHILD_ENV, "yes", 1)) {
+			pr_perror("Can't set %s", CHILD_ENV);
+			return 1;
+		}
+
+		execl(argv[0], "sigpipe00_child", NULL);
+		pr_perror("Can't execute %s", argv[0]);
+		return 1;
+	}
+
+	close(pipe_in[0]);
+	close(pipe_out[1]);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, usr1_handler);
+
+	if (child_actions_dfl(pipe_in[1], pipe_out[0]) != 1) {
+		pr_err("Child's actions are not default before dump\n");
+		return 1;
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	ret = child_actions_dfl(pipe_in[1], pipe_out[0]);
+	if (ret < 0)
+		return 1;
+	if (ret != 1) {
+		fail("Child's SIGPIPE or SIGUSR1 action is not default");
+		return 1;
+	}
+
+	if (sig_dfl(SIGPIPE) || sig_dfl(SIGUSR1)) {
+		fail("Parent's actions are default");
+		return 1;
+	}
+
+	close(pipe_in[1]);
+	close(pipe_out[0]);
+
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait for the child");
+		return 1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fail("Child exited with %x", status);
+		return 1;
+	}
+
+	pass();
+	return 0;
+}
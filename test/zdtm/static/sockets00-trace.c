@@ -0,0 +1 @@
+sockets00.c
\ No newline at end of file
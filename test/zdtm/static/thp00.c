@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "zdtmtst.h"
+#include "get_smaps_bits.h"
+
+#ifndef MADV_HUGEPAGE
+# define MADV_HUGEPAGE 14
+#endif
+
+const char *test_doc	= "Check that an area with huge pages keeps them "
+			  "and its madvise bits after restore";
+const char *test_author	= "agent <agent@local>";
+
+#define HPAGE_SIZE	(2 << 20)
+#define MEM_SIZE	(4 * HPAGE_SIZE)
+
+/* The AnonHugePages of the vma at where, in kB */
+static long get_anon_huge(unsigned long where)
+{
+	unsigned long start, end;
+	long kb = -1;
+	bool found = false;
+	char buf[1024];
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f) {
+		pr_perror("Can't open smaps");
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "%lx-%lx", &start, &end) == 2) {
+			found = (start <= where && where < end);
+			continue;
+		}
+
+		if (found && sscanf(buf, "AnonHugePages: %ld kB", &kb) == 1)
+			break;
+	}
+
+	fclose(f);
+
+	if (kb < 0)
+		pr_err("No AnonHugePages for %lx\n", where);
+	return kb;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long orig_flags = 0, new_flags = 0;
+	unsigned long orig_madv = 0, new_madv = 0;
+	long orig_huge, new_huge;
+	uint32_t crc;
+	char *m, *area;
+
+	test_init(argc, argv);
+
+	m = mmap(NULL, MEM_SIZE + HPAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		pr_perror("Can't map memory");
+		return 1;
+	}
+
+	area = (char *)(((unsigned long)m + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1UL));
+	if (madvise(area, MEM_SIZE, MADV_HUGEPAGE)) {
+		pr_perror("Can't advise huge pages");
+		return 1;
+	}
+
+	crc = ~0;
+	datagen((uint8_t *)area, MEM_SIZE, &crc);
+
+	if (get_smaps_bits((unsigned long)area, &orig_flags, &orig_madv))
+		return 1;
+	orig_huge = get_anon_huge((unsigned long)area);
+	if (orig_huge < 0)
+		return 1;
+	test_msg("%ld kB in huge pages before dump\n", orig_huge);
+
+	test_daemon();
+	test_waitsig();
+
+	crc = ~0;
+	if (datachk((uint8_t *)area, MEM_SIZE, &crc)) {
+		fail("Memory is corrupted");
+		return 1;
+	}
+
+	if (get_smaps_bits((unsigned long)area, &new_flags, &new_madv))
+		return 1;
+	new_huge = get_anon_huge((unsigned long)area);
+	if (new_huge < 0)
+		return 1;
+	test_msg("%ld kB in huge pages after restore\n", new_huge);
+
+	if (orig_flags != new_flags) {
+		fail("Flags are changed %lx -> %lx", orig_flags, new_flags);
+		return 1;
+	}
+
+	if (orig_madv != new_madv) {
+		fail("Madvs are changed %lx -> %lx", orig_madv, new_madv);
+		return 1;
+	}
+
+	/* No huge pages on dump, e.g. with THP disabled, nothing to check */
+	if (orig_huge && !new_huge) {
+		fail("Huge pages are lost");
+		return 1;
+	}
+
+	pass();
+	return 0;
+}